@@ -19,11 +19,11 @@
 const char* YowsupInterfacePy =
 R"(
 from Yowsup.connectionmanager import YowsupConnectionManager
-from Yowsup.Contacts.contacts import WAContactsSyncRequest
-from Yowsup.Registration.v2.coderequest import WACodeRequest as WACodeRequestV2
-from Yowsup.Registration.v2.regrequest import WARegRequest as WARegRequestV2
 from Yowsup.Common.debugger import Debugger
+#Contact sync and registration are imported on first use, they are rarely needed
+#and pull in a lot of modules
 import signal
+import threading
 #Don't swallow SIGINT
 signal.signal(signal.SIGINT, signal.SIG_DFL)
 Debugger.enabled = False
@@ -39,24 +39,65 @@ def resultToString(result):
 
     return "\n".join(out)
 
-def createCallback(handler, sig):
-    return lambda *args: getattr(handler,sig)(*args)
+#Signals whose arguments do not fit the native listener as they are
+def resumeOffset(listener):
+    return lambda _hash, url, resumeFrom: listener(_hash, url, int(resumeFrom or 0))
+adapters = {"media_uploadRequestSuccess": resumeOffset}
 
-def init(handler):
-    #!don't use any methods on handler before returning!
+def init(listeners):
+    #listeners maps signal names to native functions, signals without one are not used
+    #!don't call any listener before returning!
     connectionManager = YowsupConnectionManager()
     connectionManager.setAutoPong(True)
     signalsInterface = connectionManager.getSignalsInterface()
     for sig in signalsInterface.signals:
-        signalsInterface.registerListener(sig, createCallback(handler, sig))
+        if sig in listeners:
+            listener = listeners[sig]
+            if sig in adapters:
+                listener = adapters[sig](listener)
+            signalsInterface.registerListener(sig, listener)
     return connectionManager
 
-def call(connectionManager,methodName,*args):
-    return connectionManager.getMethodsInterface().call(methodName, args)
+#Used instead of init() when a trace is replayed. Nothing is sent, every method
+#returns a made up message id
+offline = False
 
-def onSignal(i, *args):
-    print 'YI: Got signal ' + i
-    getattr(Emb, i)(*args)
+class OfflineMethodsInterface:
+    def __init__(self):
+        self.lastId = 0
+    def getCallback(self, methodName):
+        return lambda *args: self.call(methodName, args)
+    def call(self, methodName, args = ()):
+        self.lastId += 1
+        return "offline-%d" % self.lastId
+
+class OfflineConnectionManager:
+    def __init__(self):
+        self.methodsInterface = OfflineMethodsInterface()
+        self.readerThread = None
+    def getMethodsInterface(self):
+        return self.methodsInterface
+    def startReader(self):
+        self.readerThread = threading.Thread(target = lambda: None)
+        self.readerThread.start()
+
+def initOffline(listeners):
+    global offline
+    offline = True
+    return OfflineConnectionManager()
+
+#Returns the function behind a method of the methodsInterface, so that it can be
+#called without going through call() each time
+def resolveMethod(connectionManager, methodName):
+    methodsInterface = connectionManager.getMethodsInterface()
+    getCallback = getattr(methodsInterface, "getCallback", None)
+    callback = getCallback(methodName) if getCallback else None
+    if callback is None:
+        return lambda *args: methodsInterface.call(methodName, args)
+    return callback
+
+def getPictureIds(connectionManager, jids):
+    connectionManager.getMethodsInterface().call("picture_getIds", (jids,))
 
 def runThread(connectionManager):
     print 'In runThread'
@@ -64,6 +105,9 @@ def runThread(connectionManager):
     connectionManager.readerThread.join()
 
 def syncContact(login, password, contact):
+    if offline:
+        return 0
+    from Yowsup.Contacts.contacts import WAContactsSyncRequest
     wsync = WAContactsSyncRequest(login, password, (contact,))
     result = wsync.send()
     print resultToString(result)
@@ -71,19 +115,22 @@ def syncContact(login, password, contact):
     print "Returning ", ret
     return ret
 
-def syncContacts(login, password, contacts):
-    wsync = WAContactsSyncRequest(login, password, contacts.split(','))
+#Returns a (address, number, registered) tuple for each address the server knows
+def syncNumbers(login, password, addresses):
+    if offline:
+        return []
+    from Yowsup.Contacts.contacts import WAContactsSyncRequest
+    wsync = WAContactsSyncRequest(login, password, addresses.split(','))
     result = wsync.send()
     print resultToString(result)
     ret = []
     for i in result[u'c']:
-        if i[u'w']:
-            ret.append(i[u'n'].encode('utf-8'))
-    print "Returning ", ret
+        ret.append((i[u'p'].encode('utf-8'), i[u'n'].encode('utf-8'), bool(i[u'w'])))
     return ret
 
 def code_request(self, countryCode, phoneNumber, identity, useText):
     print "code_request entered ", countryCode, phoneNumber, identity, "sms" if(useText) else "voice"
+    from Yowsup.Registration.v2.coderequest import WACodeRequest as WACodeRequestV2
     we = WACodeRequestV2(countryCode, phoneNumber, identity, "sms" if(useText) else "voice")
     #result = we.send()
     #print resultToString(result)
@@ -91,6 +138,7 @@ def code_request(self, countryCode, phoneNumber, identity, useText):
     return u'123'
 
 def code_register(self, countryCode, phoneNumber, identity, code):
+    from Yowsup.Registration.v2.regrequest import WARegRequest as WARegRequestV2
     we = WARegRequestV2(countryCode, phoneNumber, code, identity)
     #result = we.send()
     #print resultToString(result)
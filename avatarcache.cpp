@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include "avatarcache.h"
+#include "jid.h"
+
+static const int MAX_FETCHES_IN_FLIGHT = 4;
+/* A fetch without answer after that long frees its slot */
+static const int FETCH_TIMEOUT_SECS = 60;
+static const int EXPIRY_INTERVAL_MS = 10*1000;
+
+AvatarCache::AvatarCache(const QString& directory, QObject* parent)
+    : QObject(parent), mDirectory(directory)
+{
+    QDir().mkpath(mDirectory);
+    mExpiryTimer.setInterval(EXPIRY_INTERVAL_MS);
+    QObject::connect(&mExpiryTimer, SIGNAL(timeout()), this, SLOT(expireFetches()));
+}
+
+/* The token names a file in the cache, so it is built from the parsed number only */
+QString AvatarCache::tokenFor(const QString& jid, int pictureId)
+{
+    Jid contact = Jid::parse(jid);
+    if(!contact.isContact())
+        return QString();
+    return QString::number(contact.user()) + "-" + QString::number(pictureId);
+}
+
+QString AvatarCache::path(const QString& token) const
+{
+    return mDirectory + "/" + token;
+}
+
+void AvatarCache::request(const QString& jid, const QString& token)
+{
+    if(token.isEmpty())
+        return;
+
+    QFile file(path(token));
+    if(file.open(QIODevice::ReadOnly)) {
+        emit avatarRetrieved(jid, token, file.readAll());
+        return;
+    }
+
+    /* Already being fetched or waiting for it */
+    auto i = mInFlight.find(jid);
+    if(i != mInFlight.end() && i->token == token)
+        return;
+    if(mQueuedJids.contains(token))
+        return;
+
+    mQueuedJids[token] = jid;
+    mQueue.enqueue(token);
+    pump();
+}
+
+void AvatarCache::pump()
+{
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    /* Tokens of contacts with a fetch in flight stay queued, in order */
+    QQueue<QString> waiting;
+    while(!mQueue.isEmpty() && mInFlight.size() < MAX_FETCHES_IN_FLIGHT) {
+        QString token = mQueue.dequeue();
+        QString jid = mQueuedJids.value(token);
+        /* Only one fetch per contact, as the answer does not carry the picture id */
+        if(mInFlight.contains(jid)) {
+            waiting.enqueue(token);
+            continue;
+        }
+        mQueuedJids.remove(token);
+        Fetch fetch;
+        fetch.token = token;
+        fetch.started = now;
+        mInFlight[jid] = fetch;
+        emit fetchRequested(jid);
+    }
+    for(int i = waiting.size()-1; i >= 0; --i)
+        mQueue.prepend(waiting[i]);
+
+    if(mInFlight.isEmpty())
+        mExpiryTimer.stop();
+    else if(!mExpiryTimer.isActive())
+        mExpiryTimer.start();
+}
+
+void AvatarCache::expireFetches()
+{
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    for(auto i = mInFlight.begin(); i != mInFlight.end();) {
+        if(i->started.secsTo(now) > FETCH_TIMEOUT_SECS) {
+            qDebug() << "AvatarCache: fetch of " << i->token << " timed out";
+            i = mInFlight.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    pump();
+}
+
+/* Pictures of the same contact under earlier picture ids are never asked for again */
+void AvatarCache::removeOlder(const QString& token)
+{
+    QString prefix = token.section('-', 0, 0) + "-";
+    QDir directory(mDirectory);
+    for(const QString& name : directory.entryList(QStringList() << prefix + "*", QDir::Files)) {
+        if(name == token || mQueuedJids.contains(name))
+            continue;
+        qDebug() << "AvatarCache: removing " << name;
+        directory.remove(name);
+    }
+}
+
+QSet<QString> AvatarCache::jids() const
+{
+    return mQueuedJids.values().toSet() + mInFlight.keys().toSet();
+}
+
+void AvatarCache::fetched(const QString& jid, const QString& filename)
+{
+    auto i = mInFlight.find(jid);
+    if(i == mInFlight.end()) {
+        qDebug() << "AvatarCache::fetched: unexpected picture for " << jid;
+        return;
+    }
+    QString token = i->token;
+    mInFlight.erase(i);
+
+    QFile file(filename);
+    if(!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "AvatarCache::fetched: cannot read " << filename;
+        pump();
+        return;
+    }
+    QByteArray data = file.readAll();
+    file.close();
+
+    /* Write to a temporary file first, so that a crash does not leave a truncated picture */
+    QFile cached(path(token) + ".tmp");
+    if(cached.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        cached.write(data);
+        cached.close();
+        QFile::remove(path(token));
+        cached.rename(path(token));
+        removeOlder(token);
+    }
+
+    emit avatarRetrieved(jid, token, data);
+    pump();
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QDateTime>
+#include <QHash>
+#include <QObject>
+#include <QQueue>
+#include <QSet>
+#include <QTimer>
+
+/*
+ * On-disk cache of contact pictures, keyed by avatar token.
+ *
+ * The token of a picture is derived from the contact's number and WhatsApp's
+ * picture id, so it changes exactly when the picture changes. Pictures that
+ * are not cached yet are fetched with at most MAX_FETCHES_IN_FLIGHT requests
+ * outstanding, and concurrent requests for the same token are merged.
+ * Storing a contact's picture removes the ones it replaced, so the cache holds
+ * at most one picture per contact.
+ */
+class AvatarCache : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(AvatarCache)
+public:
+    AvatarCache(const QString& directory, QObject* parent = 0);
+
+    /* Empty if jid is not a valid contact id */
+    static QString tokenFor(const QString& jid, int pictureId);
+
+    /* Emits avatarRetrieved, either right away from the cache or after fetching it */
+    void request(const QString& jid, const QString& token);
+    /* Yowsup stored the picture of jid in filename */
+    void fetched(const QString& jid, const QString& filename);
+    /* Contacts whose pictures are queued or being fetched */
+    QSet<QString> jids() const;
+
+signals:
+    /* Fetch the picture of jid, answer with fetched() */
+    void fetchRequested(const QString& jid);
+    void avatarRetrieved(const QString& jid, const QString& token, const QByteArray& data);
+
+private slots:
+    void expireFetches();
+
+private:
+    QString path(const QString& token) const;
+    void removeOlder(const QString& token);
+    void pump();
+
+    QString mDirectory;
+    /* Tokens waiting for a free slot, and the jid of each */
+    QQueue<QString> mQueue;
+    QHash<QString,QString> mQueuedJids;
+    struct Fetch {
+        QString token;
+        QDateTime started;
+    };
+    /* jid -> running fetch */
+    QHash<QString,Fetch> mInFlight;
+    /* Runs while fetches are in flight */
+    QTimer mExpiryTimer;
+};
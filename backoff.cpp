@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+#include <random>
+#include <QtGlobal>
+#include "backoff.h"
+
+int backoffDelayMs(int attempt, int baseMs, int maxMs)
+{
+    /* Seeded per process, clients restarted together must not draw the same delays */
+    static std::mt19937 random((std::random_device())());
+
+    qint64 delay = std::min(qint64(baseMs) << std::min(std::max(attempt, 0), 30), qint64(maxMs));
+    std::uniform_int_distribution<qint64> jitter(0, delay/2);
+    return int(delay - jitter(random));
+}
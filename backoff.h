@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+/*
+ * Exponential backoff with jitter, so that all clients do not reconnect at the
+ * same time after a server outage.
+ *
+ * The delay before the given attempt (counting from 0) is baseMs * 2^attempt,
+ * capped at maxMs, of which a random half is taken off.
+ */
+int backoffDelayMs(int attempt, int baseMs, int maxMs);
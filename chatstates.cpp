@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QDateTime>
+#include <TelepathyQt/Constants>
+#include "chatstates.h"
+
+using namespace Tp;
+
+static const int WHEEL_TICK_MS = 250;
+static const int WHEEL_SLOTS = 128;
+
+static const int REMOTE_MIN_INTERVAL_MS = 500;
+/* WhatsApp does not always send "paused" */
+static const int REMOTE_TYPING_TIMEOUT_MS = 15000;
+static const int LOCAL_TYPING_REFRESH_MS = 10000;
+static const int LOCAL_PAUSE_DELAY_MS = 1000;
+
+/* Prefixes of the wheel keys */
+static const QString REMOTE_HOLD = "r:";
+static const QString REMOTE_EXPIRY = "x:";
+static const QString LOCAL_PAUSE = "l:";
+
+ChatStates::Conversation::Conversation()
+    : remoteState(ChannelChatStateActive), pendingRemoteState(ChannelChatStateActive),
+      remoteHeld(false), localComposing(false), lastTypingSentMs(0)
+{
+}
+
+ChatStates::ChatStates(QObject* parent) : QObject(parent)
+{
+    mWheel = new TimerWheel(WHEEL_TICK_MS, WHEEL_SLOTS, this);
+    mWheel->setObjectName("wheel");
+    QMetaObject::connectSlotsByName(this);
+}
+
+void ChatStates::remoteTyping(const QString& jid)
+{
+    setRemoteState(jid, ChannelChatStateComposing);
+    mWheel->schedule(REMOTE_EXPIRY + jid, REMOTE_TYPING_TIMEOUT_MS);
+}
+
+void ChatStates::remotePaused(const QString& jid)
+{
+    setRemoteState(jid, ChannelChatStatePaused);
+    if(mConversations.contains(jid))
+        mWheel->schedule(REMOTE_EXPIRY + jid, REMOTE_TYPING_TIMEOUT_MS);
+}
+
+void ChatStates::remoteMessage(const QString& jid)
+{
+    mWheel->cancel(REMOTE_EXPIRY + jid);
+    setRemoteState(jid, ChannelChatStateActive);
+}
+
+void ChatStates::setRemoteState(const QString& jid, uint state)
+{
+    auto i = mConversations.find(jid);
+    if(i == mConversations.end()) {
+        /* Only composing starts a conversation */
+        if(state != ChannelChatStateComposing)
+            return;
+        i = mConversations.insert(jid, Conversation());
+    }
+    Conversation& conversation = i.value();
+
+    if(conversation.remoteHeld) {
+        conversation.pendingRemoteState = state;
+        return;
+    }
+    if(conversation.remoteState == state)
+        return;
+
+    conversation.remoteState = conversation.pendingRemoteState = state;
+    conversation.remoteHeld = true;
+    mWheel->schedule(REMOTE_HOLD + jid, REMOTE_MIN_INTERVAL_MS);
+    emit remoteStateChanged(jid, state);
+}
+
+void ChatStates::setLocalState(const QString& jid, uint state)
+{
+    Conversation& conversation = mConversations[jid];
+    if(state == ChannelChatStateComposing) {
+        mWheel->cancel(LOCAL_PAUSE + jid);
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+        if(!conversation.localComposing || now - conversation.lastTypingSentMs >= LOCAL_TYPING_REFRESH_MS) {
+            conversation.localComposing = true;
+            conversation.lastTypingSentMs = now;
+            emit sendTyping(jid);
+        }
+    } else if(conversation.localComposing) {
+        /* Clients flap between composing and paused while the user types */
+        if(!mWheel->isScheduled(LOCAL_PAUSE + jid))
+            mWheel->schedule(LOCAL_PAUSE + jid, LOCAL_PAUSE_DELAY_MS);
+    } else {
+        forgetIfIdle(jid);
+    }
+}
+
+void ChatStates::on_wheel_expired(const QString& key)
+{
+    QString jid = key.mid(2);
+    auto i = mConversations.find(jid);
+    if(i == mConversations.end())
+        return;
+    Conversation& conversation = i.value();
+
+    if(key.startsWith(REMOTE_HOLD)) {
+        conversation.remoteHeld = false;
+        if(conversation.pendingRemoteState != conversation.remoteState)
+            setRemoteState(jid, conversation.pendingRemoteState);
+    } else if(key.startsWith(REMOTE_EXPIRY)) {
+        setRemoteState(jid, ChannelChatStateActive);
+    } else if(key.startsWith(LOCAL_PAUSE)) {
+        if(conversation.localComposing) {
+            conversation.localComposing = false;
+            emit sendPaused(jid);
+        }
+    }
+    forgetIfIdle(jid);
+}
+
+/* Keeps memory bounded by the number of conversations with activity */
+void ChatStates::forgetIfIdle(const QString& jid)
+{
+    auto i = mConversations.find(jid);
+    if(i == mConversations.end())
+        return;
+    const Conversation& conversation = i.value();
+    if(conversation.remoteState == ChannelChatStateActive && !conversation.remoteHeld
+       && !conversation.localComposing
+       && !mWheel->isScheduled(REMOTE_EXPIRY + jid) && !mWheel->isScheduled(LOCAL_PAUSE + jid))
+        mConversations.erase(i);
+}
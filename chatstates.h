@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include "timerwheel.h"
+
+/*
+ * Coalesces and rate-limits chat states (typing notifications) in both directions.
+ *
+ * Remote: state changes of a conversation are signalled at most once per
+ * REMOTE_MIN_INTERVAL_MS, intermediate states collapse into the last one.
+ * Composing and paused states that are not followed by anything else expire
+ * into active.
+ *
+ * Local: typing_send is repeated at most once per LOCAL_TYPING_REFRESH_MS while
+ * composing, and typing_paused is only sent if composing did not resume within
+ * LOCAL_PAUSE_DELAY_MS.
+ *
+ * All timeouts of all conversations share one TimerWheel.
+ */
+class ChatStates : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ChatStates)
+public:
+    ChatStates(QObject* parent = 0);
+
+    /* From yowsup */
+    void remoteTyping(const QString& jid);
+    void remotePaused(const QString& jid);
+    /* A message arrived, so the contact is done typing it */
+    void remoteMessage(const QString& jid);
+    /* From a client, Tp::ChannelChatState */
+    void setLocalState(const QString& jid, uint state);
+    int conversationCount() const { return mConversations.size(); }
+    /* Contacts with a state or timeout pending */
+    QSet<QString> jids() const { return mConversations.keys().toSet(); }
+
+signals:
+    void remoteStateChanged(const QString& jid, uint state);
+    void sendTyping(const QString& jid);
+    void sendPaused(const QString& jid);
+
+private slots:
+    void on_wheel_expired(const QString& key);
+
+private:
+    void setRemoteState(const QString& jid, uint state);
+    void forgetIfIdle(const QString& jid);
+
+    struct Conversation {
+        Conversation();
+        /* Last state signalled to clients */
+        uint remoteState;
+        /* State to signal when the rate limit allows it */
+        uint pendingRemoteState;
+        bool remoteHeld;
+        /* Whether we told the server that we are typing */
+        bool localComposing;
+        qint64 lastTypingSentMs;
+    };
+    QHash<QString,Conversation> mConversations;
+    TimerWheel* mWheel;
+};
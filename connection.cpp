@@ -18,20 +18,51 @@
 
 #include <algorithm>
 #include <QDebug>
+#include <QDir>
+#include <QMimeDatabase>
+#include <QUrl>
+#include <QStandardPaths>
 #include <TelepathyQt/Constants>
+#include "backoff.h"
 #include "connection.h"
+#include "phonenumber.h"
 #include "protocol.h"
 
 using namespace Tp;
 using namespace std;
 namespace python = boost::python;
 
+/* Text channels idle for that long are closed, see reapChannels() */
+static const uint DEFAULT_CHANNEL_IDLE_SECS = 30*60;
+static const uint DEFAULT_MEDIA_DOWNLOAD_LIMIT = 0;
+static const int CHANNEL_REAP_INTERVAL_MS = 60*1000;
+
+/* Budget for received messages waiting in channels for a client to ack them */
+static const int MAX_PENDING_PER_CHANNEL = 500;
+static const qint64 MAX_PENDING_BYTES = 16*1024*1024;
+
+/* Unused transient contacts are dropped after 3 to 4 sweeps, i.e. 30 to 40 minutes */
+static const int HANDLE_SWEEP_INTERVAL_MS = 10*60*1000;
+static const uint HANDLE_GRACE_SWEEPS = 3;
+/* Time without answers after which outstanding group requests are given up */
+static const int GROUP_FETCH_TIMEOUT_MS = 15000;
+/* Time the reader of a lost connection gets to exit before the new one is given up */
+static const int READER_EXIT_TIMEOUT_MS = 2000;
+
 YSConnection::YSConnection( const QDBusConnection &  	dbusConnection,
                             const QString &  	cmName,
                             const QString &  	protocolName,
                             const QVariantMap &  	parameters
                             ) : BaseConnection(dbusConnection, cmName, protocolName, parameters),
+                                mLastHandle(0),
+                                mSweepGeneration(0),
+                                mPendingMessages(MAX_PENDING_PER_CHANNEL, MAX_PENDING_BYTES),
                                 lastMessageId(1),
+                                mReconnectAttempts(0),
+                                mResuming(false),
+                                mLastOutageMs(-1),
+                                mGroupFetchErrors(0),
+                                mRoomListCompleteMs(-1),
                                 yowsupInterface(this)
 {
     qDebug() << "YSConnection::YSConnection proto: " << protocolName
@@ -40,9 +71,17 @@ YSConnection::YSConnection( const QDBusConnection &  	dbusConnection,
         mPhoneNumber = parameters["account"].toString();
     if(parameters.contains("password"))
         mPassword = QByteArray::fromBase64( parameters["password"].toString().toLatin1() );
-
+    /* 0 keeps channels open until a client closes them */
+    mChannelIdleMs = parameters.value("channel-idle-timeout", DEFAULT_CHANNEL_IDLE_SECS).toUInt() * 1000LL;
+    /* 0 leaves downloading media to the clients */
+    mMediaMaxSize = parameters.value("media-download-limit", DEFAULT_MEDIA_DOWNLOAD_LIMIT).toUInt();
+    /* For national numbers in the address book */
+    mCountryCode = PhoneNumber::countryCode(mPhoneNumber);
+
+    /* Protocol::createConnection() normalized the account, connect() refuses it otherwise */
     selfHandle = addContact(mPhoneNumber + "@s.whatsapp.net");
-    assert(selfHandle == 1);
+    if(!selfHandle)
+        qWarning() << "YSConnection::YSConnection: invalid account " << mPhoneNumber;
 
     setSelfHandle(selfHandle);
 
@@ -76,7 +115,8 @@ YSConnection::YSConnection( const QDBusConnection &  	dbusConnection,
     contactsIface->setContactAttributeInterfaces(QStringList()
                                                  << QLatin1String("org.freedesktop.Telepathy.Connection")
                                                  << QLatin1String("org.freedesktop.Telepathy.Connection.Interface.ContactList")
-                                                 << TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE);
+                                                 << TP_QT_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE
+                                                 << TP_QT_IFACE_CONNECTION_INTERFACE_AVATARS);
     plugInterface(AbstractConnectionInterfacePtr::dynamicCast(contactsIface));
 
     /* Connection.Interface.SimplePresence */
@@ -96,14 +136,120 @@ YSConnection::YSConnection( const QDBusConnection &  	dbusConnection,
     addressingIface->setGetContactsByURICallback( Tp::memFun(this,&YSConnection::getContactsByURI) );
     plugInterface(AbstractConnectionInterfacePtr::dynamicCast(addressingIface));
 
+    /* WHOSTHERE_RECORD=<directory> records everything yowsup signals to a trace,
+     * WHOSTHERE_REPLAY=<trace> replays one without connecting to the server */
+    mTraceRecorder = 0;
+    mTraceReplayer = 0;
+    QString replayFile = QString::fromLocal8Bit(qgetenv("WHOSTHERE_REPLAY"));
+    QString recordDirectory = QString::fromLocal8Bit(qgetenv("WHOSTHERE_RECORD"));
+    if(!replayFile.isEmpty()) {
+        /* 0 replays as fast as possible */
+        bool ok;
+        double speed = qgetenv("WHOSTHERE_REPLAY_SPEED").toDouble(&ok);
+        mTraceReplayer = new TraceReplayer(replayFile, ok ? speed : 1.0, &yowsupInterface, this);
+        mTraceReplayer->setObjectName("replay");
+    } else if(!recordDirectory.isEmpty()) {
+        QDir().mkpath(recordDirectory);
+        mTraceRecorder = new TraceRecorder(recordDirectory + "/"
+                                           + QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss-zzz") + ".trace",
+                                           qgetenv("WHOSTHERE_RECORD_ANONYMIZE") == "1");
+        yowsupInterface.setRecorder(mTraceRecorder);
+    }
+
+    /* A replay starts from empty journal, caches and indexes and leaves the account's alone */
+    QString dataDirectory = QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)
+                            + "/telepathy-whosthere";
+    QString cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+                             + "/telepathy-whosthere";
+    mReplayDirectory = 0;
+    if(mTraceReplayer) {
+        mReplayDirectory = new QTemporaryDir;
+        dataDirectory = cacheDirectory = mReplayDirectory->path();
+    }
+
+    /* Connection.Interface.Avatars */
+    avatarsIface = BaseConnectionAvatarsInterface::create();
+    avatarsIface->setAvatarDetails(Protocol::getAvatarSpec());
+    avatarsIface->setGetKnownAvatarTokensCallback( Tp::memFun(this,&YSConnection::getKnownAvatarTokens) );
+    avatarsIface->setRequestAvatarsCallback( Tp::memFun(this,&YSConnection::requestAvatars) );
+    plugInterface(AbstractConnectionInterfacePtr::dynamicCast(avatarsIface));
+    mAvatarCache = new AvatarCache(cacheDirectory + "/avatars", this);
+    mAvatarCache->setObjectName("avatars");
+
+    mChatStates = new ChatStates(this);
+    mChatStates->setObjectName("chatstates");
+
+    /* Shared by all accounts, only the index is per account */
+    mMediaFetcher = 0;
+    if(mMediaMaxSize > 0) {
+        QString mediaDirectory = cacheDirectory + "/media";
+        mMediaFetcher = new MediaFetcher(mediaDirectory, mediaDirectory + "/" + mPhoneNumber + ".index", this);
+        mMediaFetcher->setObjectName("media");
+    }
+
+    /* Journal of received messages, replayed into channels after connecting */
+    mJournal = new MessageJournal(dataDirectory + "/" + mPhoneNumber + "/messages.journal", this);
+    mJournal->setObjectName("journal");
+    mContactSync = new ContactSyncCache(dataDirectory + "/" + mPhoneNumber + "/contacts.sync");
+    mJournal->open(&mReplayEntries);
+    for(const MessageJournal::Entry& entry : mReplayEntries)
+        mReceivedMessages.seen(entry.senderId, MessageJournal::msgIdOf(entry.token));
+
     /* Python interface to yowsup */
-    pythonInterface = new PythonInterface(&yowsupInterface);
+    pythonInterface = new PythonInterface(&yowsupInterface, mTraceReplayer != 0);
     yowsupInterface.setObjectName("yowsup");
+
+    mOutgoingQueue = new OutgoingQueue(pythonInterface, this);
+    mOutgoingQueue->setObjectName("outgoing");
+    mMediaUploader = new MediaUploader(mPhoneNumber, this);
+    mMediaUploader->setObjectName("uploads");
+
+    mLinkMonitor = new LinkMonitor(&yowsupInterface, this);
+    mLinkMonitor->setObjectName("link");
+    mMetrics = new ConnectionMetrics(this);
+
+    mReconnectTimer.setSingleShot(true);
+    QObject::connect(&mReconnectTimer, SIGNAL(timeout()), this, SLOT(reconnect()));
+    mReaderExitTimer.setSingleShot(true);
+    mReaderExitTimer.setInterval(READER_EXIT_TIMEOUT_MS);
+    QObject::connect(&mReaderExitTimer, SIGNAL(timeout()), this, SLOT(readerExitTimedOut()));
+
+    mPresenceFlushTimer.setSingleShot(true);
+    mPresenceFlushTimer.setInterval(0);
+    QObject::connect(&mPresenceFlushTimer, SIGNAL(timeout()), this, SLOT(flushPresences()));
+
+    mGroupIngestTimer.setSingleShot(true);
+    mGroupIngestTimer.setInterval(0);
+    QObject::connect(&mGroupIngestTimer, SIGNAL(timeout()), this, SLOT(ingestGroupInfos()));
+
+    mGroupFetchTimeout.setSingleShot(true);
+    mGroupFetchTimeout.setInterval(GROUP_FETCH_TIMEOUT_MS);
+    QObject::connect(&mGroupFetchTimeout, SIGNAL(timeout()), this, SLOT(groupFetchTimedOut()));
+
+    mRoomListTimer.setInterval(0);
+    QObject::connect(&mRoomListTimer, SIGNAL(timeout()), this, SLOT(sendRoomListPages()));
+
+    if(mChannelIdleMs > 0) {
+        mChannelReapTimer.setInterval(CHANNEL_REAP_INTERVAL_MS);
+        QObject::connect(&mChannelReapTimer, SIGNAL(timeout()), this, SLOT(reapChannels()));
+        mChannelReapTimer.start();
+    }
+
+    mHandleSweepTimer.setInterval(HANDLE_SWEEP_INTERVAL_MS);
+    QObject::connect(&mHandleSweepTimer, SIGNAL(timeout()), this, SLOT(reclaimHandles()));
+    mHandleSweepTimer.start();
     QMetaObject::connectSlotsByName(this);
 }
 
 YSConnection::~YSConnection() {
+    /* Send out acks for everything that made it to disk */
+    mJournal->commit();
     delete pythonInterface;
+    yowsupInterface.setRecorder(0);
+    delete mTraceRecorder;
+    delete mContactSync;
+    delete mReplayDirectory;
+    dbusConnection().unregisterObject(objectPath() + "/Debug");
 }
 
 /* I wanted one connection per account, but the account manager
@@ -117,8 +263,16 @@ QString YSConnection::uniqueName() const {
 void YSConnection::connect(Tp::DBusError *error) {
     qDebug() << "Thread id connect " << QThread::currentThreadId();
     qDebug() << "YSConnection::connect";
+    if(!selfHandle) {
+        error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("account is not a valid WhatsApp id"));
+        return;
+    }
     setStatus(ConnectionStatusConnecting, ConnectionStatusReasonRequested);
 
+    /* The connection is on the bus by now */
+    if(!dbusConnection().registerObject(objectPath() + "/Debug", mMetrics, QDBusConnection::ExportScriptableSlots))
+        qDebug() << "YSConnection::connect: metrics not exported";
+
 #ifdef USE_CAPTCHA_FOR_REGISTRATION
     /* Clear pointer from a previous registration */
     captchaIface.reset();
@@ -126,6 +280,9 @@ void YSConnection::connect(Tp::DBusError *error) {
 
     if(mPassword.length() > 0 ) {
         pythonInterface->call("auth_login", mPhoneNumber, mPassword );
+        /* The trace brings its own auth_success */
+        if(mTraceReplayer && !mTraceReplayer->isRunning())
+            mTraceReplayer->start();
     } else {
 #ifdef USE_CAPTCHA_FOR_REGISTRATION
         qDebug() << "Opening registration";
@@ -247,13 +404,13 @@ QStringList YSConnection::inspectHandles(uint handleType, const Tp::UIntList& ha
 
     if( handleType == Tp::HandleTypeContact || handleType == HandleTypeRoom) {
         for( uint handle : handles ) {
-            auto i = mHandles.left.find(handle);
-            if( i == mHandles.left.end() ) {
+            if( !mHandles.contains(handle) ) {
                 error->set(TP_QT_ERROR_INVALID_HANDLE,"Handle not found");
                 return QStringList();
             }
-            qDebug() << "inspectHandles " << handle << " = " << i->second;
-            ret.append( i->second );
+            QString id = mHandles.use(handle, mSweepGeneration).toString();
+            qDebug() << "inspectHandles " << handle << " = " << id;
+            ret.append( id );
         }
         return ret;
     } else if(handleType == HandleTypeNone) {
@@ -278,50 +435,61 @@ Tp::ContactAttributesMap YSConnection::getContactAttributes(const Tp::UIntList&
 {
     Tp::ContactAttributesMap ret;
     for( uint handle : handles ) {
-        auto i = mHandles.left.find(handle);
-        if( i == mHandles.left.end())
-            continue;
-        if( !isContactId(i->second) )
-            continue;
-        qDebug() << "getContactAttributes " << handle << " = " << i->second;
-        QVariantMap attributes;
-        //org.freedesktop.Telepathy.Connection.Interface.SimplePresence/presence
-        attributes["org.freedesktop.Telepathy.Connection/contact-id"] = i->second;
-        if(handle != selfHandle) {
-            attributes["org.freedesktop.Telepathy.Connection.Interface.ContactList/subscribe"] = mContactsSubscription[handle];
-            attributes["org.freedesktop.Telepathy.Connection.Interface.ContactList/publish"] = SubscriptionStateYes;
-            attributes["org.freedesktop.Telepathy.Connection.Interface.SimplePresence/presence"] = QVariant::fromValue( getPresence(handle) );
-        }
-        ret[handle] = attributes;
+        mHandles.use(handle, mSweepGeneration);
+        QVariantMap attributes = contactAttributes(handle);
+        if( !attributes.isEmpty() )
+            ret[handle] = attributes;
     }
-    qDebug() << "YSConnection::getContactAttributes " << handles
-             << " = " << ret;
+    qDebug() << "YSConnection::getContactAttributes: " << ret.size() << " of " << handles.size() << " handles";
     return ret;
 
 }
 
+/* The roster is kept up to date as contacts change, and handed out as a shared copy */
 Tp::ContactAttributesMap YSConnection::getContactListAttributes(const QStringList& interfaces,
                                                                 bool /*hold*/, Tp::DBusError* /*error*/)
 {
-    Tp::ContactAttributesMap contactAttributeMap;
-    for( auto i : mHandles.left )
-    {
-        uint handle = i.first;
-        if(handle == selfHandle)
-            continue;
-        if( !isContactId(i.second) )
-            continue;
+    for( uint handle : mChangedContacts ) {
         QVariantMap attributes;
-        //org.freedesktop.Telepathy.Connection.Interface.ContactList/subscribe
-        attributes["org.freedesktop.Telepathy.Connection/contact-id"] = i.second;
-        attributes["org.freedesktop.Telepathy.Connection.Interface.ContactList/subscribe"] = mContactsSubscription[handle];
+        if( handle != selfHandle )
+            attributes = contactAttributes(handle);
+        if( attributes.isEmpty() )
+            mContactList.remove(handle);
+        else
+            mContactList[handle] = attributes;
+    }
+    mChangedContacts.clear();
+    qDebug() << "YSConnection::getContactListAttributes " << interfaces
+             << ": " << mContactList.size() << " contacts";
+    return mContactList;
+}
+
+/* Attributes of a contact, cached until contactChanged(). Empty if handle is not a contact */
+QVariantMap YSConnection::contactAttributes(uint handle) {
+    auto i = mContactAttributes.find(handle);
+    if( i != mContactAttributes.end() )
+        return i.value();
+
+    Jid jid = mHandles.jid(handle);
+    if( !jid.isContact() )
+        return QVariantMap();
+    QVariantMap attributes;
+    attributes["org.freedesktop.Telepathy.Connection/contact-id"] = jid.toString();
+    if(handle != selfHandle) {
+        attributes["org.freedesktop.Telepathy.Connection.Interface.ContactList/subscribe"] = mContactsSubscription.value(handle);
         attributes["org.freedesktop.Telepathy.Connection.Interface.ContactList/publish"] = SubscriptionStateYes;
         attributes["org.freedesktop.Telepathy.Connection.Interface.SimplePresence/presence"] = QVariant::fromValue( getPresence(handle) );
-        contactAttributeMap[handle] = attributes;
     }
-    qDebug() << "YSConnection::getContactListAttributesCallback " << interfaces
-             << " = " << contactAttributeMap;
-    return contactAttributeMap;
+    auto token = mAvatarTokens.find(handle);
+    if(token != mAvatarTokens.end())
+        attributes["org.freedesktop.Telepathy.Connection.Interface.Avatars/token"] = token.value();
+    mContactAttributes.insert(handle, attributes);
+    return attributes;
+}
+
+void YSConnection::contactChanged(uint handle) {
+    mContactAttributes.remove(handle);
+    mChangedContacts.insert(handle);
 }
 
 void YSConnection::requestSubscription(const Tp::UIntList& contacts,
@@ -353,6 +521,7 @@ Tp::UIntList YSConnection::requestHandles(uint handleType, const QStringList& id
         return ret;
     }
 
+    QStringList newContacts;
     for( const QString& identifier : identifiers ) {
 
         if(( handleType == Tp::HandleTypeContact && !isContactId(identifier) )
@@ -361,20 +530,21 @@ Tp::UIntList YSConnection::requestHandles(uint handleType, const QStringList& id
             return ret;
         }
 
-        auto i = mHandles.right.find(identifier);
-        if( i == mHandles.right.end()) {
-            if(handleType == Tp::HandleTypeContact && isValidContact(identifier)) {
-                //Check if that identifier is at whatsapp
-                ret.push_back(addContact(identifier));
-            } else {
-                qDebug() << "YSConnection::requestHandles: id invalid " << identifier;
-                error->set(TP_QT_ERROR_INVALID_HANDLE,"Handle not found");
-                return Tp::UIntList();
-            }
-        } else {
-            ret.push_back(i->second);
+        if( getHandle(identifier) )
+            continue;
+        //Check if that identifier is at whatsapp
+        if( handleType != Tp::HandleTypeContact || !isValidContact(identifier) ) {
+            qDebug() << "YSConnection::requestHandles: id invalid " << identifier;
+            error->set(TP_QT_ERROR_INVALID_HANDLE,"Handle not found");
+            return Tp::UIntList();
         }
+        newContacts << identifier;
     }
+    /* All new contacts in one go, so that clients get one change signal */
+    ensureContacts(newContacts);
+
+    for( const QString& identifier : identifiers )
+        ret.push_back(getHandle(identifier));
 
     qDebug() << "YSConnection::requestHandles " << identifiers
              << " = " << ret;
@@ -396,6 +566,9 @@ Tp::BaseChannelPtr YSConnection::createChannel(const QString& channelType, uint
         roomListType->setListRoomsCallback( [this, roomListType] (Tp::DBusError* error) {
                                                         listRooms( roomListType, error) ;
                                              } );
+        roomListType->setStopListingCallback( [this, roomListType] (Tp::DBusError* error) {
+                                                        stopListingRooms( roomListType, error) ;
+                                             } );
         baseChannel->plugInterface(AbstractChannelInterfacePtr::dynamicCast(roomListType));
         return baseChannel;
     }
@@ -406,12 +579,11 @@ Tp::BaseChannelPtr YSConnection::createChannel(const QString& channelType, uint
         return BaseChannelPtr();
     }
 
-    auto i = mHandles.left.find(targetHandle);
-    if( i == mHandles.left.end() ) {
+    if( !mHandles.contains(targetHandle) ) {
         error->set(TP_QT_ERROR_INVALID_HANDLE,"Handle not found");
         return BaseChannelPtr();
     }
-    QString id = i->second;
+    QString id = mHandles.use(targetHandle, mSweepGeneration).toString();
 
     if( targetHandleType != getType(id) ) {
         qDebug() << "Type mismatch " << targetHandleType << " " << getType(id);
@@ -441,6 +613,20 @@ Tp::BaseChannelPtr YSConnection::createChannel(const QString& channelType, uint
                         return sendMessage(id, message, flags, error );
                     });
         baseChannel->plugInterface(AbstractChannelInterfacePtr::dynamicCast(messagesIface));
+        textType->setMessageAcknowledgedCallback(Tp::memFun(this,&YSConnection::messageAcknowledged));
+        /* Missed the close of the previous one */
+        if(mTextChannels.contains(targetHandle) && !BaseChannelPtr(mTextChannels[targetHandle]))
+            releasePending(targetHandle);
+        mTextChannels[targetHandle] = Tp::WeakPtr<BaseChannel>(baseChannel);
+        QObject::connect(baseChannel.data(), SIGNAL(closed()), this, SLOT(textChannelClosed()));
+        touchChannel(targetHandle);
+
+        BaseChannelChatStateInterfacePtr chatStateIface = BaseChannelChatStateInterface::create();
+        chatStateIface->setSetChatStateCallback(
+                    [this, id] (uint state, Tp::DBusError* /*error*/) {
+                        mChatStates->setLocalState(id, state);
+                    });
+        baseChannel->plugInterface(AbstractChannelInterfacePtr::dynamicCast(chatStateIface));
     }
 
     if(targetHandleType == Tp::HandleTypeRoom) {
@@ -449,8 +635,15 @@ Tp::BaseChannelPtr YSConnection::createChannel(const QString& channelType, uint
         BaseChannelGroupInterfacePtr groupIface = BaseChannelGroupInterface::create(flags, selfHandle);
         //groupIface->setAddMembersCallback(); FIXME
         //groupIface->setRemoveMembersCallback();
-        groupIface->addMembers(Tp::UIntList() << selfHandle,
-                               QStringList() << getIdentifier(selfHandle));
+        Tp::UIntList members = Tp::UIntList() << selfHandle;
+        QStringList memberIds = QStringList() << getIdentifier(selfHandle);
+        for(uint member : mRoomMembers.members(targetHandle)) {
+            if(member == selfHandle)
+                continue;
+            members << member;
+            memberIds << getIdentifier(member);
+        }
+        groupIface->addMembers(members, memberIds);
         baseChannel->plugInterface( AbstractChannelInterfacePtr::dynamicCast(groupIface) );
 
         if(rooms.contains(targetHandle)) {
@@ -465,7 +658,7 @@ Tp::BaseChannelPtr YSConnection::createChannel(const QString& channelType, uint
             BaseChannelSubjectInterfacePtr subjectIface = BaseChannelSubjectInterface::create();
             subjectIface->setSubject( room.subject );
             subjectIface->setActor( room.subjectOwner );
-            subjectIface->setActorHandle( ensureContact(room.subjectOwner) );
+            subjectIface->setActorHandle( isContactId(room.subjectOwner) ? ensureContact(room.subjectOwner) : 0 );
             subjectIface->setTimestamp( room.subjectTimestamp );
             subjectIface->setCanSet( false );
             baseChannel->plugInterface( AbstractChannelInterfacePtr::dynamicCast(subjectIface) );
@@ -478,7 +671,29 @@ Tp::BaseChannelPtr YSConnection::createChannel(const QString& channelType, uint
 }
 
 /* Called when a telepathy client has acknowledged receiving this message */
-void YSConnection::messageAcknowledged(QString /*id*/) {
+void YSConnection::messageAcknowledged(QString id) {
+    mJournal->acknowledge(id);
+    if(mPendingMessages.acknowledge(id))
+        pageInPending();
+}
+
+/* Moves spilled messages back into their channels, as far as the budget allows */
+void YSConnection::pageInPending() {
+    for(uint targetHandle : mPendingMessages.spillingChannels()) {
+        QString token;
+        while(!(token = mPendingMessages.nextSpilled(targetHandle)).isEmpty()) {
+            MessageJournal::Entry entry;
+            if(!mJournal->read(token, &entry)) {
+                qWarning() << "YSConnection::pageInPending: lost " << token;
+                mPendingMessages.dropSpilled(targetHandle);
+                continue;
+            }
+            if(!mPendingMessages.hasRoom(targetHandle, mJournal->sizeOf(token)))
+                break;
+            mPendingMessages.dropSpilled(targetHandle);
+            deliverMessage(entry, true);
+        }
+    }
 }
 
 QString YSConnection::sendMessage(const QString& jid, const Tp::MessagePartList& message, uint /*flags*/,
@@ -486,6 +701,11 @@ QString YSConnection::sendMessage(const QString& jid, const Tp::MessagePartList&
     //We ignore flags and always post delivery reports
     qDebug() << "YSConnection::sendMessage ";
 
+    /* WhatsApp messages carry either text or one attachment */
+    QString token = sendAttachment(jid, message, error);
+    if(!token.isEmpty() || error->isValid())
+        return token;
+
     QString content;
     for(MessagePartList::const_iterator i = message.begin()+1; i != message.end(); ++i)
         if(i->count(QLatin1String("content-type"))
@@ -496,17 +716,97 @@ QString YSConnection::sendMessage(const QString& jid, const Tp::MessagePartList&
             break;
         }
 
-    GILStateHolder gstate;
-    python::object pMsgId = pythonInterface->call("message_send", jid, content.toUtf8());
-    python::extract<QString> get_msgId(pMsgId);
-    if(!get_msgId.check()) {
-        qDebug() << "message_send did not return a string";
-        error->set(TP_QT_ERROR_INVALID_ARGUMENT,"Internal error");
-        return "";
+    /* Returns immediately, the message is sent (and resent after reconnects) by the queue.
+     * Delivery reports use the same token, see on_yowsup_receipt_messageSent() */
+    token = mOutgoingQueue->enqueue(jid, content.toUtf8());
+    touchChannel(getHandle(jid));
+    qDebug() << "YSConnection::sendMessage with token " << token;
+    return token;
+}
+
+/* Uploads the first image, video or audio part, inline in "content" or a local file in
+ * "x-whosthere-local-uri". Parts marked as thumbnail are sent as preview, text parts are
+ * refused. Returns an empty token if there is no attachment */
+QString YSConnection::sendAttachment(const QString& jid, const Tp::MessagePartList& message, Tp::DBusError* error) {
+    MessagePart attachment;
+    QString type;
+    QString preview;
+    for(MessagePartList::const_iterator i = message.begin()+1; i != message.end(); ++i) {
+        QString contentType = i->value(QLatin1String("content-type")).variant().toString();
+        QString kind = contentType.section('/', 0, 0);
+        if(kind != "image" && kind != "video" && kind != "audio")
+            continue;
+        if(i->value(QLatin1String("thumbnail")).variant().toBool())
+            preview = i->value(QLatin1String("content")).variant().toByteArray().toBase64();
+        else if(type.isEmpty()) {
+            attachment = *i;
+            type = kind;
+        }
     }
+    if(type.isEmpty())
+        return QString();
+    /* A media message has no caption, and sending the text on its own would
+     * need a token of its own */
+    for(MessagePartList::const_iterator i = message.begin()+1; i != message.end(); ++i) {
+        if(i->value(QLatin1String("content-type")).variant().toString() == QLatin1String("text/plain")
+           && !i->value(QLatin1String("content")).variant().toString().isEmpty()) {
+            error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("Text cannot be sent along with an attachment"));
+            return QString();
+        }
+    }
+
+    QString token = mOutgoingQueue->reserveToken();
+    QString contentType = attachment.value(QLatin1String("content-type")).variant().toString();
+    bool ok;
+    if(attachment.count(QLatin1String("x-whosthere-local-uri"))) {
+        QUrl uri(attachment.value(QLatin1String("x-whosthere-local-uri")).variant().toString());
+        ok = uri.isLocalFile() && mMediaUploader->uploadFile(token, jid, type, uri.toLocalFile(), preview);
+    } else {
+        ok = mMediaUploader->uploadData(token, jid, type, contentType,
+                                        attachment.value(QLatin1String("content")).variant().toByteArray(), preview);
+    }
+    if(!ok) {
+        error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("Attachment cannot be uploaded"));
+        return QString();
+    }
+    touchChannel(getHandle(jid));
+    qDebug() << "YSConnection::sendAttachment: uploading " << type << " with token " << token;
+    return token;
+}
+
+void YSConnection::on_uploads_requestUpload(const QString& hash, const QString& type, qint64 size) {
+    pythonInterface->call("media_requestUpload", hash, type, QString::number(size));
+}
+
+void YSConnection::on_uploads_progress(const QString& token, const QString& jid, int percent) {
+    MessagePart details;
+    details["x-whosthere-upload-progress"] = QDBusVariant(percent);
+    postDeliveryReport(jid, token, DeliveryStatusUnknown, details);
+}
+
+void YSConnection::on_uploads_uploaded(const QString& token, const QString& jid, const OutgoingQueue::Media& media) {
+    mOutgoingQueue->enqueueMedia(token, jid, media);
+}
+
+void YSConnection::on_uploads_failed(const QString& token, const QString& jid, const QString& reason) {
+    MessagePart details;
+    details["delivery-error"]            = QDBusVariant(uint(ChannelTextSendErrorUnknown));
+    details["delivery-dbus-error"]       = QDBusVariant(TP_QT_ERROR_NETWORK_ERROR);
+    details["x-whosthere-upload-error"]  = QDBusVariant(reason);
+    postDeliveryReport(jid, token, DeliveryStatusPermanentlyFailed, details);
+}
 
-    qDebug() << "YSConnection::sendMessage with id " << get_msgId();
-    return get_msgId();
+void YSConnection::on_yowsup_media_uploadRequestSuccess(QString hash, QString url, int resumeFrom) {
+    qDebug() << "YSConnection::media_uploadRequestSuccess " << hash << " resume from " << resumeFrom;
+    mMediaUploader->requestSucceeded(hash, url);
+}
+
+void YSConnection::on_yowsup_media_uploadRequestFailed(QString hash) {
+    mMediaUploader->requestFailed(hash);
+}
+
+void YSConnection::on_yowsup_media_uploadRequestDuplicate(QString hash, QString url) {
+    mMediaUploader->requestDuplicate(hash, url);
 }
 
 uint YSConnection::setPresence(const QString& status, const QString& message, Tp::DBusError* error)
@@ -515,6 +815,100 @@ uint YSConnection::setPresence(const QString& status, const QString& message, Tp
     return selfHandle;
 }
 
+/* Avatars */
+Tp::AvatarTokenMap YSConnection::getKnownAvatarTokens(const Tp::UIntList& contacts, Tp::DBusError* error) {
+    Tp::AvatarTokenMap tokens;
+    for(uint handle : contacts) {
+        mHandles.use(handle, mSweepGeneration);
+        auto i = mAvatarTokens.find(handle);
+        if(i != mAvatarTokens.end())
+            tokens[handle] = i.value();
+    }
+    return tokens;
+}
+
+void YSConnection::requestAvatars(const Tp::UIntList& contacts, Tp::DBusError* error) {
+    QStringList unknown;
+    for(uint handle : contacts) {
+        QString jid = getIdentifier(handle);
+        if(!isContactId(jid))
+            continue;
+        auto i = mAvatarTokens.find(handle);
+        if(i != mAvatarTokens.end())
+            mAvatarCache->request(jid, i.value());
+        else
+            unknown << jid;
+    }
+    /* The token is needed to look into the cache; answered by contact_gotProfilePictureId */
+    if(!unknown.isEmpty())
+        pythonInterface->requestPictureIds(unknown);
+}
+
+void YSConnection::setAvatarToken(const QString& jid, const QString& token) {
+    uint handle = getHandle(jid);
+    if(!handle)
+        return;
+    auto i = mAvatarTokens.find(handle);
+    if(i != mAvatarTokens.end() && i.value() == token)
+        return;
+    mAvatarTokens[handle] = token;
+    contactChanged(handle);
+    avatarsIface->avatarUpdated(handle, token);
+}
+
+void YSConnection::on_avatars_fetchRequested(const QString& jid) {
+    pythonInterface->call("contact_getProfilePicture", jid);
+}
+
+void YSConnection::on_avatars_avatarRetrieved(const QString& jid, const QString& token, const QByteArray& data) {
+    uint handle = getHandle(jid);
+    if(handle)
+        avatarsIface->avatarRetrieved(handle, token, data, "image/jpeg");
+}
+
+void YSConnection::on_yowsup_contact_gotProfilePictureId(QString jid, int pictureId, QString filename) {
+    if(!isContactId(jid)) {
+        qDebug() << "YSConnection::on_yowsup_contact_gotProfilePictureId: invalid contact " << jid;
+        return;
+    }
+    QString token = AvatarCache::tokenFor(jid, pictureId);
+    setAvatarToken(jid, token);
+    mAvatarCache->request(jid, token);
+}
+
+void YSConnection::on_yowsup_contact_gotProfilePicture(QString jid, QString filename) {
+    mAvatarCache->fetched(jid, filename);
+}
+
+/* Chat states */
+void YSConnection::on_yowsup_contact_typing(QString jid) {
+    mChatStates->remoteTyping(jid);
+}
+
+void YSConnection::on_yowsup_contact_paused(QString jid) {
+    mChatStates->remotePaused(jid);
+}
+
+void YSConnection::on_chatstates_remoteStateChanged(const QString& jid, uint state) {
+    /* Only tell existing channels, typing alone does not open one */
+    uint handle = getHandle(jid);
+    BaseChannelPtr channel = findTextChannel(handle);
+    if(!channel)
+        return;
+    touchChannel(handle);
+    BaseChannelChatStateInterfacePtr chatStateIface = BaseChannelChatStateInterfacePtr::dynamicCast(channel->interface(TP_QT_IFACE_CHANNEL_INTERFACE_CHAT_STATE));
+    if(chatStateIface)
+        chatStateIface->chatStateChanged(handle, state);
+}
+
+void YSConnection::on_chatstates_sendTyping(const QString& jid) {
+    pythonInterface->call("typing_send", jid);
+}
+
+void YSConnection::on_chatstates_sendPaused(const QString& jid) {
+    pythonInterface->call("typing_paused", jid);
+}
+
 /*
  * If field == 'tel', sync's the given contact's phonenumbers with whatsapp to see if they
  * are registered there.
@@ -530,40 +924,119 @@ void YSConnection::getContactsByVCardField(const QString& field, const QStringLi
         return;
     }
 
-    GILStateHolder gstate;
-    QString numbers = addresses.join(",");
-    python::object ret = pythonInterface->call_intern("syncContacts", mPhoneNumber, mPassword, numbers);
-    python::extract<python::list> getList(ret);
-    if(!getList.check()) {
-        qDebug() << "YSConnection::getContactsByVCardField: return value is not a list";
-        error->set(TP_QT_ERROR_NOT_AVAILABLE,"YSConnection::getContactsByVCardField: return value is not a list");
-        return;
+    /* Canonical "+<digits>" form for the sync and its cache. Addresses we cannot
+     * parse go to the server as they are */
+    QStringList keys;
+    for(const QString& address : addresses) {
+        QString number = PhoneNumber::normalize(address, mCountryCode);
+        keys << (number.isEmpty() ? address : "+" + number);
     }
-    python::list l = getList();
-        while(python::len(l)) {
-        python::object entry = l.pop();
-        python::extract<QString> getNumber(entry);
-        if(!getNumber.check()) {
-            qDebug() << "YSConnection::getContactsByVCardField: return value is not a QString";
-            error->set(TP_QT_ERROR_NOT_AVAILABLE,"YSConnection::getContactsByVCardField: return value is not a QString");
+
+    QStringList stale = mContactSync->stale(keys);
+    if(!stale.isEmpty()) {
+        GILStateHolder gstate;
+        python::object ret = pythonInterface->call_intern("syncNumbers", mPhoneNumber, mPassword, stale.join(","));
+        python::extract<python::list> getList(ret);
+        if(!getList.check()) {
+            qDebug() << "YSConnection::getContactsByVCardField: return value is not a list";
+            error->set(TP_QT_ERROR_NOT_AVAILABLE,"YSConnection::getContactsByVCardField: return value is not a list");
             return;
         }
-        qDebug() << "YSConnection::getContactsByVCardField: " << getNumber();
-        QString identifier = getNumber() + "@s.whatsapp.net";
-        addContact(identifier);
+        python::list l = getList();
+        QSet<QString> asked = stale.toSet();
+        int answered = 0;
+        for(int i = 0; i < python::len(l); ++i) {
+            python::object entry = l[i];
+            python::object address = entry[0], number = entry[1], registered = entry[2];
+            python::extract<QString> getAddress(address);
+            python::extract<QString> getNumber(number);
+            python::extract<bool> getRegistered(registered);
+            if(!getAddress.check() || !getNumber.check() || !getRegistered.check()) {
+                qDebug() << "YSConnection::getContactsByVCardField: unexpected entry in return value";
+                error->set(TP_QT_ERROR_NOT_AVAILABLE,"YSConnection::getContactsByVCardField: unexpected entry in return value");
+                return;
+            }
+            /* The server may echo the address in another format */
+            QString address = getAddress();
+            if(!asked.contains(address)) {
+                QString number = PhoneNumber::normalize(address, mCountryCode);
+                address = "+" + number;
+                if(number.isEmpty() || !asked.contains(address)) {
+                    qDebug() << "YSConnection::getContactsByVCardField: answer for unknown address " << getAddress();
+                    continue;
+                }
+            }
+            mContactSync->update(address, getNumber(), getRegistered());
+            ++answered;
+        }
+        /* Addresses without an answer are not cached, they are asked for again next time */
+        if(answered < stale.size())
+            qDebug() << "YSConnection::getContactsByVCardField: no answer for " << stale.size() - answered
+                     << " addresses";
+        mContactSync->save();
+    }
+    mContactSync->countHits(keys.size() - stale.size());
+    qDebug() << "YSConnection::getContactsByVCardField: synced " << stale.size() << " of " << addresses.size()
+             << " addresses, totals: " << mContactSync->hitCount() << " from cache, "
+             << mContactSync->syncedCount() << " synced";
+
+    /* Build the answer from the cache */
+    QStringList identifiers;
+    QStringList resolved;
+    for(int i = 0; i < addresses.size(); ++i) {
+        ContactSyncCache::Result result;
+        if(!mContactSync->lookup(keys[i], &result) || !result.registered)
+            continue;
+        QString jid = result.number + "@s.whatsapp.net";
+        if(!isContactId(jid)) {
+            qDebug() << "YSConnection::getContactsByVCardField: invalid number " << result.number;
+            continue;
+        }
+        identifiers << jid;
+        resolved << addresses[i];
     }
+    Tp::UIntList handles = ensureContacts(identifiers);
+    for(int i = 0; i < handles.size(); ++i)
+        addressingNormalizationMap[resolved[i]] = handles[i];
+    contactAttributesMap = getContactAttributes(handles, interfaces, error);
 }
 
 void YSConnection::getContactsByURI(const QStringList& URIs, const QStringList& interfaces,
                      Tp::AddressingNormalizationMap& addressingNormalizationMap,
                      Tp::ContactAttributesMap& contactAttributesMap, Tp::DBusError* error) {
     qDebug() << "YSConnection::getContactsByURI " << URIs;
+
+    /* Only tel: URIs, the rest is ignored */
+    QStringList uris, addresses;
+    for(const QString& uri : URIs) {
+        QString address = PhoneNumber::fromUri(uri);
+        if(address.isEmpty())
+            continue;
+        uris << uri;
+        addresses << address;
+    }
+    if(addresses.isEmpty())
+        return;
+
+    Tp::AddressingNormalizationMap addressHandles;
+    getContactsByVCardField("tel", addresses, interfaces, addressHandles, contactAttributesMap, error);
+    for(int i = 0; i < uris.size(); ++i) {
+        auto handle = addressHandles.find(addresses[i]);
+        if(handle != addressHandles.end())
+            addressingNormalizationMap[uris[i]] = handle.value();
+    }
 }
 
 /*                                             YowsupInterface                                      */
 void YSConnection::on_yowsup_auth_success(QString phonenumber) {
     qDebug() << "YSConnection::auth_success " << phonenumber;
 
+    if(mResuming) {
+        startReader();
+        return;
+    }
+    mReconnectAttempts = 0;
+
     simplePresenceIface->setStatuses(Protocol::getSimpleStatusSpecMap());
     simplePresenceIface->setMaxmimumStatusMessageLength(20); //FIXME
 
@@ -582,13 +1055,56 @@ void YSConnection::on_yowsup_auth_success(QString phonenumber) {
     /* Set ContactList status */
     contactListIface->setContactListState(ContactListStateSuccess);
 
-    pythonInterface->runReaderThread();
+    startReader();
+}
+
+/* Reads from the new connection, then continues with startSession() or resumeSession().
+ * The reader of a lost connection may still be exiting, that is waited for without
+ * blocking: on_yowsup_reader_exited() calls this again */
+void YSConnection::startReader() {
+    if(!pythonInterface->runReaderThread()) {
+        if(!mReaderExitTimer.isActive())
+            mReaderExitTimer.start();
+        return;
+    }
+    mReaderExitTimer.stop();
+    if(mResuming)
+        resumeSession();
+    else
+        startSession();
+}
+
+void YSConnection::on_yowsup_reader_exited() {
+    if(mReaderExitTimer.isActive())
+        startReader();
+}
+
+void YSConnection::readerExitTimedOut() {
+    qWarning() << "YSConnection::readerExitTimedOut: previous reader thread is still running";
+    /* Nothing would read from the new connection, log in again later */
+    if(mResuming)
+        scheduleReconnect();
+    else
+        setStatus(ConnectionStatusDisconnected, ConnectionStatusReasonNetworkError);
+}
+
+/* Logged in for the first time */
+void YSConnection::startSession() {
+    mLinkMonitor->start();
+    mOutgoingQueue->setOnline(true);
+    mMediaUploader->setOnline(true);
     pythonInterface->call("presence_sendAvailable");
-    pythonInterface->call("group_getGroups", QString(QLatin1String("participating")) ); //can also be "owning"
+    fetchGroups();
+
+    /* Messages that were acked to the server, but never seen by a client */
+    for(const MessageJournal::Entry& entry : mReplayEntries)
+        deliverMessage(entry);
+    mReplayEntries.clear();
 }
 
 void YSConnection::on_yowsup_auth_fail(QString mobilenumber, QString reason) {
     qDebug() << "YSConnection::auth_fail for " << mobilenumber << " reason: " << reason;
+    mResuming = false;
     setStatus(ConnectionStatusDisconnected, ConnectionStatusReasonAuthenticationFailed);
 }
 
@@ -597,54 +1113,161 @@ void YSConnection::on_yowsup_status_dirty() {
 }
 
 void YSConnection::on_yowsup_disconnected(QString reason) {
-    qDebug() << "YSConnection::on_yowsup_disconnected: reason=" << reason;
-    if(reason == "shutdown") //set in PythonInterface::~PythonInterface()
+    qDebug() << "YSConnection::on_yowsup_disconnected: reason=" << reason
+             << " silent for " << mLinkMonitor->silenceMs() << " ms";
+    if(reason == "shutdown") { //set in PythonInterface::~PythonInterface()
+        mLinkMonitor->stop();
+        mOutgoingQueue->setOnline(false);
+        mMediaUploader->setOnline(false);
+        mReconnectTimer.stop();
+        mReaderExitTimer.stop();
         setStatus(ConnectionStatusDisconnected, ConnectionStatusReasonRequested);
-    else
+        return;
+    }
+    /* Already handled, see on_link_stalled() */
+    if(reason == "stalled")
+        return;
+    connectionLost();
+}
+
+void YSConnection::connectionLost() {
+    mLinkMonitor->stop();
+    mReaderExitTimer.stop();
+    logMetrics();
+    mOutgoingQueue->setOnline(false);
+    mMediaUploader->setOnline(false);
+    if(status() == ConnectionStatusConnected) {
+        /* Keep handles, channels and rooms, and try to get back online ourselves.
+         * Tearing down the connection would make clients re-sync everything. */
+        if(!mResuming)
+            mOutageTimer.start();
+        mResuming = true;
+        scheduleReconnect();
+    } else {
         setStatus(ConnectionStatusDisconnected, ConnectionStatusReasonNetworkError);
+    }
 }
 
-void YSConnection::on_yowsup_receipt_messageSent(QString id,QString msgId) {
+void YSConnection::on_yowsup_pong() {
+    mLinkMonitor->pong();
+}
 
-    uint handle = ensureHandle(id);
-    bool yours;
-    Tp::DBusError error;
-    BaseChannelPtr channel = ensureChannel(TP_QT_IFACE_CHANNEL_TYPE_TEXT, getType(id), handle,
-                                           yours, selfHandle, false,
-                                           &error);
-    if(error.isValid()) {
-        qWarning() << "ensureChannel failed:" << error.name() << " " << error.message();
-        return;
-    }
-    BaseChannelTextTypePtr textChannel = BaseChannelTextTypePtr::dynamicCast(channel->interface(TP_QT_IFACE_CHANNEL_TYPE_TEXT));
+void YSConnection::on_link_sendPing() {
+    pythonInterface->call("ping");
+}
 
-    if(!textChannel) {
-        qDebug() << "Error, channel is not a textChannel??";
+/* The server stopped answering. Drop the connection now, instead of waiting for TCP
+ * to give up. Yowsup does not always signal disconnected for that, so the
+ * reconnect is scheduled right here */
+void YSConnection::on_link_stalled() {
+    qDebug() << "YSConnection::on_link_stalled: no answer for " << mLinkMonitor->silenceMs() << " ms";
+    mLinkMonitor->stop();
+    pythonInterface->call("disconnect", QString(QLatin1String("stalled")));
+    connectionLost();
+}
+
+void YSConnection::on_replay_finished() {
+    qDebug() << "YSConnection::on_replay_finished: " << mTraceReplayer->eventCount() << " events";
+    logMetrics();
+}
+
+QVariantMap YSConnection::metrics() const {
+    QVariantMap metrics;
+    metrics["rtt"] = mLinkMonitor->rtt().summary();
+    metrics["stalls"] = mLinkMonitor->stallCount();
+    metrics["reconnect-attempts"] = mReconnectAttempts;
+    metrics["last-outage-ms"] = mLastOutageMs;
+    metrics["outgoing-pending"] = mOutgoingQueue->pendingCount();
+    metrics["accept-latency"] = mOutgoingQueue->acceptLatency().summary();
+    metrics["delivery-latency"] = mOutgoingQueue->deliveryLatency().summary();
+    metrics["expired-unaccepted"] = mOutgoingQueue->unacceptedExpiredCount();
+    metrics["expired-undelivered"] = mOutgoingQueue->undeliveredExpiredCount();
+    /* -1 while the groups are still being fetched */
+    metrics["room-list-complete-ms"] = mRoomListCompleteMs;
+    metrics["handles"] = mHandles.size();
+    metrics["text-channels"] = mTextChannels.size();
+    metrics["duplicates-dropped"] = mReceivedMessages.duplicateCount();
+    metrics["pending-messages"] = mPendingMessages.messageCount();
+    metrics["pending-bytes"] = mPendingMessages.byteCount();
+    metrics["media"] = mMediaFetcher ? mMediaFetcher->summary() : QString("off");
+    metrics["uploads"] = mMediaUploader->summary();
+    return metrics;
+}
+
+void YSConnection::logMetrics() {
+    qDebug() << "YSConnection::metrics: " << metrics();
+}
+
+void YSConnection::scheduleReconnect() {
+    static const int RECONNECT_BASE_MS = 1000;
+    static const int RECONNECT_MAX_MS = 5*60*1000;
+    static const int RECONNECT_MAX_ATTEMPTS = 12;
+
+    if(mReconnectAttempts >= RECONNECT_MAX_ATTEMPTS) {
+        qDebug() << "YSConnection::scheduleReconnect: giving up after " << mReconnectAttempts << " attempts";
+        mResuming = false;
+        /* Reported while the channels are still there */
+        mOutgoingQueue->failAll();
+        setStatus(ConnectionStatusDisconnected, ConnectionStatusReasonNetworkError);
         return;
     }
+    int delay = backoffDelayMs(mReconnectAttempts, RECONNECT_BASE_MS, RECONNECT_MAX_MS);
+    ++mReconnectAttempts;
+    qDebug() << "YSConnection::scheduleReconnect: attempt " << mReconnectAttempts << " in " << delay << " ms";
+    mReconnectTimer.start(delay);
+}
+
+void YSConnection::reconnect() {
+    qDebug() << "YSConnection::reconnect";
+    /* Either auth_success, auth_fail or disconnected will follow */
+    pythonInterface->call("auth_login", mPhoneNumber, mPassword );
+}
+
+/* Logged in again after a connection loss. Handles, channels and rooms are still valid,
+ * only state that may have changed while we were away is fetched again. */
+void YSConnection::resumeSession() {
+    mResuming = false;
+    mReconnectAttempts = 0;
+    mLinkMonitor->start();
+    mOutgoingQueue->setOnline(true);
+    mMediaUploader->setOnline(true);
+    pythonInterface->call("presence_sendAvailable");
 
-    MessagePartList partList;
-    MessagePart header;
-    header["message-sender"]        = QDBusVariant(handle);
-    header["message-sender-id"]     = QDBusVariant(id);
-    header["message-type"]          = QDBusVariant(ChannelTextMessageTypeDeliveryReport);
-    header["delivery-status"]       = QDBusVariant(DeliveryStatusAccepted);
-    header["delivery-token"]        = QDBusVariant(msgId);
-    partList << header;
+    for(auto i = mContactsSubscription.begin(); i != mContactsSubscription.end(); ++i)
+        if(i.value() == SubscriptionStateYes)
+            pythonInterface->call("presence_subscribe", getIdentifier(i.key()));
+    fetchGroups();
 
-    textChannel->addReceivedMessage(partList);
+    mLastOutageMs = mOutageTimer.elapsed();
+    qDebug() << "YSConnection::resumeSession: usable again after " << mLastOutageMs << " ms";
 }
 
-void YSConnection::on_yowsup_receipt_messageDelivered(QString id, QString msgId) {
-    pythonInterface->call("delivered_ack", id, msgId);
+void YSConnection::on_yowsup_receipt_messageSent(QString id,QString msgId) {
+    mOutgoingQueue->messageAccepted(msgId);
+    postDeliveryReport(id, msgId, DeliveryStatusAccepted);
+}
 
-    uint handle = ensureHandle(id);
-    bool yours;
-    Tp::DBusError error;
-    BaseChannelPtr channel = ensureChannel(TP_QT_IFACE_CHANNEL_TYPE_TEXT, getType(id), handle,
-                                           yours, selfHandle, false, &error);
-    if(error.isValid()) {
-        qWarning() << "ensureChannel failed:" << error.name() << " " << error.message();
+void YSConnection::on_yowsup_receipt_messageDelivered(QString id, QString msgId) {
+    pythonInterface->ackDelivered(id, msgId);
+    /* The report needs the token, which the queue forgets on delivery */
+    postDeliveryReport(id, msgId, DeliveryStatusDelivered);
+    mOutgoingQueue->messageDelivered(msgId);
+}
+
+void YSConnection::on_outgoing_messageFailed(const QString& token, const QString& jid) {
+    MessagePart details;
+    details["delivery-error"]       = QDBusVariant(uint(ChannelTextSendErrorUnknown));
+    postDeliveryReport(jid, token, DeliveryStatusPermanentlyFailed, details);
+}
+
+/* Reports go to the channel the message was sent from. If that was closed in the
+ * meantime, nobody is waiting for the report, so no channel is opened just for it */
+void YSConnection::postDeliveryReport(const QString& id, const QString& msgId, uint status,
+                                      const Tp::MessagePart& details) {
+    uint handle = getHandle(id);
+    BaseChannelPtr channel = findTextChannel(handle);
+    if(!channel) {
+        qDebug() << "YSConnection::postDeliveryReport: no channel for " << id << ", dropping report";
         return;
     }
     BaseChannelTextTypePtr textChannel = BaseChannelTextTypePtr::dynamicCast(channel->interface(TP_QT_IFACE_CHANNEL_TYPE_TEXT));
@@ -653,60 +1276,129 @@ void YSConnection::on_yowsup_receipt_messageDelivered(QString id, QString msgId)
         qDebug() << "Error, channel is not a textChannel??";
         return;
     }
+    touchChannel(handle);
+
     MessagePartList partList;
     MessagePart header;
     header["message-sender"]        = QDBusVariant(handle);
     header["message-sender-id"]     = QDBusVariant(id);
     header["message-type"]          = QDBusVariant(ChannelTextMessageTypeDeliveryReport);
-    header["delivery-status"]       = QDBusVariant(DeliveryStatusDelivered);
-    header["delivery-token"]        = QDBusVariant(msgId);
+    header["delivery-status"]       = QDBusVariant(status);
+    header["delivery-token"]        = QDBusVariant(mOutgoingQueue->tokenFor(msgId));
+    for(MessagePart::const_iterator i = details.begin(); i != details.end(); ++i)
+        header[i.key()] = i.value();
     partList << header;
 
     textChannel->addReceivedMessage(partList);
 }
 
 void YSConnection::on_yowsup_presence_available(QString jid) {
-    uint handle = ensureContact(jid);
-    if(!handle) {
-        qDebug() << "YSConnection::on_yowsup_presence_available: could not create contact " << jid;
+    if(!isContactId(jid)) {
+        qDebug() << "YSConnection::on_yowsup_presence_available: invalid contact " << jid;
         return;
     }
-    setPresenceState(QList<uint>() << handle, "available");
-    if(handle != selfHandle)
-        setSubscriptionState(QStringList() << jid, QList<uint>() << handle, SubscriptionStateYes);
+    mPendingPresences[jid] = "available";
+    if(!mPresenceFlushTimer.isActive())
+        mPresenceFlushTimer.start();
 }
 
 void YSConnection::on_yowsup_presence_unavailable(QString jid) {
-    uint handle = ensureContact(jid);
-    if(!handle) {
-        qDebug() << "YSConnection::on_yowsup_presence_unavailable: could not create contact " << jid;
+    if(!isContactId(jid)) {
+        qDebug() << "YSConnection::on_yowsup_presence_unavailable: invalid contact " << jid;
         return;
     }
-    setPresenceState(QList<uint>() << handle, "offline");
-    if(handle != selfHandle)
-        setSubscriptionState(QStringList() << jid, QList<uint>() << handle, SubscriptionStateYes);
+    mPendingPresences[jid] = "offline";
+    if(!mPresenceFlushTimer.isActive())
+        mPresenceFlushTimer.start();
 }
 
+/* Applies all presence updates received since the last flush, with one presence change
+ * and at most one contact list change signal */
+void YSConnection::flushPresences() {
+    QStringList jids = mPendingPresences.keys();
+    /* New contacts are announced below, together with the known ones */
+    Tp::UIntList handles = ensureContacts(jids, false);
+
+    QHash<uint,QString> statuses;
+    QStringList subscribedJids;
+    QList<uint> subscribedHandles;
+    for(int i = 0; i < jids.size(); ++i) {
+        uint handle = handles[i];
+        statuses[handle] = mPendingPresences[jids[i]];
+        if(handle != selfHandle && mContactsSubscription.value(handle) != SubscriptionStateYes) {
+            subscribedJids << jids[i];
+            subscribedHandles << handle;
+        }
+    }
+    mPendingPresences.clear();
+
+    setPresenceStates(statuses);
+    if(!subscribedHandles.isEmpty())
+        setSubscriptionState(subscribedJids, subscribedHandles, SubscriptionStateYes);
+}
+
+/* mediaUrl: the message is delivered once the media is downloaded, see mediaDone() */
 void YSConnection::yowsup_messageReceived(QString msgId, QString jid, const MessagePartList& body, uint timestamp,
-                                          bool wantsReceipt, const QString& gid) {
+                                          bool wantsReceipt, const QString& gid, const QString& mediaUrl) {
     qDebug() << "YSConnection::yowsup_messageReceived " << msgId;
+    if(!isContactId(jid) || (!gid.isEmpty() && !isGroupId(gid))) {
+        qWarning() << "YSConnection::yowsup_messageReceived: invalid sender " << jid << " or group " << gid;
+        return;
+    }
+    if(mReceivedMessages.seen(jid, msgId)) {
+        qDebug() << "YSConnection::yowsup_messageReceived: dropping duplicate " << msgId << " from " << jid;
+        /* Ack again, the first ack may have been lost. If the original is not
+         * committed yet, the ack has to wait for it */
+        if(wantsReceipt) {
+            QPair<QString,QString> ack(gid.isEmpty() ? jid : gid, msgId);
+            if(mJournal->hasUncommitted())
+                mPendingServerAcks << ack;
+            else
+                pythonInterface->ackMessages(QList<QPair<QString,QString> >() << ack);
+        }
+        return;
+    }
+    if(timestamp == 0)
+        timestamp = QDateTime::currentMSecsSinceEpoch()/1000;
+
+    MessageJournal::Entry entry;
+    entry.token = MessageJournal::tokenFor(jid, msgId);
+    entry.senderId = jid;
+    entry.targetId = gid.isEmpty() ? jid : gid;
+    entry.timestamp = timestamp;
+    entry.body = body;
+
     //We cannot wait until messageAcknowledged(), because that indicates that the user saw the message,
     //not that it was received. Yowsup won't tolerate such long delays.
+    //But we wait until the message is in the journal, see on_journal_committed().
     if(wantsReceipt)
-        pythonInterface->call("message_ack", gid.isEmpty() ? jid : gid, msgId );
+        mPendingServerAcks << qMakePair(entry.targetId, msgId);
+    mJournal->append(entry);
+
+    /* Later messages of the chat wait behind a download, so the order is kept */
+    if(!mediaUrl.isEmpty() || mHeldMessages.contains(entry.targetId)) {
+        HeldMessage held = { entry, mediaUrl };
+        mHeldMessages[entry.targetId] << held;
+        return;
+    }
+    deliverMessage(entry);
+}
 
+void YSConnection::on_journal_committed() {
+    pythonInterface->ackMessages(mPendingServerAcks);
+    mPendingServerAcks.clear();
+}
+
+/* pagedIn: entry was spilled before, and there is room for it now */
+void YSConnection::deliverMessage(const MessageJournal::Entry& entry, bool pagedIn) {
     uint senderHandle, targetHandle;
-    QString senderId, targetId;
     HandleType handleType;
-    if(gid.isEmpty()) {
-        senderHandle = targetHandle = ensureContact(jid);
-        senderId = targetId = jid;
+    if(isContactId(entry.targetId)) {
+        senderHandle = targetHandle = ensureContact(entry.senderId);
         handleType = HandleTypeContact;
     } else {
-        senderHandle = ensureContact(jid);
-        senderId = jid;
-        targetHandle = ensureGroup(gid);
-        targetId = gid;
+        senderHandle = ensureContact(entry.senderId);
+        targetHandle = ensureGroup(entry.targetId);
         handleType = HandleTypeRoom;
     }
     //TODO: initiator should be group creator
@@ -720,30 +1412,41 @@ void YSConnection::yowsup_messageReceived(QString msgId, QString jid, const Mess
         return;
     }
 
-    if(handleType == HandleTypeRoom) {
-        BaseChannelGroupInterfacePtr groupIface = BaseChannelGroupInterfacePtr::dynamicCast(channel->interface(TP_QT_IFACE_CHANNEL_INTERFACE_GROUP));
-        Q_ASSERT(!groupIface.isNull());
-        groupIface->addMembers(Tp::UIntList() << senderHandle << selfHandle,
-                               QStringList() << senderId << getIdentifier(selfHandle));
-    }
+    touchChannel(targetHandle);
+
+    /* Usually the sender is known from group_gotParticipants already */
+    if(handleType == HandleTypeRoom && mRoomMembers.addMember(targetHandle, senderHandle))
+        updateRoomMembers(targetHandle, Tp::UIntList() << senderHandle, Tp::UIntList());
 
     BaseChannelTextTypePtr textChannel = BaseChannelTextTypePtr::dynamicCast(channel->interface(TP_QT_IFACE_CHANNEL_TYPE_TEXT));
     if(!textChannel) {
         qDebug() << "Error, channel is not a textChannel??";
         return;
     }
-    if(timestamp == 0)
-        timestamp = QDateTime::currentMSecsSinceEpoch()/1000;
+    /* The message is what the contact was typing */
+    if(handleType == HandleTypeContact && !pagedIn)
+        mChatStates->remoteMessage(entry.senderId);
+
+    int size = mJournal->sizeOf(entry.token);
+    if(pagedIn) {
+        mPendingMessages.deliver(targetHandle, entry.token, size);
+    } else if(!mPendingMessages.admit(targetHandle, entry.token, size)) {
+        if(mPendingMessages.spilledCount(targetHandle) == 1)
+            qDebug() << "YSConnection::deliverMessage: pending budget exhausted, spilling messages for "
+                     << entry.targetId;
+        return;
+    }
+
     MessagePartList partList;
     MessagePart header;
-    header["message-token"]         = QDBusVariant(msgId);
-    header["message-received"]      = QDBusVariant(timestamp);
+    header["message-token"]         = QDBusVariant(entry.token);
+    header["message-received"]      = QDBusVariant(entry.timestamp);
     header["message-sender"]        = QDBusVariant(senderHandle);
-    header["message-sender-id"]     = QDBusVariant(senderId);
+    header["message-sender-id"]     = QDBusVariant(entry.senderId);
     //header["sender-nickname"]       = QDBusVariant(pushName);
     header["message-type"]          = QDBusVariant(ChannelTextMessageTypeNormal);
 
-    partList << header << body;
+    partList << header << entry.body;
     textChannel->addReceivedMessage(partList);
 }
 
@@ -783,7 +1486,54 @@ void YSConnection::yowsup_linked_data_received(const char* type, QString msgId,
         img["thumbnail"]            = QDBusVariant(true);
         body << img;
     }
-    yowsup_messageReceived(msgId, jid, body, 0, wantsReceipt, gid);
+
+    qint64 bytes = size.toLongLong();
+    bool download = mMediaFetcher && bytes > 0 && bytes <= mMediaMaxSize;
+    yowsup_messageReceived(msgId, jid, body, 0, wantsReceipt, gid, download ? url : QString());
+    /* After the message is held, a cached file is reported right away */
+    if(download)
+        mMediaFetcher->fetch(url, bytes);
+}
+
+void YSConnection::on_media_fetched(const QString& url, const QString& filename) {
+    MessagePart file;
+    file["content-type"]            = QDBusVariant(QMimeDatabase().mimeTypeForFile(filename).name());
+    file["x-whosthere-local-uri"]   = QDBusVariant(QUrl::fromLocalFile(filename).toString());
+    mediaDone(url, file);
+}
+
+/* Deliver them anyway, clients can still use the url */
+void YSConnection::on_media_failed(const QString& url) {
+    mediaDone(url, MessagePart());
+}
+
+/*
+ * Attaches file (unless empty) to the messages that waited for url and delivers
+ * the messages of their chats up to the next one that is still downloading.
+ */
+void YSConnection::mediaDone(const QString& url, const MessagePart& file) {
+    QStringList targets;
+    for(auto i = mHeldMessages.begin(); i != mHeldMessages.end(); ++i) {
+        for(HeldMessage& held : i.value()) {
+            if(held.mediaUrl != url)
+                continue;
+            held.mediaUrl.clear();
+            if(!file.isEmpty()) {
+                held.entry.body << file;
+                /* Replaces the record without the file */
+                mJournal->append(held.entry);
+            }
+            if(!targets.contains(i.key()))
+                targets << i.key();
+        }
+    }
+    for(const QString& target : targets) {
+        QList<HeldMessage> held = mHeldMessages.take(target);
+        while(!held.isEmpty() && held.first().mediaUrl.isEmpty())
+            deliverMessage(held.takeFirst().entry);
+        if(!held.isEmpty())
+            mHeldMessages[target] = held;
+    }
 }
 
 void YSConnection::on_yowsup_image_received(QString msgId, QString jid, QString preview,
@@ -880,24 +1630,39 @@ void YSConnection::on_yowsup_notification_contactProfilePictureUpdated(QString j
     qDebug() << "YSConnection::on_yowsup_notification_contactProfilePictureUpdated";
     if(wantsReceipt)
         pythonInterface->call("notification_ack", jid, msgId );
+    if(!isContactId(jid))
+        return;
+    /* Clients fetch the picture with RequestAvatars if they want it */
+    setAvatarToken(jid, AvatarCache::tokenFor(jid, pictureId));
 }
 
 void YSConnection::on_yowsup_notification_contactProfilePictureRemoved(QString jid, uint timestamp,QString msgId, bool wantsReceipt){
     qDebug() << "YSConnection::on_yowsup_notification_contactProfilePictureRemoved";
     if(wantsReceipt)
         pythonInterface->call("notification_ack", jid, msgId );
+    setAvatarToken(jid, "");
 }
 
 void YSConnection::on_yowsup_notification_groupParticipantAdded(QString gid, QString jid, QString author, uint timestamp,QString msgId, bool wantsReceipt){
     qDebug() << "YSConnection::on_yowsup_notification_groupParticipantAdded";
     if(wantsReceipt)
         pythonInterface->call("notification_ack", gid, msgId );
+    if(!isGroupId(gid) || !isContactId(jid))
+        return;
+    uint roomHandle = ensureGroup(gid);
+    uint handle = ensureContact(jid);
+    if(mRoomMembers.addMember(roomHandle, handle))
+        updateRoomMembers(roomHandle, Tp::UIntList() << handle, Tp::UIntList());
 }
 
 void YSConnection::on_yowsup_notification_groupParticipantRemoved(QString gid, QString jid, QString author, uint timestamp,QString msgId,bool wantsReceipt){
     qDebug() << "YSConnection::on_yowsup_notification_groupParticipantRemoved";
     if(wantsReceipt)
         pythonInterface->call("notification_ack", gid, msgId );
+    uint roomHandle = getHandle(gid);
+    uint handle = getHandle(jid);
+    if(roomHandle && handle && mRoomMembers.removeMember(roomHandle, handle))
+        updateRoomMembers(roomHandle, Tp::UIntList(), Tp::UIntList() << handle);
 }
 
 void YSConnection::on_yowsup_notification_groupPictureUpdated(QString gid, QString jid, uint timestamp, QString msgId, int pictureId, bool wantsReceipt){
@@ -916,33 +1681,120 @@ void YSConnection::on_yowsup_group_subjectReceived(QString msgId,QString gid,QSt
     qDebug() << "YSConnection::on_yowsup_group_subjectReceived";
     if(wantsReceipt)
         pythonInterface->call("message_ack", gid, msgId );
+
+    uint roomHandle = getHandle(gid);
+    if(!roomHandle || !rooms.contains(roomHandle))
+        return;
+    Room& room = rooms[roomHandle];
+    room.subject = newSubject;
+    room.subjectOwner = jid;
+    room.subjectTimestamp = timestamp;
+    updateRoomInfo(roomHandle);
 }
 
 void YSConnection::on_yowsup_profile_setStatusSuccess(QString jid, QString msgId) {
     qDebug() << "YSConnection::on_yowsup_profile_setStatusSuccess";
-    pythonInterface->call("delivered_ack", jid, msgId );
+    pythonInterface->ackDelivered(jid, msgId);
 }
 
 /* Group listing */
+static const int ROOM_LIST_PAGE_SIZE = 50;
+
 void YSConnection::listRooms(BaseChannelRoomListTypePtr roomListType, Tp::DBusError* error) {
     qDebug() << "YSConnection::listRooms";
-    Tp::RoomInfoList roomInfoList;
-
-    for( Room& room : rooms ) {
-        Tp::RoomInfo roomInfo;
-
-        roomInfo.channelType = TP_QT_IFACE_CHANNEL_TYPE_TEXT;
-        roomInfo.handle = getHandle(room.id);
-        roomInfo.info["handle-name"] = room.id;
-        roomInfo.info["name"] = room.subject;
-        roomInfo.info["subject"] = room.subject;
-        roomInfo.info["members"] = room.members.size();
-        roomInfo.info["password"] = false;
-        roomInfo.info["invite-only"] = false;
-
-        roomInfoList << roomInfo;
+    RoomListing listing;
+    listing.roomListType = Tp::WeakPtr<BaseChannelRoomListType>(roomListType);
+    listing.remaining = mRoomInfoCache.keys();
+    listing.listed = listing.remaining.toSet();
+
+    roomListType->setListingRooms(true);
+    /* First page right away, so clients can show something */
+    if(sendRoomListPage(listing, mRoomListCompleteMs >= 0 || !mGroupFetchTimer.isValid()))
+        return;
+    mRoomListings << listing;
+    if(!listing.remaining.isEmpty())
+        mRoomListTimer.start();
+}
+
+void YSConnection::stopListingRooms(BaseChannelRoomListTypePtr roomListType, Tp::DBusError* error) {
+    qDebug() << "YSConnection::stopListingRooms";
+    for(int i = 0; i < mRoomListings.size(); ++i)
+        if(BaseChannelRoomListTypePtr(mRoomListings[i].roomListType) == roomListType)
+            mRoomListings.removeAt(i--);
+    roomListType->setListingRooms(false);
+}
+
+/* Sends the next page of listing. Returns true if the listing is finished, i.e.
+ * its channel is gone, or all rooms are sent and the room list is complete */
+bool YSConnection::sendRoomListPage(RoomListing& listing, bool roomListComplete) {
+    BaseChannelRoomListTypePtr roomListType(listing.roomListType);
+    if(!roomListType)
+        return true;
+    Tp::RoomInfoList page;
+    while(!listing.remaining.isEmpty() && page.size() < ROOM_LIST_PAGE_SIZE) {
+        auto roomInfo = mRoomInfoCache.find(listing.remaining.takeFirst());
+        if(roomInfo != mRoomInfoCache.end())
+            page << roomInfo.value();
+    }
+    if(!page.isEmpty())
+        roomListType->gotRooms(page);
+    if(listing.remaining.isEmpty() && roomListComplete) {
+        roomListType->setListingRooms(false);
+        return true;
     }
-    roomListType->gotRooms(roomInfoList);
+    return false;
+}
+
+/* Sends the next page of every running listing */
+void YSConnection::sendRoomListPages() {
+    bool roomListComplete = mRoomListCompleteMs >= 0 || !mGroupFetchTimer.isValid();
+    for(int i = 0; i < mRoomListings.size(); ++i)
+        if(sendRoomListPage(mRoomListings[i], roomListComplete))
+            mRoomListings.removeAt(i--);
+    /* While loading, sendRoomListPages() is triggered from updateRoomInfo() */
+    bool pending = false;
+    for(const RoomListing& listing : mRoomListings)
+        pending = pending || !listing.remaining.isEmpty();
+    if(!pending)
+        mRoomListTimer.stop();
+}
+
+void YSConnection::updateRoomInfo(uint roomHandle) {
+    auto i = rooms.find(roomHandle);
+    if(i == rooms.end())
+        return;
+    const Room& room = i.value();
+
+    Tp::RoomInfo& roomInfo = mRoomInfoCache[roomHandle];
+    roomInfo.channelType = TP_QT_IFACE_CHANNEL_TYPE_TEXT;
+    roomInfo.handle = roomHandle;
+    roomInfo.info["handle-name"] = room.id;
+    roomInfo.info["name"] = room.subject;
+    roomInfo.info["subject"] = room.subject;
+    roomInfo.info["members"] = mRoomMembers.memberCount(roomHandle);
+    roomInfo.info["password"] = false;
+    roomInfo.info["invite-only"] = false;
+
+    bool queued = false;
+    for(RoomListing& listing : mRoomListings) {
+        if(listing.listed.contains(roomHandle))
+            continue;
+        listing.listed.insert(roomHandle);
+        listing.remaining << roomHandle;
+        queued = true;
+    }
+    if(queued && !mRoomListTimer.isActive())
+        mRoomListTimer.start();
+}
+
+void YSConnection::fetchGroups() {
+    mGroupFetchTimer.start();
+    mRoomListCompleteMs = -1;
+    mGroupFetchQueue.clear();
+    mGroupFetchesInFlight.clear();
+    mGroupFetchErrors = 0;
+    mGroupFetchTimeout.start();
+    pythonInterface->call("group_getGroups", QString(QLatin1String("participating")) ); //can also be "owning"
 }
 
 void YSConnection::on_yowsup_group_gotInfo(QString gid, QString jid,
@@ -956,9 +1808,193 @@ void YSConnection::on_yowsup_group_gotInfo(QString gid, QString jid,
     room.subjectOwner = subjectOwner;
     room.creationTimestamp = creation;
     room.subjectTimestamp = subjectT;
-    //room.members
-    uint roomHandle = ensureHandle(gid);
-    rooms[roomHandle] = room;
+    /* Infos for all groups arrive back to back after group_getGroups, ingest them together */
+    mPendingGroupInfos << room;
+    if(!mGroupIngestTimer.isActive())
+        mGroupIngestTimer.start();
+}
+
+void YSConnection::ingestGroupInfos() {
+    qDebug() << "YSConnection::ingestGroupInfos: " << mPendingGroupInfos.size() << " groups";
+    QStringList owners;
+    for(const Room& room : mPendingGroupInfos) {
+        if(!isGroupId(room.id))
+            continue;
+        if(isContactId(room.owner))
+            owners << room.owner;
+        if(isContactId(room.subjectOwner))
+            owners << room.subjectOwner;
+    }
+    ensureContacts(owners);
+
+    for(const Room& room : mPendingGroupInfos) {
+        if(!isGroupId(room.id))
+            continue;
+        uint roomHandle = ensureGroup(room.id);
+        rooms[roomHandle] = room;
+        updateRoomInfo(roomHandle);
+        if(!mGroupFetchQueue.contains(room.id) && !mGroupFetchesInFlight.contains(room.id))
+            mGroupFetchQueue.enqueue(room.id);
+    }
+    mPendingGroupInfos.clear();
+    pumpGroupFetches();
+}
+
+/* Keeps up to MAX_GROUP_FETCHES_IN_FLIGHT participant requests outstanding */
+void YSConnection::pumpGroupFetches() {
+    static const int MAX_GROUP_FETCHES_IN_FLIGHT = 8;
+    /* group_infoError does not tell which request failed. No new requests are sent
+     * until all others in flight were answered, the ones left over are those that failed */
+    if(mGroupFetchErrors > 0 && mGroupFetchErrors >= mGroupFetchesInFlight.size()) {
+        qDebug() << "YSConnection::pumpGroupFetches: failed to fetch " << mGroupFetchesInFlight;
+        mGroupFetchesInFlight.clear();
+        mGroupFetchErrors = 0;
+    }
+    while(mGroupFetchErrors == 0 && !mGroupFetchQueue.isEmpty()
+          && mGroupFetchesInFlight.size() < MAX_GROUP_FETCHES_IN_FLIGHT) {
+        QString gid = mGroupFetchQueue.dequeue();
+        mGroupFetchesInFlight.enqueue(gid);
+        pythonInterface->call("group_getParticipants", gid);
+    }
+
+    if(mGroupFetchQueue.isEmpty() && mGroupFetchesInFlight.isEmpty()
+       && mRoomListCompleteMs < 0 && mGroupFetchTimer.isValid()) {
+        mRoomListCompleteMs = mGroupFetchTimer.elapsed();
+        mGroupFetchTimeout.stop();
+        qDebug() << "YSConnection::pumpGroupFetches: room list of " << rooms.size()
+                 << " groups complete after " << mRoomListCompleteMs << " ms";
+        /* Lets running listings finish */
+        if(!mRoomListings.isEmpty())
+            mRoomListTimer.start();
+    } else if(mRoomListCompleteMs < 0) {
+        mGroupFetchTimeout.start();
+    }
+}
+
+void YSConnection::on_yowsup_group_infoError(QString errorCode) {
+    qDebug() << "YSConnection::on_yowsup_group_infoError " << errorCode;
+    ++mGroupFetchErrors;
+    pumpGroupFetches();
+}
+
+void YSConnection::groupFetchTimedOut() {
+    qDebug() << "YSConnection::groupFetchTimedOut: no answer for " << mGroupFetchesInFlight;
+    mGroupFetchesInFlight.clear();
+    mGroupFetchErrors = 0;
+    pumpGroupFetches();
+}
+
+/* jids is the comma-joined list of all participants */
+void YSConnection::on_yowsup_group_gotParticipants(QString gid, QString jids) {
+    qDebug() << "YSConnection::on_yowsup_group_gotParticipants " << gid;
+    if(!isGroupId(gid))
+        return;
+    QStringList participants;
+    for(const QString& jid : jids.split(',', QString::SkipEmptyParts))
+        if(isContactId(jid))
+            participants << jid;
+
+    uint roomHandle = ensureGroup(gid);
+    QSet<uint> members = ensureContacts(participants).toSet();
+    members.insert(selfHandle);
+    Tp::UIntList removed;
+    Tp::UIntList added = mRoomMembers.setMembers(roomHandle, members, &removed);
+    if(!added.isEmpty() || !removed.isEmpty())
+        updateRoomMembers(roomHandle, added, removed);
+
+    if(mGroupFetchesInFlight.removeOne(gid))
+        pumpGroupFetches();
+}
+
+/* Forwards membership changes to the room's channel, if there is one */
+void YSConnection::updateRoomMembers(uint roomHandle, const Tp::UIntList& added, const Tp::UIntList& removed) {
+    updateRoomInfo(roomHandle);
+    BaseChannelPtr channel = findTextChannel(roomHandle);
+    if(!channel)
+        return;
+    BaseChannelGroupInterfacePtr groupIface = BaseChannelGroupInterfacePtr::dynamicCast(channel->interface(TP_QT_IFACE_CHANNEL_INTERFACE_GROUP));
+    if(!groupIface)
+        return;
+    if(!added.isEmpty()) {
+        QStringList ids;
+        for(uint handle : added)
+            ids << getIdentifier(handle);
+        groupIface->addMembers(added, ids);
+    }
+    if(!removed.isEmpty())
+        groupIface->removeMembers(removed);
+}
+
+void YSConnection::touchChannel(uint targetHandle) {
+    if(mTextChannels.contains(targetHandle))
+        mChannelActivity[targetHandle] = QDateTime::currentMSecsSinceEpoch();
+}
+
+/*
+ * Closes text channels without pending messages and without activity for
+ * mChannelIdleMs. They are opened again when a message arrives.
+ */
+void YSConnection::reapChannels() {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    int reaped = 0;
+    QList<BaseChannelPtr> idle;
+    for(auto i = mTextChannels.begin(); i != mTextChannels.end();) {
+        uint handle = i.key();
+        BaseChannelPtr channel(i.value());
+        if(!channel || mPendingMessages.contains(handle) || now - mChannelActivity.value(handle) < mChannelIdleMs) {
+            ++i;
+            continue;
+        }
+        mChannelActivity.remove(handle);
+        i = mTextChannels.erase(i);
+        idle << channel;
+    }
+    /* Not tracked anymore, so textChannelClosed() ignores them */
+    for(const BaseChannelPtr& channel : idle)
+        channel->close();
+    if(!idle.isEmpty())
+        qDebug() << "YSConnection::reapChannels: closed " << idle.size() << " idle channels, "
+                 << mTextChannels.size() << " left";
+}
+
+/* A client closed a text channel */
+void YSConnection::textChannelClosed() {
+    BaseChannel* channel = qobject_cast<BaseChannel*>(sender());
+    if(!channel)
+        return;
+    uint targetHandle = channel->targetHandle();
+    auto i = mTextChannels.find(targetHandle);
+    if(i == mTextChannels.end())
+        return;
+    BaseChannelPtr current(i.value());
+    if(current && current.data() != channel)
+        return; // replaced in the meantime
+    mTextChannels.erase(i);
+    mChannelActivity.remove(targetHandle);
+    releasePending(targetHandle);
+}
+
+/* Messages the client of targetHandle's channel did not ack are still in the
+ * journal. Like a respawned channel, a new channel gets them again, in order and
+ * in front of those spilled before. Paged in later, not from within the close */
+void YSConnection::releasePending(uint targetHandle) {
+    if(!mPendingMessages.contains(targetHandle))
+        return;
+    mPendingMessages.release(targetHandle);
+    QMetaObject::invokeMethod(this, "pageInPending", Qt::QueuedConnection);
+}
+
+BaseChannelPtr YSConnection::findTextChannel(uint targetHandle) {
+    auto i = mTextChannels.find(targetHandle);
+    if(i == mTextChannels.end())
+        return BaseChannelPtr();
+    BaseChannelPtr channel(i.value());
+    if(!channel) {
+        mTextChannels.erase(i); //closed in the meantime
+        mChannelActivity.remove(targetHandle);
+        releasePending(targetHandle);
+    }
+    return channel;
 }
 
 /* Convenience */
@@ -980,29 +2016,83 @@ bool YSConnection::isValidContact(const QString& identifier) {
 }
 
 bool YSConnection::isContactId(const QString& jid) {
-    static QRegExp validId(R"(^\d+@s\.whatsapp\.net$)");
-    return validId.exactMatch(jid);
+    return Jid::parse(jid).isContact();
 }
 
 bool YSConnection::isGroupId(const QString& gid) {
-    static QRegExp validId(R"(^\d+-\d+@g\.us$)");
-    return validId.exactMatch(gid);
+    return Jid::parse(gid).isGroup();
 }
 
 QString YSConnection::getIdentifier(uint handle) {
-    auto i = mHandles.left.find(handle);
-    if( i == mHandles.left.end() )
+    Jid jid = mHandles.use(handle, mSweepGeneration);
+    if( !jid.isValid() )
         return "";
-    else
-        return i->second;
+    return jid.toString();
 }
 
 uint YSConnection::getHandle(const QString& id) {
-    auto i = mHandles.right.find(id);
-    if( i == mHandles.right.end() )
+    Jid jid = Jid::parse(id);
+    if( !jid.isValid() )
         return 0;
-    else
-        return i->second;
+    return mHandles.use(jid, mSweepGeneration);
+}
+
+/* Pinned handles are never reclaimed. A pure lookup: must neither count as a use
+ * of the handle nor touch the channel bookkeeping like findTextChannel() does.
+ * referenced holds the jids that queued or running work will look up later */
+bool YSConnection::isPinned(uint handle, const QSet<QString>& referenced) {
+    Jid jid = mHandles.jid(handle);
+    if(handle == selfHandle || !jid.isContact())
+        return true;
+    if(referenced.contains(jid.toString()))
+        return true;
+    if(mContactsSubscription.value(handle) == SubscriptionStateYes) // on the roster
+        return true;
+    if(!mRoomMembers.rooms(handle).isEmpty())
+        return true;
+    auto channel = mTextChannels.constFind(handle);
+    return channel != mTextChannels.constEnd() && !BaseChannelPtr(channel.value()).isNull();
+}
+
+/*
+ * Drops contacts that are neither pinned nor were used during the grace period,
+ * e.g. members of groups we left and one-off senders. Every entry point taking a
+ * handle from a client records its use, so a handle a client still works with stays
+ * alive. Handles are never reused, so a client holding a reclaimed handle gets an
+ * error instead of another contact.
+ */
+void YSConnection::reclaimHandles() {
+    ++mSweepGeneration;
+
+    QSet<QString> referenced = mOutgoingQueue->jids() + mMediaUploader->jids()
+                               + mChatStates->jids() + mAvatarCache->jids();
+    for(auto i = mHeldMessages.begin(); i != mHeldMessages.end(); ++i)
+        for(const HeldMessage& held : i.value())
+            referenced.insert(held.entry.senderId);
+
+    QList<uint> unused;
+    for(uint handle : mHandles.handles())
+        if(mSweepGeneration - mHandles.lastUsed(handle) > HANDLE_GRACE_SWEEPS && !isPinned(handle, referenced))
+            unused << handle;
+    if(unused.isEmpty())
+        return;
+
+    Tp::HandleIdentifierMap removals;
+    for(uint handle : unused) {
+        if(mHandles.contains(handle)) {
+            removals[handle] = mHandles.jid(handle).toString();
+            mHandles.remove(handle);
+        }
+        mContactsSubscription.remove(handle);
+        mPresences.remove(handle);
+        mAvatarTokens.remove(handle);
+        contactChanged(handle);
+    }
+    if(!contactListIface.isNull())
+        contactListIface->contactsChangedWithID(Tp::ContactSubscriptionMap(), Tp::HandleIdentifierMap(), removals);
+
+    qDebug() << "YSConnection::reclaimHandles: reclaimed " << removals.size()
+             << " contacts, " << mHandles.size() << " handles left";
 }
 
 bool YSConnection::isValidHandle(uint handle) {
@@ -1045,6 +2135,22 @@ uint YSConnection::ensureContact(QString jid) {
     return handle;
 }
 
+/* Like ensureContact, but adds all unknown jids in one go. Returns the handles of all jids */
+Tp::UIntList YSConnection::ensureContacts(const QStringList& jids, bool emitSignals) {
+    QStringList unknown;
+    for(const QString& jid : jids)
+        if(!getHandle(jid))
+            unknown << jid;
+    unknown.removeDuplicates();
+    if(!unknown.isEmpty())
+        addContacts(unknown, emitSignals);
+
+    Tp::UIntList handles;
+    for(const QString& jid : jids)
+        handles << getHandle(jid);
+    return handles;
+}
+
 uint YSConnection::ensureGroup(QString gid) {
     Q_ASSERT(isGroupId(gid));
     uint handle = getHandle(gid);
@@ -1054,39 +2160,56 @@ uint YSConnection::ensureGroup(QString gid) {
 }
 
 uint YSConnection::addGroup(const QString& gid) {
-    uint handle = 0;
-    for (auto i : mHandles.left)
-        if( handle < i.first )
-            handle = i.first;
-
-    handle++; // id = maximum + 1, never 0
-    mHandles.left.insert( make_pair(handle, gid) );
+    /* Invalid ids would all pack to the same key */
+    Jid jid = Jid::parse(gid);
+    if(!jid.isGroup()) {
+        qWarning() << "YSConnection::addGroup: invalid group id " << gid;
+        return 0;
+    }
+    uint handle = ++mLastHandle; // never 0
+    mHandles.insert( handle, jid, mSweepGeneration );
 
     return handle;
 }
 
-uint YSConnection::addContacts(const QStringList& jids) {
-    uint handle = 0;
-    for (auto i : mHandles.left)
-        if( handle < i.first )
-            handle = i.first;
-
+/*
+ * Allocates handles for a batch of new contacts. They start with unknown presence and
+ * subscription state. If emitSignals is set, this is announced with a single presence
+ * change and a single contact list change for the whole batch. Invalid jids are skipped.
+ */
+Tp::UIntList YSConnection::addContacts(const QStringList& jids, bool emitSignals) {
     QList<uint> newHandles;
-    foreach(const QString& jid, jids) {
-        handle++; // id = maximum + 1, never 0
-        mHandles.left.insert( make_pair(handle, jid) );
+    QStringList newJids;
+    foreach(const QString& id, jids) {
+        /* Invalid ids would all pack to the same key */
+        Jid jid = Jid::parse(id);
+        if(!jid.isContact()) {
+            qWarning() << "YSConnection::addContacts: invalid contact id " << id;
+            continue;
+        }
+        uint handle = ++mLastHandle; // never 0
+        mHandles.insert( handle, jid, mSweepGeneration );
+        contactChanged(handle);
         newHandles << handle;
+        newJids << id;
     }
 
-    setPresenceState(newHandles, "unknown");
-    setSubscriptionState(jids, newHandles, SubscriptionStateUnknown);
+    if(emitSignals) {
+        setPresenceState(newHandles, "unknown");
+        setSubscriptionState(newJids, newHandles, SubscriptionStateUnknown);
+    } else {
+        for(uint handle : newHandles)
+            mContactsSubscription[handle] = SubscriptionStateUnknown;
+    }
+    if(newHandles.size() > 100)
+        qDebug() << "YSConnection::addContacts: imported " << newHandles.size() << " contacts";
 
-    return handle;
+    return newHandles;
 }
 
 uint YSConnection::addContact(const QString &jid) {
-
-    return addContacts(QStringList() << jid);
+    Tp::UIntList handles = addContacts(QStringList() << jid);
+    return handles.isEmpty() ? 0 : handles.last();
 }
 
 void YSConnection::setSubscriptionState(const QStringList& jids, const QList<uint> handles, uint state) {
@@ -1108,6 +2231,7 @@ void YSConnection::setSubscriptionState(const QStringList& jids, const QList<uin
         changes[handles[i]] = change;
         identifiers[handles[i]] = jids[i];
         mContactsSubscription[handles[i]] = state;
+        contactChanged(handles[i]);
     }
     Tp::HandleIdentifierMap removals;
     contactListIface->contactsChangedWithID(changes, identifiers, removals);
@@ -1123,24 +2247,31 @@ Tp::SimplePresence YSConnection::getPresence(uint handle) {
 }
 
 void YSConnection::setPresenceState(const QList<uint> handles, const QString& status) {
+    QHash<uint,QString> statuses;
+    foreach( uint handle, handles)
+        statuses[handle] = status;
+    setPresenceStates(statuses);
+}
+
+void YSConnection::setPresenceStates(const QHash<uint,QString>& statuses) {
     if(simplePresenceIface.isNull())
         return;
 
     Tp::SimpleContactPresences newPresences;
     SimpleStatusSpecMap statusSpecMap = Protocol::getSimpleStatusSpecMap();
-    foreach( uint handle, handles) {
-        auto i = statusSpecMap.find(status);
+    for(auto j = statuses.begin(); j != statuses.end(); ++j) {
+        auto i = statusSpecMap.find(j.value());
         if(i == statusSpecMap.end()) {
-            qDebug() << "YSConnection::setPresenceState: status not found: " << status;
-            return;
+            qDebug() << "YSConnection::setPresenceState: status not found: " << j.value();
+            continue;
         }
         SimplePresence presence;
-        presence.status = status;
+        presence.status = j.value();
         presence.statusMessage = ""; //FIXME
         presence.type = i->type;
-        mPresences[handle] = presence;
-        newPresences[handle] = presence;
-
+        mPresences[j.key()] = presence;
+        contactChanged(j.key());
+        newPresences[j.key()] = presence;
     }
     simplePresenceIface->setPresences(newPresences);
 }
@@ -19,12 +19,30 @@
 #pragma once
 
 #include <tuple>
+#include <QElapsedTimer>
 #include <QHash>
+#include <QQueue>
+#include <QSet>
+#include <QTemporaryDir>
+#include <QTimer>
 #include <TelepathyQt/BaseConnection>
 #include <TelepathyQt/BaseChannel>
-#include <boost/bimap.hpp>
 
 #include "pythoninterface.h"
+#include "messagejournal.h"
+#include "outgoingqueue.h"
+#include "roommembers.h"
+#include "avatarcache.h"
+#include "chatstates.h"
+#include "handletable.h"
+#include "linkmonitor.h"
+#include "duplicatefilter.h"
+#include "contactsynccache.h"
+#include "trace.h"
+#include "mediafetcher.h"
+#include "mediauploader.h"
+#include "pendingbudget.h"
+#include "connectionmetrics.h"
 
 //There is no client with support for that
 //#define USE_CAPTCHA_FOR_REGISTRATION
@@ -53,6 +71,8 @@ public:
     uint setPresence(const QString& status, const QString& message, Tp::DBusError* error);
     Tp::ContactAttributesMap getContactListAttributes(const QStringList& interfaces, bool hold, Tp::DBusError* error);
     void requestSubscription(const Tp::UIntList& contacts, const QString& message, Tp::DBusError* error);
+    Tp::AvatarTokenMap getKnownAvatarTokens(const Tp::UIntList& contacts, Tp::DBusError* error);
+    void requestAvatars(const Tp::UIntList& contacts, Tp::DBusError* error);
 
 
     void getContactsByVCardField(const QString& field, const QStringList& addresses,const QStringList& interfaces,
@@ -69,6 +89,10 @@ public:
     void cancelCaptcha(uint reason, const QString& debugMessage, Tp::DBusError* error);
 #endif
     void listRooms(Tp::BaseChannelRoomListTypePtr roomListType, Tp::DBusError* error);
+    void stopListingRooms(Tp::BaseChannelRoomListTypePtr roomListType, Tp::DBusError* error);
+
+    /* Counters for debugging, exported by ConnectionMetrics and logged on connection loss */
+    QVariantMap metrics() const;
 private slots:
     void on_yowsup_auth_success(QString phonenumber);
     void on_yowsup_auth_fail(QString mobilenumber, QString reason);
@@ -103,9 +127,59 @@ private slots:
     void on_yowsup_group_subjectReceived(QString msgId,QString fromAttribute,QString author,QString newSubject,uint timestamp,bool receiptRequested);
     void on_yowsup_profile_setStatusSuccess(QString jid, QString msgId);
     void on_yowsup_group_gotInfo(QString gid, QString jid, QString subject, QString subjectOwner, qlonglong subjectT, qlonglong creation);
+    void on_yowsup_group_gotParticipants(QString gid, QString jids);
+    void on_yowsup_group_infoError(QString errorCode);
+
+    void on_journal_committed();
+    void on_outgoing_messageFailed(const QString& token, const QString& jid);
+    void on_avatars_fetchRequested(const QString& jid);
+    void on_avatars_avatarRetrieved(const QString& jid, const QString& token, const QByteArray& data);
+    void on_yowsup_contact_gotProfilePictureId(QString jid, int pictureId, QString filename);
+    void on_yowsup_contact_gotProfilePicture(QString jid, QString filename);
+    void on_yowsup_contact_typing(QString jid);
+    void on_yowsup_contact_paused(QString jid);
+    void on_chatstates_remoteStateChanged(const QString& jid, uint state);
+    void on_chatstates_sendTyping(const QString& jid);
+    void on_chatstates_sendPaused(const QString& jid);
+    void on_yowsup_pong();
+    void on_link_sendPing();
+    void on_link_stalled();
+    void on_replay_finished();
+    void on_media_fetched(const QString& url, const QString& filename);
+    void on_media_failed(const QString& url);
+    void on_uploads_requestUpload(const QString& hash, const QString& type, qint64 size);
+    void on_uploads_progress(const QString& token, const QString& jid, int percent);
+    void on_uploads_uploaded(const QString& token, const QString& jid, const OutgoingQueue::Media& media);
+    void on_uploads_failed(const QString& token, const QString& jid, const QString& reason);
+    void on_yowsup_media_uploadRequestSuccess(QString hash, QString url, int resumeFrom);
+    void on_yowsup_media_uploadRequestFailed(QString hash);
+    void on_yowsup_media_uploadRequestDuplicate(QString hash, QString url);
+    void reconnect();
+    void on_yowsup_reader_exited();
+    void readerExitTimedOut();
+    void ingestGroupInfos();
+    void groupFetchTimedOut();
+    void sendRoomListPages();
+    void flushPresences();
+    void reclaimHandles();
+    void reapChannels();
+    void pageInPending();
+    void textChannelClosed();
 private:
+    void updateRoomInfo(uint roomHandle);
+    void fetchGroups();
+    void pumpGroupFetches();
+    void connectionLost();
+    void scheduleReconnect();
+    void startReader();
+    void startSession();
+    void resumeSession();
+    void logMetrics();
+    void deliverMessage(const MessageJournal::Entry& entry, bool pagedIn = false);
     void yowsup_messageReceived(QString msgId, QString jid, const Tp::MessagePartList& body, uint timestamp,
-                                bool wantsReceipt, const QString &gid = QString());
+                                bool wantsReceipt, const QString &gid = QString(),
+                                const QString& mediaUrl = QString());
+    void mediaDone(const QString& url, const Tp::MessagePart& file);
     void yowsup_linked_data_received(const char* type, QString msgId, QString jid, QString preview,
                                      QString url,QString size,bool wantsReceipt,const QString& gid = QString());
     void yowsup_vcard_received(QString msgId,QString jid,QString name, QString data,bool wantsReceipt, QString gid = QString());
@@ -120,33 +194,65 @@ private:
     Tp::HandleType getType(uint handle);
     Tp::HandleType getType(const QString& id);
     bool isValidHandle(uint handle);
+    bool isPinned(uint handle, const QSet<QString>& referenced);
     uint getHandle(const QString& id);
     QString getIdentifier(uint handle);
     uint ensureHandle(QString id);
     uint addGroup(const QString& gid);
     uint ensureGroup(QString gid);
     uint addContact(const QString& jid);
-    uint addContacts(const QStringList& jid);
+    Tp::UIntList addContacts(const QStringList& jids, bool emitSignals = true);
     uint ensureContact(QString jid);
+    Tp::UIntList ensureContacts(const QStringList& jids, bool emitSignals = true);
+    Tp::BaseChannelPtr findTextChannel(uint targetHandle);
+    void touchChannel(uint targetHandle);
+    void releasePending(uint targetHandle);
+    void postDeliveryReport(const QString& id, const QString& msgId, uint status,
+                            const Tp::MessagePart& details = Tp::MessagePart());
+    QString sendAttachment(const QString& jid, const Tp::MessagePartList& message, Tp::DBusError* error);
+    void updateRoomMembers(uint roomHandle, const Tp::UIntList& added, const Tp::UIntList& removed);
     void setPresenceState(const QList<uint> handles, const QString& status);
+    void setPresenceStates(const QHash<uint,QString>& statuses);
     void setSubscriptionState(const QStringList& jid, const QList<uint> handles, uint state);
+    void setAvatarToken(const QString& jid, const QString& token);
     QString generateUID();
     QString formatSize(QString size_);
     Tp::SimplePresence getPresence(uint handle);
+    QVariantMap contactAttributes(uint handle);
+    void contactChanged(uint handle);
     Tp::BaseConnectionRequestsInterfacePtr requestsIface;
     Tp::BaseConnectionContactsInterfacePtr contactsIface;
     Tp::BaseConnectionSimplePresenceInterfacePtr simplePresenceIface;
     Tp::BaseConnectionContactListInterfacePtr contactListIface;
     Tp::BaseConnectionAddressingInterfacePtr addressingIface;
+    Tp::BaseConnectionAvatarsInterfacePtr avatarsIface;
 #ifdef USE_CAPTCHA_FOR_REGISTRATION
     /* Only valid during registration */
     Tp::BaseChannelCaptchaAuthenticationInterfacePtr captchaIface;
 #endif
     /* Maps ids to identifiers. handle "0" is never valid according to spec */
-    boost::bimap<uint,QString> mHandles;
+    HandleTable mHandles;
+    uint mLastHandle;
+    /* Contacts that are not pinned by a channel, room, roster entry or pending work are
+     * reclaimed when they were not looked up for HANDLE_GRACE_SWEEPS sweeps */
+    uint mSweepGeneration;
+    QTimer mHandleSweepTimer;
     /* Maps a contact handle to its subscription state */
     QHash<uint,uint> mContactsSubscription;
     Tp::SimpleContactPresences mPresences;
+    /* Attributes as returned by getContactAttributes, built on demand */
+    QHash<uint,QVariantMap> mContactAttributes;
+    /* Roster as returned by getContactListAttributes, updated with the contacts
+     * changed since the last call */
+    Tp::ContactAttributesMap mContactList;
+    QSet<uint> mChangedContacts;
+    /* Presence updates from yowsup, jid -> status, applied as one batch */
+    QHash<QString,QString> mPendingPresences;
+    QTimer mPresenceFlushTimer;
+    /* Maps a contact handle to its avatar token, "" if it has no picture */
+    QHash<uint,QString> mAvatarTokens;
+    AvatarCache* mAvatarCache;
+    ChatStates* mChatStates;
 
     struct Room {
         QString id;
@@ -155,9 +261,56 @@ private:
         QString subjectOwner;
         qlonglong subjectTimestamp;
         qlonglong creationTimestamp;
-        QList<uint> members;
     };
     QHash<uint,Room> rooms;
+    RoomMembers mRoomMembers;
+
+    /* Group metadata fetched after login: group_gotInfo is buffered and ingested in bulk,
+     * participant lists are requested with a bounded number of requests in flight */
+    QList<Room> mPendingGroupInfos;
+    QTimer mGroupIngestTimer;
+    QQueue<QString> mGroupFetchQueue;
+    QQueue<QString> mGroupFetchesInFlight;
+    /* group_infoError received for requests still in mGroupFetchesInFlight */
+    int mGroupFetchErrors;
+    /* Fires when no answers arrived for a while. group_getGroups has no end marker,
+     * for accounts without groups this is what completes the room list */
+    QTimer mGroupFetchTimeout;
+    /* Time since group_getGroups, to measure how long the room list takes to complete */
+    QElapsedTimer mGroupFetchTimer;
+    qint64 mRoomListCompleteMs;
+    /* Prebuilt RoomList entries, kept up to date as group info, subjects and members change */
+    QHash<uint,Tp::RoomInfo> mRoomInfoCache;
+    /* Running RoomList listings. Rooms are sent in pages, rooms that arrive while
+     * the room list is still loading are appended to all listings. Every room is
+     * sent at most once per listing, with its info as of the time it is sent */
+    struct RoomListing {
+        Tp::WeakPtr<Tp::BaseChannelRoomListType> roomListType;
+        QList<uint> remaining;
+        /* Rooms sent or in remaining */
+        QSet<uint> listed;
+    };
+    bool sendRoomListPage(RoomListing& listing, bool roomListComplete);
+    QList<RoomListing> mRoomListings;
+    QTimer mRoomListTimer;
+    /* Text channels by target handle, to update them without creating new ones */
+    QHash<uint,Tp::WeakPtr<Tp::BaseChannel> > mTextChannels;
+    /* Time of the last message, report or chat state of each text channel */
+    QHash<uint,qint64> mChannelActivity;
+    qint64 mChannelIdleMs;
+    QTimer mChannelReapTimer;
+
+    /* Downloads media of up to mMediaMaxSize bytes before delivering the message, if set */
+    MediaFetcher* mMediaFetcher;
+    qint64 mMediaMaxSize;
+    /* Received messages of chats with a media download in progress, by target id.
+     * They are journaled already but delivered in order once the downloads ahead
+     * of them are done. mediaUrl is empty unless the message waits for it */
+    struct HeldMessage {
+        MessageJournal::Entry entry;
+        QString mediaUrl;
+    };
+    QHash<QString,QList<HeldMessage> > mHeldMessages;
 
     /* increasing id for unique telepathy-ids */
     uint lastMessageId;
@@ -165,7 +318,47 @@ private:
 
     PythonInterface* pythonInterface;
 
+    /* Received messages not yet acknowledged by a client */
+    MessageJournal* mJournal;
+    /* Entries found in the journal at startup, delivered once we are connected */
+    QList<MessageJournal::Entry> mReplayEntries;
+    /* (jid, msgId) pairs to ack to the server after the next journal commit */
+    QList<QPair<QString,QString> > mPendingServerAcks;
+    /* Received messages in the pending lists of channels, by target handle */
+    PendingBudget mPendingMessages;
+    /* Recently received messages, the server redelivers those it did not see acked */
+    DuplicateFilter mReceivedMessages;
+
+    /* Messages sent by clients, retransmitted after reconnects */
+    OutgoingQueue* mOutgoingQueue;
+    MediaUploader* mMediaUploader;
+
+    /* Reconnecting after network errors, without dropping handles and channels */
+    QTimer mReconnectTimer;
+    int mReconnectAttempts;
+    /* Runs while waiting for the reader of the lost connection to exit */
+    QTimer mReaderExitTimer;
+    /* Set while logging in again after a connection loss */
+    bool mResuming;
+    /* Time since the connection was lost */
+    QElapsedTimer mOutageTimer;
+    /* Time to usable after the last connection loss, -1 if there was none */
+    qint64 mLastOutageMs;
+    /* Keepalive probes and round trip times */
+    LinkMonitor* mLinkMonitor;
+
+    /* Results of address book syncs */
+    ContactSyncCache* mContactSync;
+    /* Set from WHOSTHERE_RECORD and WHOSTHERE_REPLAY, for debugging */
+    TraceRecorder* mTraceRecorder;
+    TraceReplayer* mTraceReplayer;
+    /* Holds journal, caches and indexes while replaying */
+    QTemporaryDir* mReplayDirectory;
+    /* Exports metrics() on D-Bus once connect() was called */
+    ConnectionMetrics* mMetrics;
+
     QString mPhoneNumber;
+    QString mCountryCode;
     QByteArray mPassword;
     YowsupInterface yowsupInterface;
 };
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QVariantMap>
+
+class YSConnection;
+
+/*
+ * Exports the counters of a connection on D-Bus, next to the connection at
+ * <connection path>/Debug, so that they can be read while it is running:
+ *
+ *   qdbus <bus name> <connection path>/Debug Metrics
+ */
+class ConnectionMetrics : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ConnectionMetrics)
+    Q_CLASSINFO("D-Bus Interface", "im.telepathy.whosthere.Debug")
+public:
+    ConnectionMetrics(YSConnection* connection);
+
+public slots:
+    Q_SCRIPTABLE QVariantMap Metrics() const;
+
+private:
+    YSConnection* mConnection;
+};
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include "contactsynccache.h"
+
+static const quint32 CACHE_MAGIC = 0x59534331; // "YSC1"
+/* People join WhatsApp more often than they leave it, so negative results expire sooner */
+static const qint64 REGISTERED_TTL_MS = 7*24*3600*1000LL;
+static const qint64 UNREGISTERED_TTL_MS = 24*3600*1000LL;
+
+ContactSyncCache::ContactSyncCache(const QString& filename)
+    : mFilename(filename), mDirty(false), mHits(0), mSynced(0)
+{
+    load();
+}
+
+void ContactSyncCache::load()
+{
+    QFile file(mFilename);
+    if(!file.open(QIODevice::ReadOnly))
+        return;
+    QDataStream in(&file);
+    quint32 magic;
+    in >> magic;
+    if(magic != CACHE_MAGIC) {
+        qWarning() << "ContactSyncCache::load: ignoring " << mFilename;
+        return;
+    }
+    while(!in.atEnd() && in.status() == QDataStream::Ok) {
+        QString address;
+        Result result;
+        in >> address >> result.number >> result.registered >> result.syncedMs;
+        if(in.status() == QDataStream::Ok)
+            mResults.insert(address, result);
+    }
+    qDebug() << "ContactSyncCache::load: " << mResults.size() << " addresses";
+}
+
+void ContactSyncCache::save()
+{
+    if(!mDirty)
+        return;
+    QDir().mkpath(QFileInfo(mFilename).path());
+    QFile file(mFilename + ".tmp");
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "ContactSyncCache::save: cannot write " << file.fileName();
+        return;
+    }
+    QDataStream out(&file);
+    out << CACHE_MAGIC;
+    for(auto i = mResults.constBegin(); i != mResults.constEnd(); ++i)
+        out << i.key() << i->number << i->registered << i->syncedMs;
+    file.close();
+    QFile::remove(mFilename);
+    if(file.rename(mFilename))
+        mDirty = false;
+}
+
+QStringList ContactSyncCache::stale(const QStringList& addresses) const
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QStringList ret;
+    for(const QString& address : addresses) {
+        auto i = mResults.find(address);
+        if(i == mResults.end()
+           || now - i->syncedMs > (i->registered ? REGISTERED_TTL_MS : UNREGISTERED_TTL_MS))
+            ret << address;
+    }
+    ret.removeDuplicates();
+    return ret;
+}
+
+bool ContactSyncCache::lookup(const QString& address, Result* result) const
+{
+    auto i = mResults.find(address);
+    if(i == mResults.end())
+        return false;
+    *result = i.value();
+    return true;
+}
+
+void ContactSyncCache::update(const QString& address, const QString& number, bool registered)
+{
+    Result& result = mResults[address];
+    result.number = number;
+    result.registered = registered;
+    result.syncedMs = QDateTime::currentMSecsSinceEpoch();
+    mDirty = true;
+    ++mSynced;
+}
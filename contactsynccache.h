@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QString>
+#include <QStringList>
+
+/*
+ * Persisted results of contact syncs, so that only addresses that are new or
+ * whose result expired have to be sent to the server again.
+ */
+class ContactSyncCache
+{
+public:
+    ContactSyncCache(const QString& filename);
+
+    struct Result {
+        Result() : registered(false), syncedMs(0) {}
+        /* Number as normalized by the server, e.g. "491234567890" */
+        QString number;
+        bool registered;
+        qint64 syncedMs;
+    };
+
+    /* The addresses without a valid result */
+    QStringList stale(const QStringList& addresses) const;
+    bool lookup(const QString& address, Result* result) const;
+    void update(const QString& address, const QString& number, bool registered);
+    /* Writes the cache to disk if it changed */
+    void save();
+
+    /* Addresses answered from the cache / sent to the server, since startup */
+    qint64 hitCount() const { return mHits; }
+    qint64 syncedCount() const { return mSynced; }
+    void countHits(int hits) { mHits += hits; }
+
+private:
+    void load();
+
+    QString mFilename;
+    QHash<QString,Result> mResults;
+    bool mDirty;
+    qint64 mHits;
+    qint64 mSynced;
+};
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "duplicatefilter.h"
+
+DuplicateFilter::DuplicateFilter(int capacity)
+    : mCapacity(capacity), mDuplicates(0)
+{
+    mIndex.reserve(capacity + 1);
+}
+
+bool DuplicateFilter::seen(const QString& sender, const QString& msgId)
+{
+    QString key = sender + QLatin1Char('/') + msgId;
+
+    auto i = mIndex.find(key);
+    if(i != mIndex.end()) {
+        mOrder.splice(mOrder.begin(), mOrder, i.value());
+        ++mDuplicates;
+        return true;
+    }
+
+    mOrder.push_front(key);
+    mIndex.insert(key, mOrder.begin());
+    if(mIndex.size() > mCapacity) {
+        mIndex.remove(mOrder.back());
+        mOrder.pop_back();
+    }
+    return false;
+}
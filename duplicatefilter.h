@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <list>
+#include <QHash>
+#include <QString>
+
+/*
+ * Remembers the last CAPACITY received (sender, msgId) pairs, to drop messages
+ * the server delivers again after a reconnect.
+ *
+ * An exact LRU: one hash lookup per message, no false positives, and memory
+ * bounded by the capacity. Seeing a message again makes it the most recent.
+ */
+class DuplicateFilter
+{
+public:
+    DuplicateFilter(int capacity = 4096);
+
+    /* Returns true if the message was seen before, remembers it otherwise */
+    bool seen(const QString& sender, const QString& msgId);
+    int size() const { return mIndex.size(); }
+    /* Number of duplicates found so far */
+    qint64 duplicateCount() const { return mDuplicates; }
+
+private:
+    int mCapacity;
+    /* Most recently seen first */
+    std::list<QString> mOrder;
+    QHash<QString,std::list<QString>::iterator> mIndex;
+    qint64 mDuplicates;
+};
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "handletable.h"
+
+uint HandleTable::use(const Jid& jid, uint generation)
+{
+    uint handle = mHandles.value(jid);
+    if(handle)
+        use(handle, generation);
+    return handle;
+}
+
+Jid HandleTable::use(uint handle, uint generation)
+{
+    auto i = mEntries.find(handle);
+    if(i == mEntries.end())
+        return Jid();
+    i->lastUsed = generation;
+    return i->jid;
+}
+
+void HandleTable::insert(uint handle, const Jid& jid, uint generation)
+{
+    mHandles.insert(jid, handle);
+    Entry entry;
+    entry.jid = jid;
+    entry.lastUsed = generation;
+    mEntries.insert(handle, entry);
+}
+
+void HandleTable::remove(uint handle)
+{
+    auto i = mEntries.find(handle);
+    if(i == mEntries.end())
+        return;
+    mHandles.remove(i->jid);
+    mEntries.erase(i);
+}
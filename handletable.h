@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include "jid.h"
+
+/*
+ * Registry of handles, both directions keyed by packed ids.
+ * A handle costs two hash nodes of 16 byte keys instead of an id string.
+ *
+ * Each handle also carries the generation it was last used in, updated in
+ * place by use(), so that lookups never insert into a hash.
+ */
+class HandleTable
+{
+public:
+    /* 0 if id is not known */
+    uint handle(const Jid& jid) const { return mHandles.value(jid); }
+    /* Invalid if handle is not known */
+    Jid jid(uint handle) const { return mEntries.value(handle).jid; }
+    bool contains(uint handle) const { return mEntries.contains(handle); }
+    /* Like handle(), but records the use in generation */
+    uint use(const Jid& jid, uint generation);
+    /* Like jid(), but records the use in generation */
+    Jid use(uint handle, uint generation);
+    /* Generation of the last use */
+    uint lastUsed(uint handle) const { return mEntries.value(handle).lastUsed; }
+
+    void insert(uint handle, const Jid& jid, uint generation);
+    void remove(uint handle);
+    QList<uint> handles() const { return mEntries.keys(); }
+    int size() const { return mEntries.size(); }
+
+private:
+    struct Entry {
+        Entry() : lastUsed(0) {}
+        Jid jid;
+        uint lastUsed;
+    };
+    QHash<Jid,uint> mHandles;
+    QHash<uint,Entry> mEntries;
+};
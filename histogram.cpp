@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "histogram.h"
+
+/* The last bucket also takes everything above 2^BUCKET_COUNT ms */
+static const int BUCKET_COUNT = 24;
+
+Histogram::Histogram() : mBuckets(BUCKET_COUNT)
+{
+    reset();
+}
+
+void Histogram::record(qint64 ms)
+{
+    ms = qMax(ms, qint64(0));
+    int bucket = 0;
+    while(bucket < BUCKET_COUNT - 1 && (ms >> (bucket + 1)))
+        ++bucket;
+    ++mBuckets[bucket];
+
+    if(!mCount || ms < mMin)
+        mMin = ms;
+    if(!mCount || ms > mMax)
+        mMax = ms;
+    ++mCount;
+    mSum += ms;
+}
+
+void Histogram::reset()
+{
+    mBuckets.fill(0);
+    mCount = mSum = mMin = mMax = 0;
+}
+
+qint64 Histogram::percentile(int p) const
+{
+    if(!mCount)
+        return 0;
+    qint64 rank = (mCount * p + 99) / 100;
+    qint64 seen = 0;
+    for(int i = 0; i < BUCKET_COUNT; ++i) {
+        seen += mBuckets[i];
+        if(seen >= rank)
+            return qMin(qint64(1) << (i + 1), mMax);
+    }
+    return mMax;
+}
+
+QString Histogram::summary() const
+{
+    return QString("n=%1 min=%2 p50<=%3 p90<=%4 p99<=%5 max=%6")
+            .arg(mCount).arg(mMin).arg(percentile(50)).arg(percentile(90))
+            .arg(percentile(99)).arg(mMax);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QString>
+#include <QVector>
+
+/*
+ * Latency histogram with power-of-two buckets: bucket i counts samples in
+ * [2^i, 2^(i+1)) ms. Fixed size, so it can record samples forever.
+ */
+class Histogram
+{
+public:
+    Histogram();
+
+    void record(qint64 ms);
+    void reset();
+    qint64 count() const { return mCount; }
+    qint64 min() const { return mMin; }
+    qint64 max() const { return mMax; }
+    qint64 mean() const { return mCount ? mSum / mCount : 0; }
+    /* Upper bound of the bucket containing the p-th percentile, 0 < p <= 100 */
+    qint64 percentile(int p) const;
+    /* e.g. "n=12 min=80 p50<=128 p90<=256 p99<=512 max=301" */
+    QString summary() const;
+
+private:
+    QVector<qint64> mBuckets;
+    qint64 mCount;
+    qint64 mSum;
+    qint64 mMin;
+    qint64 mMax;
+};
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "jid.h"
+
+static const QString CONTACT_SUFFIX = "@s.whatsapp.net";
+static const QString GROUP_SUFFIX = "@g.us";
+/* E.164 numbers have at most 15 digits, 19 always fit into a quint64 */
+static const int MAX_USER_DIGITS = 19;
+static const int MAX_CREATED_DIGITS = 10;
+
+/* Parses digits without leading zeros, so that toString() gives back the same id */
+static bool parseNumber(const QStringRef& digits, int maxDigits, quint64* number)
+{
+    if(digits.isEmpty() || digits.size() > maxDigits || digits.at(0) == QLatin1Char('0'))
+        return false;
+    quint64 n = 0;
+    for(int i = 0; i < digits.size(); ++i) {
+        QChar c = digits.at(i);
+        if(c < QLatin1Char('0') || c > QLatin1Char('9'))
+            return false;
+        n = n * 10 + (c.unicode() - '0');
+    }
+    *number = n;
+    return true;
+}
+
+Jid Jid::parse(const QString& id)
+{
+    Jid jid;
+    if(id.endsWith(CONTACT_SUFFIX)) {
+        if(parseNumber(id.leftRef(id.size() - CONTACT_SUFFIX.size()), MAX_USER_DIGITS, &jid.mUser))
+            jid.mType = Contact;
+    } else if(id.endsWith(GROUP_SUFFIX)) {
+        QStringRef name = id.leftRef(id.size() - GROUP_SUFFIX.size());
+        int dash = name.indexOf(QLatin1Char('-'));
+        quint64 created;
+        if(dash > 0
+           && parseNumber(name.left(dash), MAX_USER_DIGITS, &jid.mUser)
+           && parseNumber(name.mid(dash + 1), MAX_CREATED_DIGITS, &created)
+           && created <= 0xffffffffu) {
+            jid.mCreated = created;
+            jid.mType = Group;
+        }
+    }
+    if(!jid.isValid())
+        return Jid();
+    return jid;
+}
+
+QString Jid::toString() const
+{
+    switch(mType) {
+    case Contact:
+        return QString::number(mUser) + CONTACT_SUFFIX;
+    case Group:
+        return QString::number(mUser) + QLatin1Char('-') + QString::number(mCreated) + GROUP_SUFFIX;
+    default:
+        return QString();
+    }
+}
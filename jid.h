@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QString>
+
+/*
+ * A WhatsApp id in packed form.
+ *
+ * Contact ids are "<number>@s.whatsapp.net", group ids "<creator>-<timestamp>@g.us".
+ * Both are stored as integers, so they hash and compare without touching
+ * strings. The string form is only built when it is needed, e.g. for D-Bus.
+ */
+class Jid
+{
+public:
+    enum Type {
+        Invalid,
+        Contact,
+        Group
+    };
+
+    Jid() : mUser(0), mCreated(0), mType(Invalid) {}
+    /* Returns an invalid Jid if id is malformed */
+    static Jid parse(const QString& id);
+
+    Type type() const { return Type(mType); }
+    bool isValid() const { return mType != Invalid; }
+    bool isContact() const { return mType == Contact; }
+    bool isGroup() const { return mType == Group; }
+    /* The phone number of a contact, or of the creator of a group */
+    quint64 user() const { return mUser; }
+    /* Creation time of a group, 0 for contacts */
+    quint32 created() const { return mCreated; }
+    QString toString() const;
+
+    bool operator==(const Jid& other) const {
+        return mUser == other.mUser && mCreated == other.mCreated && mType == other.mType;
+    }
+    bool operator!=(const Jid& other) const { return !(*this == other); }
+
+private:
+    quint64 mUser;
+    quint32 mCreated;
+    quint8 mType;
+};
+
+inline uint qHash(const Jid& jid, uint seed = 0)
+{
+    return qHash(jid.user() ^ (quint64(jid.created()) << 40) ^ jid.type(), seed);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QDateTime>
+#include "linkmonitor.h"
+#include "pythoninterface.h"
+
+static const int CHECK_INTERVAL_MS = 5000;
+static const int PROBE_IDLE_MS = 45000;
+static const int STALL_TIMEOUT_MS = 20000;
+
+LinkMonitor::LinkMonitor(const YowsupInterface* yowsup, QObject* parent)
+    : QObject(parent), mYowsup(yowsup), mPingSentMs(0), mStalls(0)
+{
+    mTimer.setInterval(CHECK_INTERVAL_MS);
+    QObject::connect(&mTimer, SIGNAL(timeout()), this, SLOT(check()));
+}
+
+void LinkMonitor::start()
+{
+    mPingSentMs = 0;
+    mTimer.start();
+}
+
+void LinkMonitor::stop()
+{
+    mPingSentMs = 0;
+    mTimer.stop();
+}
+
+void LinkMonitor::pong()
+{
+    if(!mPingSentMs)
+        return;
+    mRtt.record(QDateTime::currentMSecsSinceEpoch() - mPingSentMs);
+    mPingSentMs = 0;
+}
+
+qint64 LinkMonitor::silenceMs() const
+{
+    qint64 lastEvent = mYowsup->lastEventMs();
+    return lastEvent ? QDateTime::currentMSecsSinceEpoch() - lastEvent : 0;
+}
+
+void LinkMonitor::check()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 lastEvent = mYowsup->lastEventMs();
+
+    if(mPingSentMs) {
+        qint64 sent = mPingSentMs;
+        if(now - sent < STALL_TIMEOUT_MS)
+            return;
+        mPingSentMs = 0;
+        /* Other traffic arrived, so only the pong got lost */
+        if(lastEvent >= sent)
+            return;
+        ++mStalls;
+        emit stalled();
+        return;
+    }
+    if(now - lastEvent >= PROBE_IDLE_MS) {
+        mPingSentMs = now;
+        emit sendPing();
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QObject>
+#include <QTimer>
+#include "histogram.h"
+
+class YowsupInterface;
+
+/*
+ * Keepalive probing of the link to the WhatsApp server.
+ *
+ * When nothing was received for PROBE_IDLE_MS, a ping is sent and its round
+ * trip time recorded. If neither the pong nor anything else arrives within
+ * STALL_TIMEOUT_MS, the link is considered stalled, long before TCP would
+ * notice a dead connection.
+ */
+class LinkMonitor : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(LinkMonitor)
+public:
+    LinkMonitor(const YowsupInterface* yowsup, QObject* parent = 0);
+
+    /* Probe while logged in */
+    void start();
+    void stop();
+    /* The server answered our ping */
+    void pong();
+
+    /* Time since anything was received from the server */
+    qint64 silenceMs() const;
+    const Histogram& rtt() const { return mRtt; }
+    int stallCount() const { return mStalls; }
+
+signals:
+    void sendPing();
+    void stalled();
+
+private slots:
+    void check();
+
+private:
+    const YowsupInterface* mYowsup;
+    QTimer mTimer;
+    /* Time our outstanding ping was sent, 0 if none */
+    qint64 mPingSentMs;
+    Histogram mRtt;
+    int mStalls;
+};
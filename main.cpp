@@ -18,6 +18,7 @@
 
 #include <QCoreApplication>
 #include <QDebug>
+#include <QElapsedTimer>
 
 #include <TelepathyQt/BaseConnectionManager>
 #include <TelepathyQt/Constants>
@@ -25,12 +26,13 @@
 #include <TelepathyQt/Types>
 
 #include "protocol.h"
-#include "pythoninterface.h"
 
 using namespace Tp;
 
 int main(int argc, char *argv[])
 {
+    QElapsedTimer startupTimer;
+    startupTimer.start();
     QCoreApplication a(argc, argv);
     
     Tp::registerTypes();
@@ -44,7 +46,8 @@ int main(int argc, char *argv[])
             QDBusConnection::sessionBus(), QLatin1String("whosthere"));
     cm->addProtocol(proto);
     cm->registerObject();
+    /* Python is only brought up when the first connection is created */
+    qDebug() << "Bus name registered after " << startupTimer.nsecsElapsed()/1000 << " us";
 
-    PythonInterface::initPython();
     return a.exec();
 }
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <utime.h>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QSet>
+#include <QUrl>
+#include "mediafetcher.h"
+
+static const quint32 INDEX_MAGIC = 0x59534d31; // "YSM1"
+static const int MAX_DOWNLOADS_IN_FLIGHT = 2;
+static const int MAX_ATTEMPTS = 3;
+/* Keeps memory bounded when the disk is slower than the network */
+static const qint64 READ_BUFFER_SIZE = 64*1024;
+static const int STALL_CHECK_INTERVAL_MS = 10*1000;
+static const qint64 STALL_TIMEOUT_MS = 60*1000;
+static const qint64 MAX_CACHE_BYTES = 512*1024*1024LL;
+/* Evicting down to this leaves room for a couple of downloads before the next scan */
+static const qint64 EVICT_TO_BYTES = MAX_CACHE_BYTES*3/4;
+
+MediaFetcher::MediaFetcher(const QString& directory, const QString& indexFilename, QObject* parent)
+    : QObject(parent), mDirectory(directory), mIndexFilename(indexFilename),
+      mCacheBytes(-1), mHits(0), mMisses(0), mBytesDownloaded(0), mDownloadMs(0)
+{
+    QDir().mkpath(mDirectory + "/partial");
+    mNetwork = new QNetworkAccessManager(this);
+    mStallTimer.setInterval(STALL_CHECK_INTERVAL_MS);
+    QObject::connect(&mStallTimer, SIGNAL(timeout()), this, SLOT(abortStalled()));
+    loadIndex();
+}
+
+/* Partial files are kept, the next download of the same url resumes them */
+MediaFetcher::~MediaFetcher()
+{
+    for(auto i = mDownloads.begin(); i != mDownloads.end(); ++i) {
+        i->reply->disconnect(this);
+        i->reply->abort();
+        delete i->file;
+    }
+}
+
+void MediaFetcher::loadIndex()
+{
+    QFile file(mIndexFilename);
+    if(!file.open(QIODevice::ReadOnly))
+        return;
+    QDataStream in(&file);
+    quint32 magic;
+    in >> magic;
+    if(magic != INDEX_MAGIC) {
+        qWarning() << "MediaFetcher::loadIndex: ignoring " << mIndexFilename;
+        return;
+    }
+    in >> mIndex;
+    /* Files may have been evicted by another account */
+    for(auto i = mIndex.begin(); i != mIndex.end(); ) {
+        if(QFile::exists(mDirectory + "/" + i.value()))
+            ++i;
+        else
+            i = mIndex.erase(i);
+    }
+    qDebug() << "MediaFetcher::loadIndex: " << mIndex.size() << " files";
+}
+
+void MediaFetcher::saveIndex()
+{
+    QDir().mkpath(QFileInfo(mIndexFilename).path());
+    QFile file(mIndexFilename + ".tmp");
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "MediaFetcher::saveIndex: cannot write " << file.fileName();
+        return;
+    }
+    QDataStream out(&file);
+    out << INDEX_MAGIC << mIndex;
+    file.close();
+    QFile::remove(mIndexFilename);
+    file.rename(mIndexFilename);
+}
+
+void MediaFetcher::fetch(const QString& url, qint64 size)
+{
+    QString scheme = QUrl(url).scheme();
+    if(scheme != "http" && scheme != "https") {
+        qWarning() << "MediaFetcher::fetch: refusing " << url;
+        emit failed(url);
+        return;
+    }
+    auto cached = mIndex.find(url);
+    if(cached != mIndex.end()) {
+        QString filename = mDirectory + "/" + cached.value();
+        if(QFile::exists(filename)) {
+            ++mHits;
+            /* The modification time orders files for eviction */
+            utime(QFile::encodeName(filename).constData(), 0);
+            emit fetched(url, filename);
+            return;
+        }
+        /* Somebody cleaned up the cache */
+        mIndex.erase(cached);
+    }
+    if(mDownloads.contains(url) || mQueued.contains(url))
+        return;
+    ++mMisses;
+    mQueue.enqueue(url);
+    mQueued[url] = size;
+    pump();
+}
+
+void MediaFetcher::pump()
+{
+    while(mDownloads.size() < MAX_DOWNLOADS_IN_FLIGHT && !mQueue.isEmpty()) {
+        QString url = mQueue.dequeue();
+        start(url, mQueued.take(url));
+    }
+    if(mDownloads.isEmpty())
+        mStallTimer.stop();
+    else if(!mStallTimer.isActive())
+        mStallTimer.start();
+}
+
+void MediaFetcher::start(const QString& url, qint64 size)
+{
+    Download& download = mDownloads[url];
+    if(!download.file) {
+        download.size = size;
+        QString key = QCryptographicHash::hash(url.toUtf8(), QCryptographicHash::Sha1).toHex();
+        download.file = new QFile(mDirectory + "/partial/" + key);
+        if(!download.file->open(QIODevice::WriteOnly | QIODevice::Append)) {
+            qWarning() << "MediaFetcher::start: cannot write " << download.file->fileName();
+            fail(url);
+            return;
+        }
+    }
+
+    QNetworkRequest request((QUrl(url)));
+    qint64 offset = download.file->size();
+    if(offset > 0)
+        request.setRawHeader("Range", "bytes=" + QByteArray::number(offset) + "-");
+    ++download.attempts;
+    download.received = 0;
+    download.startedMs = download.lastProgressMs = QDateTime::currentMSecsSinceEpoch();
+    download.reply = mNetwork->get(request);
+    download.reply->setReadBufferSize(READ_BUFFER_SIZE);
+    mReplyUrls[download.reply] = url;
+    QObject::connect(download.reply, SIGNAL(readyRead()), this, SLOT(readyRead()));
+    QObject::connect(download.reply, SIGNAL(finished()), this, SLOT(finished()));
+    qDebug() << "MediaFetcher::start: " << url << " attempt " << download.attempts << " from offset " << offset;
+}
+
+/* Writes whatever arrived to the partial file */
+void MediaFetcher::readyRead()
+{
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(sender());
+    auto u = mReplyUrls.find(reply);
+    if(u == mReplyUrls.end())
+        return;
+    Download& download = mDownloads[u.value()];
+    if(download.giveUp)
+        return;
+
+    /* The server ignored the range request and sends everything again */
+    if(download.received == 0 && download.file->size() > 0
+       && reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() == 200)
+        download.file->resize(0);
+
+    QByteArray data = reply->readAll();
+    if(download.file->size() + data.size() > download.size) {
+        qWarning() << "MediaFetcher::readyRead: " << u.value() << " is larger than " << download.size << " bytes";
+        download.giveUp = true;
+        reply->abort();
+        return;
+    }
+    if(download.file->write(data) != data.size()) {
+        qWarning() << "MediaFetcher::readyRead: cannot write " << download.file->fileName()
+                   << ": " << download.file->errorString();
+        download.giveUp = true;
+        reply->abort();
+        return;
+    }
+    download.received += data.size();
+    download.lastProgressMs = QDateTime::currentMSecsSinceEpoch();
+    mBytesDownloaded += data.size();
+}
+
+void MediaFetcher::finished()
+{
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(sender());
+    auto u = mReplyUrls.find(reply);
+    if(u == mReplyUrls.end())
+        return;
+    QString url = u.value();
+    if(reply->error() == QNetworkReply::NoError)
+        readyRead();
+    mReplyUrls.erase(u);
+    reply->deleteLater();
+
+    Download& download = mDownloads[url];
+    download.reply = 0;
+    mDownloadMs += QDateTime::currentMSecsSinceEpoch() - download.startedMs;
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if(download.giveUp) {
+        qDebug() << "MediaFetcher::finished: " << url << " given up";
+        download.file->remove();
+        fail(url);
+    } else if(reply->error() == QNetworkReply::NoError && (status == 200 || status == 206)) {
+        complete(url);
+    } else if(download.attempts < MAX_ATTEMPTS && (status < 400 || status >= 500)) {
+        qDebug() << "MediaFetcher::finished: " << url << " failed: " << reply->errorString() << ", resuming";
+        start(url, download.size);
+    } else {
+        qDebug() << "MediaFetcher::finished: " << url << " failed: " << reply->errorString() << ", giving up";
+        download.file->remove();
+        fail(url);
+    }
+}
+
+/* Moves the partial file to its place in the cache */
+void MediaFetcher::complete(const QString& url)
+{
+    Download download = mDownloads.take(url);
+    download.file->close();
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if(download.file->open(QIODevice::ReadOnly)) {
+        hash.addData(download.file);
+        download.file->close();
+    }
+    QString suffix = QFileInfo(QUrl(url).path()).suffix();
+    QString name = hash.result().toHex() + (suffix.isEmpty() ? QString() : "." + suffix);
+    QString filename = mDirectory + "/" + name;
+
+    if(QFile::exists(filename))
+        download.file->remove();
+    else if(!download.file->rename(filename)) {
+        qWarning() << "MediaFetcher::complete: cannot move " << download.file->fileName() << " to " << filename;
+        download.file->remove();
+        delete download.file;
+        emit failed(url);
+        pump();
+        return;
+    }
+    delete download.file;
+    mIndex[url] = name;
+    if(mCacheBytes >= 0)
+        mCacheBytes += QFileInfo(filename).size();
+    if(mCacheBytes < 0 || mCacheBytes > MAX_CACHE_BYTES)
+        evict();
+    saveIndex();
+    emit fetched(url, filename);
+    pump();
+}
+
+/* Removes the least recently used files until the cache is below EVICT_TO_BYTES */
+void MediaFetcher::evict()
+{
+    QFileInfoList files = QDir(mDirectory).entryInfoList(QDir::Files, QDir::Time | QDir::Reversed);
+    mCacheBytes = 0;
+    for(const QFileInfo& file : files)
+        mCacheBytes += file.size();
+    if(mCacheBytes <= MAX_CACHE_BYTES)
+        return;
+
+    QSet<QString> evicted;
+    for(const QFileInfo& file : files) {
+        if(mCacheBytes <= EVICT_TO_BYTES)
+            break;
+        /* Indexes of all accounts live next to the files */
+        if(file.fileName().contains(".index"))
+            continue;
+        if(QFile::remove(file.filePath())) {
+            mCacheBytes -= file.size();
+            evicted.insert(file.fileName());
+        }
+    }
+    for(auto i = mIndex.begin(); i != mIndex.end(); ) {
+        if(evicted.contains(i.value()))
+            i = mIndex.erase(i);
+        else
+            ++i;
+    }
+    qDebug() << "MediaFetcher::evict: removed " << evicted.size() << " files, " << mCacheBytes << " bytes left";
+}
+
+void MediaFetcher::fail(const QString& url)
+{
+    Download download = mDownloads.take(url);
+    delete download.file;
+    emit failed(url);
+    pump();
+}
+
+/* QNetworkReply has no timeout of its own; finished() resumes the aborted downloads */
+void MediaFetcher::abortStalled()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    /* abort() emits finished() right away, which changes mDownloads */
+    QList<QNetworkReply*> stalled;
+    for(auto i = mDownloads.constBegin(); i != mDownloads.constEnd(); ++i) {
+        if(i->reply && now - i->lastProgressMs > STALL_TIMEOUT_MS) {
+            qDebug() << "MediaFetcher::abortStalled: no data for " << i.key() << " since " << now - i->lastProgressMs << " ms";
+            stalled << i->reply;
+        }
+    }
+    for(QNetworkReply* reply : stalled)
+        reply->abort();
+}
+
+QString MediaFetcher::summary() const
+{
+    return QString("hits %1, misses %2, %3 bytes at %4 kB/s")
+            .arg(mHits).arg(mMisses).arg(mBytesDownloaded)
+            .arg(mDownloadMs > 0 ? mBytesDownloaded * 1000 / 1024 / mDownloadMs : 0);
+}
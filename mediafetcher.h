@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#pragma once
+
+#include <QHash>
+#include <QObject>
+#include <QQueue>
+#include <QTimer>
+
+class QFile;
+class QNetworkAccessManager;
+class QNetworkReply;
+
+/*
+ * Downloads media to a content-addressed cache: a file is stored under the SHA1 of its
+ * content, so media forwarded between chats is only stored once, and an index maps
+ * media URLs to those files.
+ *
+ * At most MAX_DOWNLOADS_IN_FLIGHT downloads run at a time, concurrent requests for the
+ * same URL are merged. Data is written to a partial file as it arrives; a download that
+ * fails or stalls is resumed with a range request up to MAX_ATTEMPTS times. Only http(s)
+ * URLs are fetched, and a download that grows beyond the announced size is given up.
+ *
+ * The cache is shared by all accounts and kept below MAX_CACHE_BYTES by removing the
+ * least recently used files; index entries of removed files are dropped.
+ */
+class MediaFetcher : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(MediaFetcher)
+public:
+    MediaFetcher(const QString& directory, const QString& indexFilename, QObject* parent = 0);
+    ~MediaFetcher();
+
+    /* Emits fetched or failed, right away if url is cached or cannot be fetched.
+     * size is the size announced by the sender */
+    void fetch(const QString& url, qint64 size);
+    /* e.g. "hits 3, misses 5, 1048576 bytes at 512 kB/s" */
+    QString summary() const;
+
+signals:
+    void fetched(const QString& url, const QString& filename);
+    void failed(const QString& url);
+
+private slots:
+    void readyRead();
+    void finished();
+    void abortStalled();
+
+private:
+    void loadIndex();
+    void saveIndex();
+    void pump();
+    void start(const QString& url, qint64 size);
+    void complete(const QString& url);
+    void fail(const QString& url);
+    void evict();
+
+    QString mDirectory;
+    QString mIndexFilename;
+    /* url -> file name within mDirectory */
+    QHash<QString,QString> mIndex;
+    QNetworkAccessManager* mNetwork;
+    QQueue<QString> mQueue;
+    /* url -> announced size of queued downloads */
+    QHash<QString,qint64> mQueued;
+    struct Download {
+        Download() : reply(0), file(0), attempts(0), giveUp(false), size(0), received(0), startedMs(0), lastProgressMs(0) {}
+        QNetworkReply* reply;
+        QFile* file;
+        int attempts;
+        /* Set when the download must not be resumed, e.g. because it is too large */
+        bool giveUp;
+        /* The partial file never grows beyond this */
+        qint64 size;
+        /* Bytes received by the current attempt */
+        qint64 received;
+        qint64 startedMs;
+        qint64 lastProgressMs;
+    };
+    /* url -> running download */
+    QHash<QString,Download> mDownloads;
+    QHash<QNetworkReply*,QString> mReplyUrls;
+    QTimer mStallTimer;
+    /* Bytes in mDirectory as of the last eviction plus those added since, -1 if unknown */
+    qint64 mCacheBytes;
+
+    quint64 mHits;
+    quint64 mMisses;
+    quint64 mBytesDownloaded;
+    qint64 mDownloadMs;
+};
@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QHttpMultiPart>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMimeDatabase>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QUrl>
+#include <QtConcurrent/QtConcurrentRun>
+#include "mediauploader.h"
+
+/* The server does not take anything bigger */
+static const qint64 MAX_UPLOAD_SIZE = 16*1024*1024;
+static const int PROGRESS_STEP = 10;
+/* Both digests are fed the same chunk while it is in the cache */
+static const int DIGEST_CHUNK_SIZE = 64*1024;
+
+MediaUploader::MediaUploader(const QString& selfNumber, QObject* parent)
+    : QObject(parent), mSelfNumber(selfNumber), mOnline(false),
+      mUploadCount(0), mBytesUploaded(0), mUploadMs(0)
+{
+    mNetwork = new QNetworkAccessManager(this);
+}
+
+MediaUploader::~MediaUploader()
+{
+    /* The digests read from the uploads' bytes */
+    for(auto i = mDigestTokens.begin(); i != mDigestTokens.end(); ++i) {
+        i.key()->disconnect(this);
+        i.key()->waitForFinished();
+    }
+    for(Upload* upload : mUploads) {
+        if(upload->reply) {
+            upload->reply->disconnect(this);
+            upload->reply->abort();
+        }
+        delete upload;
+    }
+}
+
+bool MediaUploader::uploadFile(const QString& token, const QString& jid, const QString& type,
+                               const QString& filename, const QString& preview)
+{
+    Upload* upload = new Upload;
+    upload->file.setFileName(filename);
+    qint64 size = upload->file.size();
+    uchar* data = 0;
+    if(size > 0 && size <= MAX_UPLOAD_SIZE && upload->file.open(QIODevice::ReadOnly))
+        data = upload->file.map(0, size);
+    if(!data) {
+        qWarning() << "MediaUploader::uploadFile: cannot upload " << filename << " of " << size << " bytes";
+        delete upload;
+        return false;
+    }
+    upload->bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(data), size);
+    upload->token = token;
+    upload->jid = jid;
+    upload->type = type;
+    upload->mimeType = QMimeDatabase().mimeTypeForFile(filename).name();
+    upload->preview = preview;
+    return start(upload);
+}
+
+bool MediaUploader::uploadData(const QString& token, const QString& jid, const QString& type,
+                               const QString& mimeType, const QByteArray& data, const QString& preview)
+{
+    if(data.isEmpty() || data.size() > MAX_UPLOAD_SIZE) {
+        qWarning() << "MediaUploader::uploadData: cannot upload " << data.size() << " bytes";
+        return false;
+    }
+    Upload* upload = new Upload;
+    upload->bytes = data;
+    upload->token = token;
+    upload->jid = jid;
+    upload->type = type;
+    upload->mimeType = mimeType;
+    upload->preview = preview;
+    return start(upload);
+}
+
+bool MediaUploader::start(Upload* upload)
+{
+    upload->reply = 0;
+    upload->startedMs = 0;
+    upload->reportedPercent = 0;
+    mUploads[upload->token] = upload;
+    qDebug() << "MediaUploader::start: " << upload->token << " " << upload->mimeType
+             << ", " << upload->bytes.size() << " bytes";
+    QFutureWatcher<Digests>* watcher = new QFutureWatcher<Digests>(this);
+    mDigestTokens[watcher] = upload->token;
+    QObject::connect(watcher, SIGNAL(finished()), this, SLOT(digestsReady()));
+    watcher->setFuture(QtConcurrent::run(&MediaUploader::digest, upload->bytes));
+    return true;
+}
+
+/* Runs on a worker thread */
+MediaUploader::Digests MediaUploader::digest(const QByteArray& bytes)
+{
+    QCryptographicHash sha256(QCryptographicHash::Sha256);
+    QCryptographicHash md5(QCryptographicHash::Md5);
+    for(int offset = 0; offset < bytes.size(); offset += DIGEST_CHUNK_SIZE) {
+        int length = qMin(DIGEST_CHUNK_SIZE, bytes.size() - offset);
+        sha256.addData(bytes.constData() + offset, length);
+        md5.addData(bytes.constData() + offset, length);
+    }
+    Digests digests = { sha256.result(), md5.result() };
+    return digests;
+}
+
+void MediaUploader::digestsReady()
+{
+    QFutureWatcher<Digests>* watcher = static_cast<QFutureWatcher<Digests>*>(sender());
+    watcher->deleteLater();
+    Upload* upload = mUploads.value(mDigestTokens.take(watcher));
+    if(!upload)
+        return;
+    Digests digests = watcher->result();
+    upload->hash = digests.sha256.toBase64();
+    upload->md5 = digests.md5.toHex();
+    if(mOnline)
+        emit requestUpload(upload->hash, upload->type, upload->bytes.size());
+}
+
+void MediaUploader::setOnline(bool online)
+{
+    mOnline = online;
+    if(!online)
+        return;
+    /* Answers to requests sent before a disconnect are lost */
+    for(Upload* upload : mUploads)
+        if(!upload->reply && !upload->hash.isEmpty())
+            emit requestUpload(upload->hash, upload->type, upload->bytes.size());
+}
+
+QList<MediaUploader::Upload*> MediaUploader::waitingFor(const QString& hash) const
+{
+    QList<Upload*> ret;
+    for(Upload* upload : mUploads)
+        if(!upload->hash.isEmpty() && upload->hash == hash && !upload->reply)
+            ret << upload;
+    return ret;
+}
+
+void MediaUploader::requestSucceeded(const QString& hash, const QString& url)
+{
+    for(Upload* upload : waitingFor(hash))
+        post(upload, url);
+}
+
+void MediaUploader::requestFailed(const QString& hash)
+{
+    for(Upload* upload : waitingFor(hash))
+        fail(upload, "upload request refused");
+}
+
+/* The server has the file already */
+void MediaUploader::requestDuplicate(const QString& hash, const QString& url)
+{
+    for(Upload* upload : waitingFor(hash))
+        complete(upload, url, QUrl(url).fileName());
+}
+
+void MediaUploader::post(Upload* upload, const QString& url)
+{
+    QString suffix = QMimeDatabase().mimeTypeForName(upload->mimeType).preferredSuffix();
+    QString name = upload->md5 + (suffix.isEmpty() ? QString() : "." + suffix);
+
+    QHttpMultiPart* multiPart = new QHttpMultiPart(QHttpMultiPart::FormDataType);
+    QHttpPart to;
+    to.setHeader(QNetworkRequest::ContentDispositionHeader, "form-data; name=\"to\"");
+    to.setBody(upload->jid.toUtf8());
+    QHttpPart from;
+    from.setHeader(QNetworkRequest::ContentDispositionHeader, "form-data; name=\"from\"");
+    from.setBody(mSelfNumber.toUtf8());
+    QHttpPart file;
+    file.setHeader(QNetworkRequest::ContentTypeHeader, upload->mimeType);
+    file.setHeader(QNetworkRequest::ContentDispositionHeader,
+                   "form-data; name=\"file\"; filename=\"" + name + "\"");
+    /* Read in chunks by QNetworkAccessManager, straight from the mapping */
+    QBuffer* device = new QBuffer(&upload->bytes, multiPart);
+    device->open(QIODevice::ReadOnly);
+    file.setBodyDevice(device);
+    multiPart->append(to);
+    multiPart->append(from);
+    multiPart->append(file);
+
+    upload->startedMs = QDateTime::currentMSecsSinceEpoch();
+    upload->reply = mNetwork->post(QNetworkRequest(QUrl(url)), multiPart);
+    multiPart->setParent(upload->reply);
+    mReplyTokens[upload->reply] = upload->token;
+    QObject::connect(upload->reply, SIGNAL(uploadProgress(qint64,qint64)), this, SLOT(uploadProgress(qint64,qint64)));
+    QObject::connect(upload->reply, SIGNAL(finished()), this, SLOT(finished()));
+}
+
+void MediaUploader::uploadProgress(qint64 sent, qint64 total)
+{
+    Upload* upload = mUploads.value(mReplyTokens.value(qobject_cast<QNetworkReply*>(sender())));
+    if(!upload || total <= 0)
+        return;
+    int percent = sent * 100 / total;
+    if(percent < upload->reportedPercent + PROGRESS_STEP || percent == 100)
+        return;
+    upload->reportedPercent = percent - percent % PROGRESS_STEP;
+    emit progress(upload->token, upload->jid, upload->reportedPercent);
+}
+
+void MediaUploader::finished()
+{
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(sender());
+    reply->deleteLater();
+    Upload* upload = mUploads.value(mReplyTokens.take(reply));
+    if(!upload)
+        return;
+    upload->reply = 0;
+    mUploadMs += QDateTime::currentMSecsSinceEpoch() - upload->startedMs;
+
+    if(reply->error() != QNetworkReply::NoError) {
+        fail(upload, reply->errorString());
+        return;
+    }
+    QJsonObject result = QJsonDocument::fromJson(reply->readAll()).object();
+    QString url = result.value("url").toString();
+    if(url.isEmpty()) {
+        fail(upload, "no url in the upload response");
+        return;
+    }
+    ++mUploadCount;
+    mBytesUploaded += upload->bytes.size();
+    complete(upload, url, result.value("name").toString());
+}
+
+void MediaUploader::complete(Upload* upload, const QString& url, const QString& name)
+{
+    qDebug() << "MediaUploader::complete: " << upload->token << " at " << url;
+    OutgoingQueue::Media media;
+    media.type = upload->type;
+    media.url = url;
+    media.name = name;
+    media.size = upload->bytes.size();
+    media.preview = upload->preview;
+    mUploads.remove(upload->token);
+    emit uploaded(upload->token, upload->jid, media);
+    delete upload;
+}
+
+void MediaUploader::fail(Upload* upload, const QString& reason)
+{
+    qWarning() << "MediaUploader::fail: " << upload->token << ": " << reason;
+    mUploads.remove(upload->token);
+    emit failed(upload->token, upload->jid, reason);
+    delete upload;
+}
+
+QString MediaUploader::summary() const
+{
+    return QString("uploads %1, %2 bytes at %3 kB/s")
+            .arg(mUploadCount).arg(mBytesUploaded)
+            .arg(mUploadMs > 0 ? mBytesUploaded * 1000 / 1024 / mUploadMs : 0);
+}
+
+QSet<QString> MediaUploader::jids() const
+{
+    QSet<QString> jids;
+    for(const Upload* upload : mUploads)
+        jids.insert(upload->jid);
+    return jids;
+}
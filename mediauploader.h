@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#pragma once
+
+#include <QFile>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include "outgoingqueue.h"
+
+class QNetworkAccessManager;
+class QNetworkReply;
+
+/*
+ * Uploads attachments for outgoing media messages.
+ *
+ * Files are mapped and uploaded straight from the mapping, inline data is uploaded
+ * from the QByteArray it came in; neither is copied as a whole or handed to python.
+ * The SHA256 and MD5 of the attachment are computed in one pass on a worker thread.
+ * Each upload is then announced to the server by its SHA256 (requestUpload). The server
+ * either answers with an upload url, or with the url of an identical file it already
+ * has, in which case nothing is uploaded.
+ */
+class MediaUploader : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(MediaUploader)
+public:
+    MediaUploader(const QString& selfNumber, QObject* parent = 0);
+    ~MediaUploader();
+
+    /* type is "image", "video" or "audio", preview a base64 JPEG or empty.
+     * Return false if there is nothing that can be uploaded */
+    bool uploadFile(const QString& token, const QString& jid, const QString& type,
+                    const QString& filename, const QString& preview);
+    bool uploadData(const QString& token, const QString& jid, const QString& type,
+                    const QString& mimeType, const QByteArray& data, const QString& preview);
+    /* Upload requests are only sent while online, and sent again after reconnecting */
+    void setOnline(bool online);
+
+    /* Answers to requestUpload */
+    void requestSucceeded(const QString& hash, const QString& url);
+    void requestFailed(const QString& hash);
+    void requestDuplicate(const QString& hash, const QString& url);
+
+    /* e.g. "uploads 2, 3145728 bytes at 256 kB/s" */
+    QString summary() const;
+    /* Recipients of running uploads */
+    QSet<QString> jids() const;
+
+signals:
+    /* Ask the server where to upload the file, answer with requestSucceeded() and friends */
+    void requestUpload(const QString& hash, const QString& type, qint64 size);
+    /* Sent in steps of PROGRESS_STEP percent */
+    void progress(const QString& token, const QString& jid, int percent);
+    void uploaded(const QString& token, const QString& jid, const OutgoingQueue::Media& media);
+    void failed(const QString& token, const QString& jid, const QString& reason);
+
+private slots:
+    void digestsReady();
+    void uploadProgress(qint64 sent, qint64 total);
+    void finished();
+
+private:
+    struct Upload {
+        QString token;
+        QString jid;
+        QString type;
+        QString mimeType;
+        QString preview;
+        /* base64 SHA256 of bytes, empty until digestsReady() */
+        QString hash;
+        /* hex MD5 of bytes, names the uploaded file */
+        QString md5;
+        /* Mapped, if the attachment is a file */
+        QFile file;
+        QByteArray bytes;
+        QNetworkReply* reply;
+        qint64 startedMs;
+        int reportedPercent;
+    };
+    bool start(Upload* upload);
+    void post(Upload* upload, const QString& url);
+    void complete(Upload* upload, const QString& url, const QString& name);
+    void fail(Upload* upload, const QString& reason);
+    QList<Upload*> waitingFor(const QString& hash) const;
+
+    struct Digests {
+        QByteArray sha256;
+        QByteArray md5;
+    };
+    static Digests digest(const QByteArray& bytes);
+
+    QString mSelfNumber;
+    bool mOnline;
+    QNetworkAccessManager* mNetwork;
+    /* token -> upload */
+    QHash<QString,Upload*> mUploads;
+    QHash<QNetworkReply*,QString> mReplyTokens;
+    QHash<QFutureWatcher<Digests>*,QString> mDigestTokens;
+
+    quint64 mUploadCount;
+    quint64 mBytesUploaded;
+    qint64 mUploadMs;
+};
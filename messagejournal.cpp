@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <cstdio>
+#include <unistd.h>
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include "messagejournal.h"
+
+using namespace Tp;
+
+/* Time we wait for more appends before syncing a batch */
+static const int COMMIT_DELAY_MS = 2;
+/* A batch is committed right away if it grows larger than that */
+static const int COMMIT_MAX_BYTES = 256*1024;
+/* Rewrite the journal if it is larger than that and mostly acknowledged */
+static const qint64 COMPACT_MIN_SIZE = 4*1024*1024;
+
+static const int RECORD_HEADER_SIZE = sizeof(quint32) + sizeof(quint16);
+
+static QDataStream& operator<<(QDataStream& stream, const MessagePartList& parts)
+{
+    stream << quint32(parts.size());
+    for(const MessagePart& part : parts) {
+        QVariantMap map;
+        for(MessagePart::const_iterator i = part.begin(); i != part.end(); ++i)
+            map[i.key()] = i.value().variant();
+        stream << map;
+    }
+    return stream;
+}
+
+static QDataStream& operator>>(QDataStream& stream, MessagePartList& parts)
+{
+    quint32 count;
+    stream >> count;
+    for(quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        QVariantMap map;
+        stream >> map;
+        MessagePart part;
+        for(QVariantMap::const_iterator j = map.begin(); j != map.end(); ++j)
+            part[j.key()] = QDBusVariant(j.value());
+        parts << part;
+    }
+    return stream;
+}
+
+MessageJournal::MessageJournal(const QString& path, QObject* parent)
+    : QObject(parent), mFile(path), mLiveBytes(0)
+{
+    mCommitTimer.setSingleShot(true);
+    mCommitTimer.setInterval(COMMIT_DELAY_MS);
+    QObject::connect(&mCommitTimer, SIGNAL(timeout()), this, SLOT(commit()));
+}
+
+MessageJournal::~MessageJournal()
+{
+    commit();
+}
+
+bool MessageJournal::open(QList<Entry>* liveEntries)
+{
+    QDir().mkpath(QFileInfo(mFile).absolutePath());
+    if(!mFile.open(QIODevice::ReadWrite)) {
+        qWarning() << "MessageJournal::open: cannot open " << mFile.fileName() << ": " << mFile.errorString();
+        return false;
+    }
+
+    /* Replay: collect all appended entries minus the acknowledged ones, in order */
+    QList<Entry> entries;
+    QHash<QString,int> index;
+    qint64 offset = 0;
+    QByteArray payload;
+    while(readRecord(&payload)) {
+        QDataStream stream(payload);
+        quint8 type;
+        stream >> type;
+        if(type == RecordAppend) {
+            Entry entry;
+            stream >> entry.token >> entry.senderId >> entry.targetId >> entry.timestamp >> entry.body;
+            if(stream.status() != QDataStream::Ok)
+                break;
+            /* Appended again, the later record replaces the earlier one but keeps its place */
+            Record record = { offset, int(RECORD_HEADER_SIZE + payload.size()), offset };
+            auto j = mLive.find(entry.token);
+            if(j != mLive.end()) {
+                mLiveBytes -= j->size;
+                record.order = j->order;
+            }
+            auto i = index.find(entry.token);
+            if(i != index.end()) {
+                entries[i.value()] = entry;
+            } else {
+                index[entry.token] = entries.size();
+                entries << entry;
+            }
+            mLive[entry.token] = record;
+            mLiveBytes += record.size;
+        } else if(type == RecordAck) {
+            QString token;
+            stream >> token;
+            if(stream.status() != QDataStream::Ok)
+                break;
+            auto i = index.find(token);
+            if(i != index.end()) {
+                entries[i.value()].token.clear();
+                index.erase(i);
+            }
+            auto j = mLive.find(token);
+            if(j != mLive.end()) {
+                mLiveBytes -= j->size;
+                mLive.erase(j);
+            }
+        } else {
+            qWarning() << "MessageJournal::open: unknown record type " << type;
+            break;
+        }
+        offset = mFile.pos();
+    }
+    if(offset != mFile.size()) {
+        qWarning() << "MessageJournal::open: discarding torn tail at " << offset
+                   << " of " << mFile.size();
+        mFile.resize(offset);
+    }
+    mFile.seek(mFile.size());
+
+    for(const Entry& entry : entries)
+        if(!entry.token.isEmpty())
+            *liveEntries << entry;
+    qDebug() << "MessageJournal::open: " << liveEntries->size() << " unacknowledged messages in "
+             << mFile.fileName();
+
+    if(mLive.isEmpty()) {
+        mFile.resize(0);
+        mLiveBytes = 0;
+    }
+    return true;
+}
+
+bool MessageJournal::readRecord(QByteArray* payload)
+{
+    QByteArray header = mFile.read(RECORD_HEADER_SIZE);
+    if(header.size() != RECORD_HEADER_SIZE)
+        return false;
+    QDataStream headerStream(header);
+    quint32 length;
+    quint16 crc;
+    headerStream >> length >> crc;
+    if(length == 0 || length > mFile.size() - mFile.pos())
+        return false;
+    *payload = mFile.read(length);
+    if(uint(payload->size()) != length)
+        return false;
+    return qChecksum(payload->constData(), payload->size()) == crc;
+}
+
+void MessageJournal::queueRecord(const QByteArray& payload)
+{
+    QDataStream stream(&mBuffer, QIODevice::WriteOnly | QIODevice::Append);
+    stream << quint32(payload.size()) << qChecksum(payload.constData(), payload.size());
+    stream.writeRawData(payload.constData(), payload.size());
+    scheduleCommit();
+}
+
+void MessageJournal::append(const Entry& entry)
+{
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream << quint8(RecordAppend) << entry.token << entry.senderId << entry.targetId
+           << entry.timestamp << entry.body;
+
+    qint64 offset = mFile.size() + mBuffer.size();
+    Record record = { offset, int(RECORD_HEADER_SIZE + payload.size()), offset };
+    auto i = mLive.find(entry.token);
+    if(i != mLive.end()) {
+        /* Replaces the earlier record, see open() */
+        mLiveBytes -= i->size;
+        record.order = i->order;
+    }
+    mLive[entry.token] = record;
+    mLiveBytes += record.size;
+    queueRecord(payload);
+}
+
+void MessageJournal::acknowledge(const QString& token)
+{
+    auto i = mLive.find(token);
+    if(i == mLive.end())
+        return;
+    mLiveBytes -= i->size;
+    mLive.erase(i);
+
+    if(mLive.isEmpty() && mBuffer.isEmpty()) {
+        /* Nothing left to protect, start over */
+        mFile.resize(0);
+        mLiveBytes = 0;
+        return;
+    }
+
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream << quint8(RecordAck) << token;
+    queueRecord(payload);
+}
+
+bool MessageJournal::contains(const QString& token) const
+{
+    return mLive.contains(token);
+}
+
+bool MessageJournal::read(const QString& token, Entry* entry)
+{
+    auto i = mLive.find(token);
+    if(i == mLive.end())
+        return false;
+
+    QByteArray record;
+    qint64 fileSize = mFile.size();
+    if(i->offset >= fileSize) {
+        record = mBuffer.mid(i->offset - fileSize, i->size);
+    } else {
+        mFile.seek(i->offset);
+        record = mFile.read(i->size);
+        mFile.seek(fileSize);
+    }
+    if(record.size() != i->size)
+        return false;
+
+    QDataStream stream(record);
+    quint32 length;
+    quint16 crc;
+    quint8 type;
+    stream >> length >> crc >> type;
+    if(type != RecordAppend)
+        return false;
+    stream >> entry->token >> entry->senderId >> entry->targetId >> entry->timestamp >> entry->body;
+    return stream.status() == QDataStream::Ok;
+}
+
+void MessageJournal::scheduleCommit()
+{
+    /* A full batch is committed on the next event loop iteration, not from within
+     * append(): callers queue their acks for committed() after appending */
+    if(mBuffer.size() >= COMMIT_MAX_BYTES)
+        mCommitTimer.start(0);
+    else if(!mCommitTimer.isActive())
+        mCommitTimer.start(COMMIT_DELAY_MS);
+}
+
+void MessageJournal::commit()
+{
+    mCommitTimer.stop();
+    if(mBuffer.isEmpty() || !mFile.isOpen())
+        return;
+
+    mFile.seek(mFile.size());
+    if(mFile.write(mBuffer) != mBuffer.size() || !mFile.flush()) {
+        qWarning() << "MessageJournal::commit: write failed: " << mFile.errorString();
+    }
+    if(::fdatasync(mFile.handle()) != 0)
+        qWarning() << "MessageJournal::commit: fdatasync failed";
+    mBuffer.clear();
+
+    if(mLive.isEmpty()) {
+        mFile.resize(0);
+        mLiveBytes = 0;
+    } else if(mFile.size() > COMPACT_MIN_SIZE && mLiveBytes < mFile.size()/4) {
+        compact();
+    }
+    emit committed();
+}
+
+/* Rewrites the journal with only the live records. Must be called with an empty buffer */
+void MessageJournal::compact()
+{
+    QFile compacted(mFile.fileName() + ".new");
+    if(!compacted.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "MessageJournal::compact: cannot open " << compacted.fileName();
+        return;
+    }
+
+    /* Keep the original order so that replay stays in order */
+    QMap<qint64,QString> byOrder;
+    for(auto i = mLive.begin(); i != mLive.end(); ++i)
+        byOrder[i->order] = i.key();
+
+    QHash<QString,Record> live;
+    qint64 liveBytes = 0;
+    for(auto i = byOrder.begin(); i != byOrder.end(); ++i) {
+        qint64 offset = mLive.value(i.value()).offset;
+        mFile.seek(offset);
+        QByteArray payload;
+        if(!readRecord(&payload)) {
+            qWarning() << "MessageJournal::compact: cannot read record at " << offset;
+            return;
+        }
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream << quint32(payload.size()) << qChecksum(payload.constData(), payload.size());
+        stream.writeRawData(payload.constData(), payload.size());
+        Record record = { compacted.pos(), data.size(), compacted.pos() };
+        live[i.value()] = record;
+        compacted.write(data);
+        liveBytes += record.size;
+    }
+    compacted.flush();
+    ::fdatasync(compacted.handle());
+    compacted.close();
+
+    QString name = mFile.fileName();
+    mFile.close();
+    bool renamed = ::rename(QFile::encodeName(compacted.fileName()).constData(),
+                            QFile::encodeName(name).constData()) == 0;
+    mFile.open(QIODevice::ReadWrite);
+    mFile.seek(mFile.size());
+    if(!renamed) {
+        qWarning() << "MessageJournal::compact: rename failed";
+        return;
+    }
+    mLive = live;
+    mLiveBytes = liveBytes;
+    qDebug() << "MessageJournal::compact: " << mLive.size() << " live records, "
+             << mLiveBytes << " bytes";
+}
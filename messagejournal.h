@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QFile>
+#include <QHash>
+#include <QObject>
+#include <QTimer>
+#include <TelepathyQt/Types>
+
+/*
+ * Append-only journal of received messages.
+ *
+ * Every message is appended before it is acked to the server and stays
+ * in the journal until a telepathy client has acknowledged it. Appends are
+ * group committed: records are buffered and written + fdatasync'ed together,
+ * after which committed() is emitted. Only then may the server acks for the
+ * batch be sent.
+ *
+ * On disk, the journal is a sequence of records
+ *   quint32 length | quint16 crc16(payload) | payload
+ * where payload starts with a quint8 record type. A torn record at the end
+ * (crash during write) is detected by its length or checksum and cut off.
+ */
+class MessageJournal : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(MessageJournal)
+public:
+    struct Entry {
+        QString token;      /* message-token, see tokenFor() */
+        QString senderId;
+        QString targetId;   /* jid for 1:1 chats, gid for rooms */
+        uint timestamp;
+        Tp::MessagePartList body;
+    };
+
+    MessageJournal(const QString& path, QObject* parent = 0);
+    ~MessageJournal();
+
+    /* msgIds are only unique per sender, so entries are keyed by both */
+    static QString tokenFor(const QString& senderId, const QString& msgId) { return senderId + '/' + msgId; }
+    static QString msgIdOf(const QString& token) { return token.mid(token.indexOf('/') + 1); }
+
+    /* Opens the journal and reads back all entries that were never acknowledged */
+    bool open(QList<Entry>* liveEntries);
+    /* Queues an entry for the next group commit */
+    void append(const Entry& entry);
+    /* Marks an entry as seen by a client. Truncates the journal if nothing is live anymore */
+    void acknowledge(const QString& token);
+    bool contains(const QString& token) const;
+    /* Reads an unacknowledged entry back */
+    bool read(const QString& token, Entry* entry);
+    /* Size of the entry's record, 0 if it is not live */
+    int sizeOf(const QString& token) const { return mLive.value(token).size; }
+    int liveCount() const { return mLive.size(); }
+    /* Whether appended records are still waiting for commit() */
+    bool hasUncommitted() const { return !mBuffer.isEmpty(); }
+
+public slots:
+    /* Writes and syncs everything appended so far */
+    void commit();
+
+signals:
+    /* All entries appended before this signal are on stable storage */
+    void committed();
+
+private:
+    enum RecordType { RecordAppend = 1, RecordAck = 2 };
+    void scheduleCommit();
+    void queueRecord(const QByteArray& payload);
+    bool readRecord(QByteArray* payload);
+    void compact();
+
+    QFile mFile;
+    QByteArray mBuffer;
+    QTimer mCommitTimer;
+    struct Record {
+        qint64 offset;
+        int size;
+        /* Offset of the first append of the entry, which replay order follows */
+        qint64 order;
+    };
+    /* Records of unacknowledged entries */
+    QHash<QString,Record> mLive;
+    qint64 mLiveBytes;
+};
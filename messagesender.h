@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QList>
+#include <QPair>
+#include <QStringList>
+
+/*
+ * Hands outgoing messages to the server, see OutgoingQueue.
+ * Implemented by PythonInterface.
+ */
+class MessageSender
+{
+public:
+    virtual ~MessageSender() {}
+    /* Sends (jid, content) pairs. Returns the msgIds, an empty string for each
+     * message that could not be sent */
+    virtual QStringList sendMessages(const QList<QPair<QString,QByteArray> >& messages) = 0;
+    /* type is "image", "video" or "audio". Returns the msgId, or an empty string
+     * if the message could not be sent */
+    virtual QString sendMedia(const QString& jid, const QString& type, const QString& url, const QString& name,
+                              qint64 size, const QString& preview) = 0;
+};
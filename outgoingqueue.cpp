@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+#include <QDateTime>
+#include <QDebug>
+#include <QElapsedTimer>
+#include "outgoingqueue.h"
+#include "messagesender.h"
+
+/* Number of messages handed to python per GIL acquisition */
+static const int BATCH_SIZE = 32;
+/* Messages handed to yowsup that the server did not accept yet. Dispatching pauses
+ * at this bound, so a server that stops confirming does not make us hold every
+ * message twice */
+static const int MAX_UNACCEPTED = 1024;
+/* Upper bound on messages tracked for completion times; older ones count as expired */
+static const int MAX_IN_FLIGHT = 4096;
+/* Recipients may be offline for a while, but not usually for a day */
+static const qint64 COMPLETION_TIMEOUT_MS = 24*3600*1000LL;
+static const int EXPIRY_INTERVAL_MS = 60*1000;
+
+OutgoingQueue::OutgoingQueue(MessageSender* sender, QObject* parent)
+    : QObject(parent), mSender(sender), mOnline(false), mLastSequence(0),
+      mUnacceptedExpired(0), mUndeliveredExpired(0)
+{
+    /* Tokens must not collide with those of a previous process */
+    mTokenPrefix = QString("ws%1-").arg(QDateTime::currentMSecsSinceEpoch(), 0, 36);
+    mDispatchTimer.setSingleShot(true);
+    mDispatchTimer.setInterval(0);
+    QObject::connect(&mDispatchTimer, SIGNAL(timeout()), this, SLOT(dispatch()));
+    mExpiryTimer.setInterval(EXPIRY_INTERVAL_MS);
+    QObject::connect(&mExpiryTimer, SIGNAL(timeout()), this, SLOT(expireInFlight()));
+}
+
+QString OutgoingQueue::enqueue(const QString& jid, const QByteArray& content)
+{
+    Message message;
+    message.token = reserveToken();
+    message.jid = jid;
+    message.content = content;
+    enqueue(message);
+    return message.token;
+}
+
+QString OutgoingQueue::reserveToken()
+{
+    return mTokenPrefix + QString::number(++mLastSequence);
+}
+
+void OutgoingQueue::enqueueMedia(const QString& token, const QString& jid, const Media& media)
+{
+    Message message;
+    message.token = token;
+    message.jid = jid;
+    message.media = media;
+    enqueue(message);
+}
+
+void OutgoingQueue::enqueue(Message& message)
+{
+    /* Media messages reserved their token before uploading, the sequence keeps
+     * the order of enqueueing */
+    message.sequence = ++mLastSequence;
+    message.queuedMs = QDateTime::currentMSecsSinceEpoch();
+    mUnsent.enqueue(message);
+
+    if(mOnline && !mDispatchTimer.isActive())
+        mDispatchTimer.start();
+}
+
+void OutgoingQueue::setOnline(bool online)
+{
+    mOnline = online;
+    if(!online) {
+        mDispatchTimer.stop();
+        if(mUnaccepted.isEmpty())
+            return;
+        /* The server never confirmed those, so send them again after reconnect,
+         * in their original order */
+        QList<Message> retransmit = mUnaccepted.values();
+        /* They get new msgIds */
+        for(auto i = mUnaccepted.constBegin(); i != mUnaccepted.constEnd(); ++i)
+            mInFlight.remove(i.key());
+        std::sort(retransmit.begin(), retransmit.end(), [] (const Message& a, const Message& b) {
+            return a.sequence < b.sequence;
+        });
+        for(int i = retransmit.size()-1; i >= 0; --i)
+            mUnsent.prepend(retransmit[i]);
+        mUnaccepted.clear();
+        qDebug() << "OutgoingQueue: " << retransmit.size() << " messages queued for retransmission";
+    } else if(!mUnsent.isEmpty()) {
+        mDispatchTimer.start();
+    }
+}
+
+void OutgoingQueue::dispatch()
+{
+    if(!mOnline || mUnsent.isEmpty())
+        return;
+    /* Resumed once the server accepts messages */
+    int room = std::min(BATCH_SIZE, MAX_UNACCEPTED - mUnaccepted.size());
+    if(room <= 0)
+        return;
+
+    QList<Message> batch;
+    QList<QPair<QString,QByteArray> > args;
+    while(!mUnsent.isEmpty() && batch.size() < room) {
+        /* A media message is a batch of its own, so that the order is kept */
+        if(!batch.isEmpty() && !mUnsent.head().media.type.isEmpty())
+            break;
+        batch << mUnsent.dequeue();
+        if(!batch.last().media.type.isEmpty())
+            break;
+        args << qMakePair(batch.last().jid, batch.last().content);
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    QStringList msgIds;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if(args.isEmpty()) {
+        const Media& media = batch.first().media;
+        msgIds << mSender->sendMedia(batch.first().jid, media.type, media.url, media.name,
+                                     media.size, media.preview);
+    } else {
+        msgIds = mSender->sendMessages(args);
+    }
+    qDebug() << "OutgoingQueue::dispatch: " << batch.size() << " messages in "
+             << timer.nsecsElapsed()/1000 << " us";
+
+    for(int i = 0; i < batch.size(); ++i) {
+        const Message& message = batch[i];
+        QString msgId = msgIds.value(i);
+        if(msgId.isEmpty()) {
+            qWarning() << "OutgoingQueue::dispatch: message_send failed for " << message.token;
+            emit messageFailed(message.token, message.jid);
+            continue;
+        }
+        mUnaccepted[msgId] = message;
+        mTokens[msgId] = message.token;
+        mTokenOrder.enqueue(qMakePair(now, msgId));
+        InFlight inFlight;
+        inFlight.queuedMs = message.queuedMs;
+        inFlight.accepted = false;
+        mInFlight[msgId] = inFlight;
+        mInFlightOrder.enqueue(msgId);
+        emit messageDispatched(message.token, msgId);
+    }
+    while(mInFlightOrder.size() > MAX_IN_FLIGHT) {
+        auto i = mInFlight.find(mInFlightOrder.dequeue());
+        if(i != mInFlight.end()) {
+            expire(i.value());
+            mInFlight.erase(i);
+        }
+    }
+    if((!mInFlight.isEmpty() || !mTokens.isEmpty()) && !mExpiryTimer.isActive())
+        mExpiryTimer.start();
+
+    /* Give the event loop a chance before the next batch */
+    if(!mUnsent.isEmpty())
+        mDispatchTimer.start();
+}
+
+void OutgoingQueue::messageAccepted(const QString& msgId)
+{
+    accepted(msgId);
+
+    auto i = mInFlight.find(msgId);
+    if(i != mInFlight.end() && !i->accepted) {
+        mAcceptLatency.record(QDateTime::currentMSecsSinceEpoch() - i->queuedMs);
+        i->accepted = true;
+    }
+}
+
+void OutgoingQueue::messageDelivered(const QString& msgId)
+{
+    /* Delivery implies acceptance; the receipt for the latter may have been lost */
+    accepted(msgId);
+    /* Nothing is reported for this msgId anymore */
+    mTokens.remove(msgId);
+
+    auto i = mInFlight.find(msgId);
+    if(i == mInFlight.end())
+        return;
+    qint64 latency = QDateTime::currentMSecsSinceEpoch() - i->queuedMs;
+    if(!i->accepted)
+        mAcceptLatency.record(latency);
+    mDeliveryLatency.record(latency);
+    mInFlight.erase(i);
+}
+
+void OutgoingQueue::accepted(const QString& msgId)
+{
+    if(mUnaccepted.remove(msgId) && mOnline && !mUnsent.isEmpty() && !mDispatchTimer.isActive())
+        mDispatchTimer.start();
+}
+
+void OutgoingQueue::failAll()
+{
+    QList<Message> failed = mUnaccepted.values();
+    for(auto i = mUnaccepted.constBegin(); i != mUnaccepted.constEnd(); ++i) {
+        mInFlight.remove(i.key());
+        mTokens.remove(i.key());
+    }
+    std::sort(failed.begin(), failed.end(), [] (const Message& a, const Message& b) {
+        return a.sequence < b.sequence;
+    });
+    failed += mUnsent;
+    mUnaccepted.clear();
+    mUnsent.clear();
+    mDispatchTimer.stop();
+
+    if(!failed.isEmpty())
+        qDebug() << "OutgoingQueue::failAll: " << failed.size() << " messages";
+    for(const Message& message : failed)
+        emit messageFailed(message.token, message.jid);
+}
+
+void OutgoingQueue::expire(const InFlight& inFlight)
+{
+    if(inFlight.accepted)
+        ++mUndeliveredExpired;
+    else
+        ++mUnacceptedExpired;
+}
+
+void OutgoingQueue::expireInFlight()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    while(!mInFlightOrder.isEmpty()) {
+        auto i = mInFlight.find(mInFlightOrder.head());
+        if(i != mInFlight.end()) {
+            if(now - i->queuedMs < COMPLETION_TIMEOUT_MS)
+                break;
+            qWarning() << "OutgoingQueue::expireInFlight: " << mInFlightOrder.head()
+                       << (i->accepted ? " was never delivered" : " was never accepted");
+            expire(i.value());
+            mInFlight.erase(i);
+        }
+        mInFlightOrder.dequeue();
+    }
+    if(mInFlight.isEmpty())
+        mInFlightOrder.clear();
+
+    /* Tokens of messages whose delivery is still awaited are never dropped early,
+     * otherwise a late receipt would be reported under yowsup's msgId */
+    while(!mTokenOrder.isEmpty()) {
+        const QPair<qint64,QString>& head = mTokenOrder.head();
+        if(mTokens.contains(head.second)) {
+            if(now - head.first < COMPLETION_TIMEOUT_MS)
+                break;
+            mTokens.remove(head.second);
+        }
+        mTokenOrder.dequeue();
+    }
+    if(mTokens.isEmpty())
+        mTokenOrder.clear();
+
+    if(mInFlight.isEmpty() && mTokens.isEmpty())
+        mExpiryTimer.stop();
+}
+
+QSet<QString> OutgoingQueue::jids() const
+{
+    QSet<QString> jids;
+    for(const Message& message : mUnsent)
+        jids.insert(message.jid);
+    for(const Message& message : mUnaccepted)
+        jids.insert(message.jid);
+    return jids;
+}
+
+QString OutgoingQueue::tokenFor(const QString& msgId) const
+{
+    return mTokens.value(msgId, msgId);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QObject>
+#include <QPair>
+#include <QQueue>
+#include <QSet>
+#include <QTimer>
+#include "histogram.h"
+
+class MessageSender;
+
+/*
+ * Queue of outgoing messages.
+ *
+ * enqueue() returns a locally generated token right away. Messages are handed
+ * to yowsup in batches (one GIL acquisition per batch) whenever we are online.
+ * Messages that were handed to yowsup but not yet accepted by the server are
+ * put back into the queue on disconnect and retransmitted after reconnecting.
+ * At most MAX_UNACCEPTED of them are outstanding at any time.
+ * Server receipts carry yowsup's msgId, tokenFor() maps them back to our token.
+ * Media messages go out on their own, after their attachment was uploaded under
+ * a token from reserveToken().
+ *
+ * The time from enqueue() to the server's acceptance and to the delivery to the
+ * recipient is recorded in histograms. Messages that do not complete within
+ * COMPLETION_TIMEOUT_MS are counted as expired.
+ */
+class OutgoingQueue : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(OutgoingQueue)
+public:
+    /* An uploaded attachment */
+    struct Media {
+        Media() : size(0) {}
+        /* "image", "video" or "audio" */
+        QString type;
+        QString url;
+        QString name;
+        qint64 size;
+        /* base64 JPEG, may be empty */
+        QString preview;
+    };
+    struct Message {
+        uint sequence;
+        QString token;
+        QString jid;
+        QByteArray content;
+        /* Empty type for text messages */
+        Media media;
+        qint64 queuedMs;
+    };
+
+    OutgoingQueue(MessageSender* sender, QObject* parent = 0);
+
+    QString enqueue(const QString& jid, const QByteArray& content);
+    /* Token for a media message that is enqueued once its attachment is uploaded */
+    QString reserveToken();
+    void enqueueMedia(const QString& token, const QString& jid, const Media& media);
+    void setOnline(bool online);
+    /* Called when the server accepted the message */
+    void messageAccepted(const QString& msgId);
+    /* Called when the message was delivered to the recipient */
+    void messageDelivered(const QString& msgId);
+    /* Gives up on every message that was not accepted yet, in order, with messageFailed() */
+    void failAll();
+    /* Maps yowsup's msgId to our token until the message was delivered or timed out.
+     * Returns msgId if it is unknown */
+    QString tokenFor(const QString& msgId) const;
+    int pendingCount() const { return mUnsent.size() + mUnaccepted.size(); }
+    /* Recipients of messages that may still be sent again */
+    QSet<QString> jids() const;
+    const Histogram& acceptLatency() const { return mAcceptLatency; }
+    const Histogram& deliveryLatency() const { return mDeliveryLatency; }
+    /* Messages that were never accepted / never delivered within the timeout */
+    qint64 unacceptedExpiredCount() const { return mUnacceptedExpired; }
+    qint64 undeliveredExpiredCount() const { return mUndeliveredExpired; }
+
+signals:
+    /* A message was handed to yowsup under the given msgId */
+    void messageDispatched(const QString& token, const QString& msgId);
+    /* yowsup refused the message or failAll() gave up on it, it is not sent again */
+    void messageFailed(const QString& token, const QString& jid);
+
+private slots:
+    void dispatch();
+    void expireInFlight();
+
+private:
+    void enqueue(Message& message);
+    void accepted(const QString& msgId);
+
+    MessageSender* mSender;
+    bool mOnline;
+    QTimer mDispatchTimer;
+    QString mTokenPrefix;
+    uint mLastSequence;
+    QQueue<Message> mUnsent;
+    /* msgId -> message, for retransmission if we get disconnected before the server accepted it */
+    QHash<QString,Message> mUnaccepted;
+    /* msgId -> token, kept until delivery or COMPLETION_TIMEOUT_MS after dispatch */
+    QHash<QString,QString> mTokens;
+    /* (dispatch time, msgId) in dispatch order, may contain delivered ones */
+    QQueue<QPair<qint64,QString> > mTokenOrder;
+
+    /* Dispatched messages that were not delivered yet */
+    struct InFlight {
+        qint64 queuedMs;
+        bool accepted;
+    };
+    void expire(const InFlight& inFlight);
+    QHash<QString,InFlight> mInFlight;
+    /* msgIds in dispatch order, may contain completed ones */
+    QQueue<QString> mInFlightOrder;
+    QTimer mExpiryTimer;
+    Histogram mAcceptLatency;
+    Histogram mDeliveryLatency;
+    qint64 mUnacceptedExpired;
+    qint64 mUndeliveredExpired;
+};
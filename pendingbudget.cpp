@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "pendingbudget.h"
+
+PendingBudget::PendingBudget(int maxPerChannel, qint64 maxBytes)
+    : mMaxPerChannel(maxPerChannel), mMaxBytes(maxBytes), mBytes(0)
+{
+}
+
+bool PendingBudget::admit(uint channel, const QString& token, int size)
+{
+    if(!mChannels.value(channel).spilled.isEmpty() || !hasRoom(channel, size)) {
+        mChannels[channel].spilled.enqueue(token);
+        return false;
+    }
+    deliver(channel, token, size);
+    return true;
+}
+
+void PendingBudget::deliver(uint channel, const QString& token, int size)
+{
+    mChannels[channel].delivered << token;
+    mTokens[token] = qMakePair(channel, size);
+    mBytes += size;
+}
+
+bool PendingBudget::hasRoom(uint channel, int size) const
+{
+    int count = mChannels.value(channel).delivered.size();
+    if(count >= mMaxPerChannel)
+        return false;
+    return count == 0 || mBytes + size <= mMaxBytes;
+}
+
+bool PendingBudget::acknowledge(const QString& token)
+{
+    auto i = mTokens.find(token);
+    if(i == mTokens.end())
+        return false;
+    uint channel = i->first;
+    mBytes -= i->second;
+    mTokens.erase(i);
+    mChannels[channel].delivered.removeOne(token);
+    forgetIfEmpty(channel);
+    return true;
+}
+
+void PendingBudget::release(uint channel)
+{
+    auto i = mChannels.find(channel);
+    if(i == mChannels.end())
+        return;
+    for(int j = i->delivered.size()-1; j >= 0; --j) {
+        const QString& token = i->delivered[j];
+        mBytes -= mTokens.take(token).second;
+        i->spilled.prepend(token);
+    }
+    i->delivered.clear();
+    forgetIfEmpty(channel);
+}
+
+QList<uint> PendingBudget::spillingChannels() const
+{
+    QList<uint> channels;
+    for(auto i = mChannels.begin(); i != mChannels.end(); ++i)
+        if(!i->spilled.isEmpty())
+            channels << i.key();
+    return channels;
+}
+
+QString PendingBudget::nextSpilled(uint channel) const
+{
+    auto i = mChannels.find(channel);
+    if(i == mChannels.end() || i->spilled.isEmpty())
+        return QString();
+    return i->spilled.head();
+}
+
+void PendingBudget::dropSpilled(uint channel)
+{
+    auto i = mChannels.find(channel);
+    if(i == mChannels.end() || i->spilled.isEmpty())
+        return;
+    i->spilled.dequeue();
+    forgetIfEmpty(channel);
+}
+
+void PendingBudget::forgetIfEmpty(uint channel)
+{
+    auto i = mChannels.find(channel);
+    if(i != mChannels.end() && i->delivered.isEmpty() && i->spilled.isEmpty())
+        mChannels.erase(i);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QQueue>
+#include <QString>
+
+/*
+ * Budget for received messages waiting in channels for a client to ack them.
+ *
+ * A channel holds at most maxPerChannel delivered messages, and all channels
+ * together at most maxBytes, though every channel may always hold one. Messages
+ * beyond the budget are spilled: they stay in the journal only and are paged in
+ * as clients ack others. Once a channel spills, later messages queue up behind
+ * the spilled ones, so that the order is kept.
+ *
+ * Messages are identified by their journal token.
+ */
+class PendingBudget
+{
+public:
+    PendingBudget(int maxPerChannel, qint64 maxBytes);
+
+    /* Counts the message as delivered and returns true if it fits, spills it otherwise */
+    bool admit(uint channel, const QString& token, int size);
+    /* Counts a message as delivered, e.g. one that was paged in */
+    void deliver(uint channel, const QString& token, int size);
+    /* Whether a message of size bytes fits into channel now */
+    bool hasRoom(uint channel, int size) const;
+    /* A client acked a delivered message. Returns false if the token is not pending */
+    bool acknowledge(const QString& token);
+    /* The channel was closed. Its delivered messages were never acked, they are
+     * put in front of the spilled ones, to be delivered again */
+    void release(uint channel);
+
+    /* Channels with spilled messages */
+    QList<uint> spillingChannels() const;
+    /* Oldest spilled message of channel, empty if there is none */
+    QString nextSpilled(uint channel) const;
+    /* Removes the oldest spilled message of channel */
+    void dropSpilled(uint channel);
+
+    /* Whether channel has delivered or spilled messages */
+    bool contains(uint channel) const { return mChannels.contains(channel); }
+    int deliveredCount(uint channel) const { return mChannels.value(channel).delivered.size(); }
+    int spilledCount(uint channel) const { return mChannels.value(channel).spilled.size(); }
+    int messageCount() const { return mTokens.size(); }
+    qint64 byteCount() const { return mBytes; }
+
+private:
+    void forgetIfEmpty(uint channel);
+
+    struct Channel {
+        /* Tokens in delivery order */
+        QList<QString> delivered;
+        QQueue<QString> spilled;
+    };
+    int mMaxPerChannel;
+    qint64 mMaxBytes;
+    QHash<uint,Channel> mChannels;
+    /* token -> (channel, size) of delivered messages */
+    QHash<QString,QPair<uint,int> > mTokens;
+    qint64 mBytes;
+};
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QStringList>
+#include "phonenumber.h"
+
+/* E.164 allows at most 15 digits, the shortest numbers in use have 7 */
+static const int MIN_DIGITS = 7;
+static const int MAX_DIGITS = 15;
+
+/* Assigned country calling codes (ITU-T E.164). No code is a prefix of another */
+static const char* COUNTRY_CODES =
+        "1 7 20 27 30 31 32 33 34 36 39 40 41 43 44 45 46 47 48 49 51 52 53 54 55 56 57 58 "
+        "60 61 62 63 64 65 66 81 82 84 86 90 91 92 93 94 95 98 "
+        "211 212 213 216 218 220 221 222 223 224 225 226 227 228 229 230 231 232 233 234 235 "
+        "236 237 238 239 240 241 242 243 244 245 246 247 248 249 250 251 252 253 254 255 256 "
+        "257 258 260 261 262 263 264 265 266 267 268 269 290 291 297 298 299 "
+        "350 351 352 353 354 355 356 357 358 359 370 371 372 373 374 375 376 377 378 379 380 "
+        "381 382 383 385 386 387 389 420 421 423 "
+        "500 501 502 503 504 505 506 507 508 509 590 591 592 593 594 595 596 597 598 599 "
+        "670 672 673 674 675 676 677 678 679 680 681 682 683 685 686 687 688 689 690 691 692 "
+        "800 808 850 852 853 855 856 870 878 880 881 882 883 886 888 "
+        "960 961 962 963 964 965 966 967 968 970 971 972 973 974 975 976 977 979 "
+        "992 993 994 995 996 998";
+
+/* COUNTRY_CODES compiled into one flag per 1 to 3 digit prefix. Shorter codes
+ * are indexed behind the 3 digit ones, so that "1" and "001" differ */
+class CountryCodeTable
+{
+public:
+    CountryCodeTable() {
+        for(int i = 0; i < TABLE_SIZE; ++i)
+            mValid[i] = false;
+        for(const QString& code : QString(COUNTRY_CODES).split(' ', QString::SkipEmptyParts))
+            mValid[index(code.size(), code.toInt())] = true;
+    }
+    bool contains(int length, int value) const { return mValid[index(length, value)]; }
+private:
+    static int index(int length, int value) { return length == 3 ? value : 1000 + (length - 1) * 100 + value; }
+    static const int TABLE_SIZE = 1200;
+    bool mValid[TABLE_SIZE];
+};
+
+static const CountryCodeTable& countryCodes()
+{
+    static CountryCodeTable table;
+    return table;
+}
+
+/* Returns the length of the country code digits start with, 0 if there is none */
+static int countryCodeLength(const QChar* digits, int size)
+{
+    const CountryCodeTable& table = countryCodes();
+    int value = 0;
+    for(int length = 1; length <= 3 && length <= size; ++length) {
+        value = value * 10 + (digits[length - 1].unicode() - '0');
+        if(table.contains(length, value))
+            return length;
+    }
+    return 0;
+}
+
+QString PhoneNumber::normalize(const QString& address, const QString& defaultCountryCode)
+{
+    /* Single pass over the characters: keep the digits, skip visual separators */
+    QChar digits[MAX_DIGITS + 4];
+    int size = 0;
+    bool plus = false;
+    const QChar* c = address.constData();
+    const QChar* end = c + address.size();
+    for(; c != end; ++c) {
+        ushort u = c->unicode();
+        if(u >= '0' && u <= '9') {
+            if(size == MAX_DIGITS + 3)
+                return QString();
+            digits[size++] = *c;
+        } else if(u == '+' && size == 0 && !plus) {
+            plus = true;
+        } else if(u != ' ' && u != '-' && u != '.' && u != '(' && u != ')' && u != '/'
+                  && u != 0xa0 /* no-break space */) {
+            return QString();
+        }
+    }
+
+    QString ret;
+    if(plus) {
+        ret = QString(digits, size);
+    } else if(size > 2 && digits[0] == QLatin1Char('0') && digits[1] == QLatin1Char('0')) {
+        ret = QString(digits + 2, size - 2);
+    } else if(!defaultCountryCode.isEmpty()) {
+        /* National number, possibly with trunk prefix */
+        int skip = (size > 0 && digits[0] == QLatin1Char('0')) ? 1 : 0;
+        ret = defaultCountryCode + QString(digits + skip, size - skip);
+    } else {
+        return QString();
+    }
+
+    if(ret.size() < MIN_DIGITS || ret.size() > MAX_DIGITS
+       || !countryCodeLength(ret.constData(), ret.size()))
+        return QString();
+    return ret;
+}
+
+QString PhoneNumber::normalizeAccount(const QString& account)
+{
+    QString number = normalize(account);
+    /* A leading zero is a national or "00" prefixed number, normalize() knows those */
+    if(number.isEmpty() && !account.isEmpty() && account.at(0) != QLatin1Char('0')
+       && account.at(0) != QLatin1Char('+'))
+        number = normalize(QLatin1Char('+') + account);
+    return number;
+}
+
+QString PhoneNumber::countryCode(const QString& digits)
+{
+    for(QChar c : digits)
+        if(c < QLatin1Char('0') || c > QLatin1Char('9'))
+            return QString();
+    return digits.left(countryCodeLength(digits.constData(), digits.size()));
+}
+
+QString PhoneNumber::fromUri(const QString& uri)
+{
+    if(!uri.startsWith(QLatin1String("tel:"), Qt::CaseInsensitive))
+        return QString();
+    int params = uri.indexOf(QLatin1Char(';'));
+    return uri.mid(4, params < 0 ? -1 : params - 4);
+}
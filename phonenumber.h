@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QString>
+
+/*
+ * Normalization of phone numbers as found in address books and tel: URIs
+ * to the E.164 digits WhatsApp uses in its ids.
+ */
+class PhoneNumber
+{
+public:
+    /* Returns the E.164 digits of address without "+", or an empty string if it is
+     * not a valid number. Punctuation is ignored, "+" and "00" introduce international
+     * numbers. National numbers need defaultCountryCode, e.g. "49" */
+    static QString normalize(const QString& address, const QString& defaultCountryCode = QString());
+    /* Normalizes a configured account number, which usually lacks the "+".
+     * Returns an empty string if it is not a valid international number */
+    static QString normalizeAccount(const QString& account);
+    /* The country calling code of E.164 digits, or an empty string */
+    static QString countryCode(const QString& digits);
+    /* Returns the number of a "tel:" URI, without parameters, or an empty string */
+    static QString fromUri(const QString& uri);
+};
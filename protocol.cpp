@@ -18,6 +18,8 @@
 
 #include "protocol.h"
 #include "connection.h"
+#include "jid.h"
+#include "phonenumber.h"
 
 #include <TelepathyQt/BaseConnection>
 #include <TelepathyQt/Constants>
@@ -55,6 +57,13 @@ SimpleStatusSpecMap Protocol::getSimpleStatusSpecMap()
     return specs;
 }
 
+AvatarSpec Protocol::getAvatarSpec()
+{
+    //WhatsApp profile pictures are jpegs of up to 640x640
+    return AvatarSpec(QStringList() << QLatin1String("image/jpeg"),
+                      96, 640, 640, 96, 640, 640, 64*1024);
+}
+
 Protocol::Protocol(const QDBusConnection &dbusConnection, const QString &name)
     : BaseProtocol(dbusConnection, name)
 {
@@ -63,6 +72,10 @@ Protocol::Protocol(const QDBusConnection &dbusConnection, const QString &name)
                              QLatin1String("s"), ConnMgrParamFlagRequired)
         << ProtocolParameter(QLatin1String("password"),
                              QLatin1String("s"), ConnMgrParamFlagRequired | ConnMgrParamFlagSecret)
+        << ProtocolParameter(QLatin1String("channel-idle-timeout"),
+                             QLatin1String("u"), ConnMgrParamFlagHasDefault, 30*60u)
+        << ProtocolParameter(QLatin1String("media-download-limit"),
+                             QLatin1String("u"), ConnMgrParamFlagHasDefault, 0u)
         /*<< ProtocolParameter(QLatin1String("uid"),
                              QLatin1String("s"), ConnMgrParamFlagRegister)*/);
 
@@ -91,8 +104,7 @@ Protocol::Protocol(const QDBusConnection &dbusConnection, const QString &name)
 
     // Avatars
     avatarsIface = BaseProtocolAvatarsInterface::create();
-    avatarsIface->setAvatarDetails(AvatarSpec(QStringList() << QLatin1String("image/png"),
-                16, 64, 32, 16, 64, 32, 1024));
+    avatarsIface->setAvatarDetails(Protocol::getAvatarSpec());
     plugInterface(AbstractProtocolInterfacePtr::dynamicCast(avatarsIface));
 
     presenceIface = BaseProtocolPresenceInterface::create();
@@ -109,9 +121,21 @@ BaseConnectionPtr Protocol::createConnection(const QVariantMap &parameters, Tp::
     if(!parameters.contains("account")) {
         error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("account is missing"));
         return BaseConnectionPtr();
-    } else {
-        return BaseConnection::create<YSConnection>( "whosthere", name().toLatin1(), parameters);
     }
+
+    /* The account becomes our own jid and names the per-account files, so it
+     * must be the plain E.164 digits */
+    QString account = parameters.value("account").toString();
+    Jid jid = Jid::parse(account);
+    QString number = jid.isContact() ? QString::number(jid.user()) : PhoneNumber::normalizeAccount(account);
+    if(number.isEmpty()) {
+        qDebug() << "Protocol::createConnection: invalid account " << account;
+        error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("account is not an international phone number"));
+        return BaseConnectionPtr();
+    }
+    QVariantMap normalized = parameters;
+    normalized["account"] = number;
+    return BaseConnection::create<YSConnection>( "whosthere", name().toLatin1(), normalized);
 }
 
 QString Protocol::identifyAccount(const QVariantMap &parameters, Tp::DBusError *error)
@@ -121,24 +145,46 @@ QString Protocol::identifyAccount(const QVariantMap &parameters, Tp::DBusError *
     return QString();
 }
 
+/* Accepts ids and international phone numbers. There is no account here,
+ * so national numbers cannot be resolved */
 QString Protocol::normalizeContact(const QString &contactId, Tp::DBusError *error)
 {
-    qDebug() << "Protocol::normalizeContact " << contactId;
-    error->set(QLatin1String("NormalizeContact.Error.Test"), QLatin1String(""));
-    return QString();
+    Jid jid = Jid::parse(contactId);
+    if(jid.isContact())
+        return jid.toString();
+
+    QString number = PhoneNumber::normalize(contactId);
+    if(number.isEmpty()) {
+        qDebug() << "Protocol::normalizeContact: invalid " << contactId;
+        error->set(TP_QT_ERROR_INVALID_HANDLE, QLatin1String("Not a WhatsApp id or international phone number"));
+        return QString();
+    }
+    return number + QLatin1String("@s.whatsapp.net");
 }
 
 QString Protocol::normalizeVCardAddress(const QString &vcardField, const QString vcardAddress,
         Tp::DBusError *error)
 {
-    qDebug() << "Protocol::normalizeVCardAddress " << vcardField;
-    error->set(QLatin1String("NormalizeVCardAddress.Error.Test"), QLatin1String(""));
-    return QString();
+    if(vcardField.compare(QLatin1String("tel"), Qt::CaseInsensitive) != 0) {
+        error->set(TP_QT_ERROR_NOT_IMPLEMENTED, QLatin1String("Only field 'tel' is supported"));
+        return QString();
+    }
+    QString number = PhoneNumber::normalize(vcardAddress);
+    if(number.isEmpty()) {
+        qDebug() << "Protocol::normalizeVCardAddress: invalid " << vcardAddress;
+        error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("Not an international phone number"));
+        return QString();
+    }
+    return QLatin1Char('+') + number;
 }
 
 QString Protocol::normalizeContactUri(const QString &uri, Tp::DBusError *error)
 {
-    qDebug() << "Protocol::normalizeContactUri " << uri;
-    error->set(QLatin1String("NormalizeContactUri.Error.Test"), QLatin1String(""));
-    return QString();
+    QString number = PhoneNumber::normalize(PhoneNumber::fromUri(uri));
+    if(number.isEmpty()) {
+        qDebug() << "Protocol::normalizeContactUri: invalid " << uri;
+        error->set(TP_QT_ERROR_INVALID_ARGUMENT, QLatin1String("Not a tel: URI with an international phone number"));
+        return QString();
+    }
+    return QLatin1String("tel:+") + number;
 }
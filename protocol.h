@@ -30,6 +30,7 @@ public:
     virtual ~Protocol();
 
     static Tp::SimpleStatusSpecMap getSimpleStatusSpecMap();
+    static Tp::AvatarSpec getAvatarSpec();
 private:
     Tp::BaseConnectionPtr createConnection(const QVariantMap &parameters, Tp::DBusError *error);
     QString identifyAccount(const QVariantMap &parameters, Tp::DBusError *error);
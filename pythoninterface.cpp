@@ -17,8 +17,16 @@
  */
 
 #include "Python.h"
+#include "marshal.h"
+#include <QCryptographicHash>
+#include <QDateTime>
 #include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QStandardPaths>
 #include "pythoninterface.h"
+#include "trace.h"
 
 #include "YowsupInterface.py.h"
 
@@ -27,7 +35,7 @@ using namespace boost::python;
 
 const char* PYTHON_MODULE = "YowsupInterface";
 
-YowsupInterface::YowsupInterface(QObject* parent) : QObject(parent) { //for vtable
+YowsupInterface::YowsupInterface(QObject* parent) : QObject(parent), mLastEventMs(0), mRecorder(0) { //for vtable
 }
 
 /** to-python convert to QStrings */
@@ -119,6 +127,18 @@ struct QByteArray_to_python_str
       }
 };
 
+/* Direct conversions for the hot paths, without the converter registry lookup */
+static object toPython(const QString& s)
+{
+    QByteArray latin1 = s.toLatin1();
+    return object(handle<>(PyString_FromStringAndSize(latin1.constData(), latin1.size())));
+}
+
+static object toPython(const QByteArray& s)
+{
+    return object(handle<>(PyString_FromStringAndSize(s.constData(), s.size())));
+}
+
 GILStateHolder::GILStateHolder() {
    gstate = PyGILState_Ensure();
 }
@@ -128,9 +148,180 @@ GILStateHolder::~GILStateHolder() {
 
 boost::python::object PythonInterface::pModule;
 
+/*
+ * Signal trampolines: one C function per yowsup signal, registered directly as listener.
+ * The function's self is a capsule holding the YowsupInterface, the arguments are
+ * converted according to the signal's signature.
+ */
+template<int...> struct Indices {};
+template<int N, int... I> struct MakeIndices : MakeIndices<N-1, N-1, I...> {};
+template<int... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+static const char* HANDLER_CAPSULE = "YowsupInterface";
+
+template<typename... A>
+static void emitValues(YowsupInterface* handler, void (YowsupInterface::*signal)(A...), const A&... values)
+{
+    if(TraceRecorder* recorder = handler->recorder())
+        recorder->record(QMetaMethod::fromSignal(signal), QVariantList{ QVariant::fromValue(values)... });
+    (handler->*signal)(values...);
+}
+
+template<typename... A, int... I>
+static void emitSignal(YowsupInterface* handler, void (YowsupInterface::*signal)(A...), PyObject* args, Indices<I...>)
+{
+    emitValues(handler, signal, extract<A>(PyTuple_GET_ITEM(args, I))()...);
+}
+
+template<typename... A>
+static PyObject* dispatch(void (YowsupInterface::*signal)(A...), PyObject* self, PyObject* args)
+{
+    if(PyTuple_GET_SIZE(args) != sizeof...(A)) {
+        PyErr_Format(PyExc_TypeError, "signal expects %d arguments, got %d",
+                     int(sizeof...(A)), int(PyTuple_GET_SIZE(args)));
+        return 0;
+    }
+    YowsupInterface* handler = static_cast<YowsupInterface*>(PyCapsule_GetPointer(self, HANDLER_CAPSULE));
+    if(!handler)
+        return 0;
+    handler->setLastEventMs(QDateTime::currentMSecsSinceEpoch());
+    try {
+        emitSignal(handler, signal, args, typename MakeIndices<sizeof...(A)>::type());
+    } catch(const error_already_set& e) {
+        /* The python error is set, yowsup will report it */
+        return 0;
+    }
+    Py_RETURN_NONE;
+}
+
+template<typename Signal, Signal signal>
+static PyObject* trampoline(PyObject* self, PyObject* args)
+{
+    return dispatch(signal, self, args);
+}
+
+#define T(X) { #X, &trampoline<decltype(&YowsupInterface::X), &YowsupInterface::X>, METH_VARARGS, 0 },
+static PyMethodDef signalTrampolines[] = {
+    T(auth_success)
+    T(auth_fail)
+    T(status_dirty)
+    T(message_received)
+    T(image_received)
+    T(video_received)
+    T(audio_received)
+    T(location_received)
+    T(vcard_received)
+    T(group_imageReceived)
+    T(group_videoReceived)
+    T(group_audioReceived)
+    T(group_locationReceived)
+    T(group_vcardReceived)
+    T(group_messageReceived)
+    T(notification_contactProfilePictureUpdated)
+    T(notification_contactProfilePictureRemoved)
+    T(notification_groupParticipantAdded)
+    T(notification_groupParticipantRemoved)
+    T(notification_groupPictureUpdated)
+    T(notification_groupPictureRemoved)
+    T(disconnected)
+    T(receipt_messageSent)
+    T(receipt_messageDelivered)
+    T(presence_updated)
+    T(presence_available)
+    T(presence_unavailable)
+    T(group_subjectReceived)
+    T(profile_setStatusSuccess)
+    T(group_setSubjectSuccess)
+    T(group_gotInfo)
+    T(group_addParticipantsSuccess)
+    T(group_removeParticipantsSuccess)
+    T(group_createSuccess)
+    T(group_createFail)
+    T(group_endSuccess)
+    T(group_gotPicture)
+    T(group_infoError)
+    T(group_gotParticipants)
+    T(group_setPictureSuccess)
+    T(group_setPictureError)
+    T(profile_setPictureSuccess)
+    T(profile_setPictureError)
+    T(receipt_visible)
+    T(contact_gotProfilePictureId)
+    T(contact_typing)
+    T(contact_paused)
+    T(contact_gotProfilePicture)
+    T(message_error)
+    T(ping)
+    T(pong)
+    T(media_uploadRequestSuccess)
+    T(media_uploadRequestFailed)
+    T(media_uploadRequestDuplicate)
+};
+#undef T
+
+/* Returns a dict of signal name -> listener emitting that signal on handler */
+static object createListeners(YowsupInterface* handler)
+{
+    object capsule(handle<>(PyCapsule_New(handler, HANDLER_CAPSULE, 0)));
+    dict listeners;
+    for(PyMethodDef& def : signalTrampolines)
+        listeners[def.ml_name] = object(handle<>(PyCFunction_New(&def, capsule.ptr())));
+    return listeners;
+}
+
+/*
+ * Returns the code object of our python wrapper. The compiled code is cached on disk,
+ * keyed by the source and the python version.
+ */
+static PyObject* loadWrapperCode()
+{
+    QByteArray key = QCryptographicHash::hash(QByteArray(YowsupInterfacePy) + Py_GetVersion(),
+                                              QCryptographicHash::Sha1);
+    QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+                       + "/telepathy-whosthere";
+    QFile cache(cacheDir + "/YowsupInterface.pyc");
+
+    if(cache.open(QIODevice::ReadOnly)) {
+        QByteArray data = cache.readAll();
+        cache.close();
+        if(data.startsWith(key)) {
+            PyObject* code = PyMarshal_ReadObjectFromString(data.data() + key.size(), data.size() - key.size());
+            if(code && PyCode_Check(code))
+                return code;
+            Py_XDECREF(code);
+            PyErr_Clear();
+        }
+    }
+
+    PyObject* code = Py_CompileString(YowsupInterfacePy,"YowsupInterface.py",Py_file_input);
+    if(!code)
+        return 0;
+
+    PyObject* marshalled = PyMarshal_WriteObjectToString(code, Py_MARSHAL_VERSION);
+    if(marshalled) {
+        QDir().mkpath(cacheDir);
+        if(cache.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            cache.write(key);
+            cache.write(PyString_AsString(marshalled), PyString_Size(marshalled));
+            cache.close();
+        }
+        Py_DECREF(marshalled);
+    } else {
+        PyErr_Clear();
+    }
+    return code;
+}
+
 void PythonInterface::initPython()
 {
+    static bool initialized = false;
+    if(initialized)
+        return;
+    initialized = true;
+
     qDebug() << "PythonInterface::initPython";
+    QElapsedTimer timer;
+    timer.start();
     Py_Initialize();
     PyEval_InitThreads();
 
@@ -140,86 +331,37 @@ void PythonInterface::initPython()
     try {
         pModule = object( (handle<>(borrowed(PyImport_AddModule("__main__")))) );
         object main_namespace = pModule.attr("__dict__");
-
-#define D(X) .def(#X,&YowsupInterface::X)
-        main_namespace["Emb"] = class_<YowsupInterface, boost::noncopyable>("Emb", no_init)
-                D(auth_success)
-                D(auth_fail)
-                D(status_dirty)
-                D(message_received)
-                D(disconnected)
-                D(receipt_messageSent)
-                D(receipt_messageDelivered)
-                D(presence_updated)
-                D(presence_available)
-                D(presence_unavailable)
-                D(message_received)
-                D(group_messageReceived)
-                D(group_gotInfo)
-                D(group_setSubjectSuccess)
-                D(group_subjectReceived)
-                D(group_addParticipantsSuccess)
-                D(group_removeParticipantsSuccess)
-                D(group_createSuccess)
-                D(group_createFail)
-                D(group_endSuccess)
-                D(group_gotPicture)
-                D(group_infoError)
-                D(group_gotParticipants)
-                D(group_setPictureSuccess)
-                D(group_setPictureError)
-                D(profile_setStatusSuccess)
-                D(profile_setPictureSuccess)
-                D(profile_setPictureError)
-                D(status_dirty)
-                D(receipt_messageSent)
-                D(receipt_messageDelivered)
-                D(receipt_visible)
-                D(contact_gotProfilePictureId)
-                D(contact_typing)
-                D(contact_paused)
-                D(contact_gotProfilePicture)
-                D(notification_contactProfilePictureUpdated)
-                D(notification_groupParticipantAdded)
-                D(notification_groupParticipantRemoved)
-                D(notification_groupPictureUpdated)
-                D(image_received)
-                D(video_received)
-                D(audio_received)
-                D(location_received)
-                D(vcard_received)
-                D(group_imageReceived)
-                D(group_videoReceived)
-                D(group_audioReceived)
-                D(group_locationReceived)
-                D(group_vcardReceived)
-                D(message_error)
-                D(disconnected)
-                D(ping)
-                D(pong)
-                ;
-#undef D
-        PyObject* code = Py_CompileString(YowsupInterfacePy,"YowsupInterface.py",Py_file_input);
+        PyObject* code = loadWrapperCode();
         if(!code) {
             PyErr_Print();
             exit(1);
         }
-        PyEval_EvalCode((PyCodeObject*)code,main_namespace.ptr(),main_namespace.ptr());
+        PyObject* result = PyEval_EvalCode((PyCodeObject*)code,main_namespace.ptr(),main_namespace.ptr());
+        Py_DECREF(code);
+        if(!result) {
+            PyErr_Print();
+            exit(1);
+        }
+        Py_DECREF(result);
     } catch(const error_already_set& e) {
         qDebug() << "Python error:";
         PyErr_Print();
         exit(1);
     }
     PyEval_SaveThread();
-    qDebug() << "PythonInterface::initPython exit";
+    qDebug() << "PythonInterface::initPython exit after " << timer.elapsed() << " ms";
 }
 
-PythonInterface::PythonInterface(YowsupInterface* handler)
+PythonInterface::PythonInterface(YowsupInterface* handler, bool offline) : mHandler(handler), readerRunning(false)
 {
+    initPython();
     GILStateHolder gstate;
     try {
-        object pFunc = pModule.attr("init");
-        pConnectionManager = pFunc(ptr(handler));
+        object pFunc = pModule.attr(offline ? "initOffline" : "init");
+        pConnectionManager = pFunc(createListeners(handler));
+        pMessageSend = method("message_send");
+        pMessageAck = method("message_ack");
+        pDeliveredAck = method("delivered_ack");
     } catch(const error_already_set& e) {
         qDebug() << "Python error:";
         PyErr_Print();
@@ -230,24 +372,34 @@ PythonInterface::PythonInterface(YowsupInterface* handler)
 PythonInterface::~PythonInterface()
 {
     if(readerThread.joinable()) {
-        qDebug() << "PythonInterface::~PythonInterface: sending disconnect, waiting to join";
-        call("disconnect","shutdown");
+        if(readerRunning) {
+            qDebug() << "PythonInterface::~PythonInterface: sending disconnect, waiting to join";
+            call("disconnect","shutdown");
+        }
         readerThread.join();
         qDebug() << "PythonInterface::~PythonInterface: readerThread joined";
     }
 }
 
-template object PythonInterface::call<QString,QByteArray>(const QString& method, const QString&, const QByteArray&);
-template object PythonInterface::call<>(const QString& method);
-template object PythonInterface::call<QString>(const QString& method, const QString&);
-template object PythonInterface::call<QString,QString>(const QString& method, const QString&, const QString&);
+template object PythonInterface::call<QString,QByteArray>(const QString& name, const QString&, const QByteArray&);
+template object PythonInterface::call<>(const QString& name);
+template object PythonInterface::call<QString>(const QString& name, const QString&);
+template object PythonInterface::call<QString,QString>(const QString& name, const QString&, const QString&);
+template object PythonInterface::call<QString,QString,QString>(const QString& name, const QString&, const QString&, const QString&);
+
+object PythonInterface::method(const QString& name) {
+    auto i = mMethods.find(name);
+    if(i == mMethods.end())
+        i = mMethods.insert(name, pModule.attr("resolveMethod")(pConnectionManager, name));
+    return i.value();
+}
 
 template<typename... T>
-object PythonInterface::call(const QString& method, const T&... args) {
+object PythonInterface::call(const QString& name, const T&... args) {
     GILStateHolder gstate;
     object pRet;
     try {
-        pRet = pModule.attr("call")(pConnectionManager, object(method), object(args)...);
+        pRet = method(name)(object(args)...);
     } catch(const error_already_set& e) {
         qDebug() << "Python error in call";
         PyErr_Print();
@@ -274,13 +426,89 @@ object PythonInterface::call_intern(const char* method, const T&... args) {
     return pRet;
 }
 
-/* Do not call this more than once! */
-void PythonInterface::runReaderThread()
-{
-    if(readerThread.joinable()) {
-        qDebug() << "PythonInterface::runReaderThread may not be called multiple times";
+QStringList PythonInterface::sendMessages(const QList<QPair<QString,QByteArray> >& messages) {
+    GILStateHolder gstate;
+    QStringList msgIds;
+    try {
+        for(const QPair<QString,QByteArray>& message : messages) {
+            object pRet = pMessageSend(toPython(message.first), toPython(message.second));
+            extract<QString> getMsgId(pRet);
+            msgIds << (getMsgId.check() ? getMsgId() : QString());
+        }
+    } catch(const error_already_set& e) {
+        qDebug() << "Python error in sendMessages";
+        PyErr_Print();
+        exit(1);
+    }
+    return msgIds;
+}
+
+QString PythonInterface::sendMedia(const QString& jid, const QString& type, const QString& url, const QString& name,
+                                   qint64 size, const QString& preview) {
+    GILStateHolder gstate;
+    try {
+        object send = method("message_" + type + "Send");
+        object pRet = type == "audio"
+                ? send(toPython(jid), toPython(url), toPython(name), toPython(QString::number(size)))
+                : send(toPython(jid), toPython(url), toPython(name), toPython(QString::number(size)), toPython(preview));
+        extract<QString> getMsgId(pRet);
+        return getMsgId.check() ? getMsgId() : QString();
+    } catch(const error_already_set& e) {
+        qDebug() << "Python error in sendMedia";
+        PyErr_Print();
+        exit(1);
+    }
+}
+
+void PythonInterface::ackMessages(const QList<QPair<QString,QString> >& acks) {
+    if(acks.isEmpty())
         return;
+    GILStateHolder gstate;
+    try {
+        for(const QPair<QString,QString>& ack : acks)
+            pMessageAck(toPython(ack.first), toPython(ack.second));
+    } catch(const error_already_set& e) {
+        qDebug() << "Python error in ackMessages";
+        PyErr_Print();
+        exit(1);
+    }
+}
+
+void PythonInterface::ackDelivered(const QString& jid, const QString& msgId) {
+    GILStateHolder gstate;
+    try {
+        pDeliveredAck(toPython(jid), toPython(msgId));
+    } catch(const error_already_set& e) {
+        qDebug() << "Python error in ackDelivered";
+        PyErr_Print();
+        exit(1);
+    }
+}
+
+void PythonInterface::requestPictureIds(const QStringList& jids) {
+    GILStateHolder gstate;
+    try {
+        boost::python::list pJids;
+        for(const QString& jid : jids)
+            pJids.append(jid);
+        pModule.attr("getPictureIds")(pConnectionManager, pJids);
+    } catch(const error_already_set& e) {
+        qDebug() << "Python error in requestPictureIds";
+        PyErr_Print();
+        exit(1);
+    }
+}
+
+bool PythonInterface::runReaderThread()
+{
+    /* The previous connection was lost, its reader is about to exit */
+    if(readerRunning) {
+        qDebug() << "PythonInterface::runReaderThread: previous reader thread is still running";
+        return false;
     }
+    if(readerThread.joinable())
+        readerThread.join();
+    readerRunning = true;
     auto lambda = [this]()
         {
             try {
@@ -294,6 +522,10 @@ void PythonInterface::runReaderThread()
                 PyErr_Print();
                 exit(1);
             }
+            readerRunning = false;
+            /* Queued to the main thread */
+            emit mHandler->reader_exited();
         };
     readerThread = thread( lambda );
+    return true;
 }
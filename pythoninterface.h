@@ -19,16 +19,32 @@
 #ifndef PYTHONINTERFACE_H
 #define PYTHONINTERFACE_H
 
+#include <atomic>
 #include <thread>
+#include <QHash>
 #include <QObject>
 #include <QString>
+#include <QStringList>
 #include <boost/python.hpp>
+#include "messagesender.h"
+
+class TraceRecorder;
 
 /* Class which implements all signals emitted by yowsup */
 class YowsupInterface : public QObject {
     Q_OBJECT
 public:
     YowsupInterface(QObject *parent);
+    /* Time of the last signal from yowsup in ms since the epoch, 0 if there was none */
+    qint64 lastEventMs() const { return mLastEventMs; }
+    /* Called from the reader thread for every signal */
+    void setLastEventMs(qint64 ms) { mLastEventMs = ms; }
+    /* Sees every signal before it is emitted, if set. Set it before the reader thread runs */
+    TraceRecorder* recorder() const { return mRecorder; }
+    void setRecorder(TraceRecorder* recorder) { mRecorder = recorder; }
+private:
+    std::atomic<qint64> mLastEventMs;
+    TraceRecorder* mRecorder;
 signals:
     void auth_success(QString mobilenumber);
     void auth_fail(QString mobilenumber, QString reason);
@@ -90,12 +106,21 @@ signals:
     void message_error(QString msgId,QString jid,QString errorCode);
     void ping(QString pingId);
     void pong();
+
+    void media_uploadRequestSuccess(QString hash, QString url, int resumeFrom);
+    void media_uploadRequestFailed(QString hash);
+    void media_uploadRequestDuplicate(QString hash, QString url);
+
+    /* Not from yowsup: the reader thread returned, see PythonInterface::runReaderThread() */
+    void reader_exited();
 };
 
-class PythonInterface
+class PythonInterface : public MessageSender
 {
 public:
-    PythonInterface(YowsupInterface* handler);
+    /* When offline, yowsup is replaced by a stub that sends nothing; signals are
+     * then expected to come from a TraceReplayer */
+    PythonInterface(YowsupInterface* handler, bool offline = false);
     ~PythonInterface();
     /* Call a python function on Yowsup's methodInterface */
     template<typename... T>
@@ -103,16 +128,42 @@ public:
     /* Call a python function in our python wrapper */
     template<typename... T>
     boost::python::object call_intern(const char* method, const T&... args);
+    /* Sends (jid, content) pairs with a single GIL acquisition. Returns yowsup's msgIds,
+     * an empty string for each message that could not be sent */
+    QStringList sendMessages(const QList<QPair<QString,QByteArray> >& messages);
+    /* message_imageSend, message_videoSend or message_audioSend, depending on type.
+     * Returns yowsup's msgId, or an empty string if it could not be sent */
+    QString sendMedia(const QString& jid, const QString& type, const QString& url, const QString& name,
+                      qint64 size, const QString& preview);
+    /* message_ack for (jid, msgId) pairs with a single GIL acquisition */
+    void ackMessages(const QList<QPair<QString,QString> >& acks);
+    /* delivered_ack */
+    void ackDelivered(const QString& jid, const QString& msgId);
+    /* Asks for the picture ids of all jids in one request, answered by contact_gotProfilePictureId */
+    void requestPictureIds(const QStringList& jids);
     /* Runs the thread reading from the connection to whatsapp. Signals
-     *  will be dispatched from that thread.
+     *  will be dispatched from that thread. May be called again after the
+     *  connection was lost, to read from the new connection. Returns false
+     *  without blocking if the reader of the previous connection is still
+     *  running; the handler's reader_exited() follows once it returned.
      */
-    void runReaderThread();
-    /* One-time initialization */
+    bool runReaderThread();
+    /* One-time initialization, done by the first PythonInterface */
     static void initPython();
 private:
+    /* Returns the callable behind method of yowsup's methodInterface. Needs the GIL */
+    boost::python::object method(const QString& name);
     static boost::python::object pModule;
     boost::python::object pConnectionManager;
+    /* Resolved methods, only accessed with the GIL held */
+    QHash<QString,boost::python::object> mMethods;
+    /* The hot methods, resolved in the constructor */
+    boost::python::object pMessageSend;
+    boost::python::object pMessageAck;
+    boost::python::object pDeliveredAck;
+    YowsupInterface* mHandler;
     std::thread readerThread;
+    std::atomic<bool> readerRunning;
 };
 
 /* Class to hold ensure/release GIL lock */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "roommembers.h"
+
+Tp::UIntList RoomMembers::setMembers(uint room, const QSet<uint>& members, Tp::UIntList* removed)
+{
+    Tp::UIntList added;
+    QSet<uint>& current = mMembers[room];
+
+    for(uint member : current) {
+        if(members.contains(member))
+            continue;
+        *removed << member;
+        auto i = mRooms.find(member);
+        if(i != mRooms.end()) {
+            i->remove(room);
+            if(i->isEmpty())
+                mRooms.erase(i);
+        }
+    }
+    for(uint member : members) {
+        if(current.contains(member))
+            continue;
+        added << member;
+        mRooms[member].insert(room);
+    }
+    current = members;
+    return added;
+}
+
+bool RoomMembers::addMember(uint room, uint member)
+{
+    QSet<uint>& current = mMembers[room];
+    if(current.contains(member))
+        return false;
+    current.insert(member);
+    mRooms[member].insert(room);
+    return true;
+}
+
+bool RoomMembers::removeMember(uint room, uint member)
+{
+    auto i = mMembers.find(room);
+    if(i == mMembers.end() || !i->remove(member))
+        return false;
+    auto j = mRooms.find(member);
+    if(j != mRooms.end()) {
+        j->remove(room);
+        if(j->isEmpty())
+            mRooms.erase(j);
+    }
+    return true;
+}
+
+void RoomMembers::removeRoom(uint room)
+{
+    Tp::UIntList removed;
+    setMembers(room, QSet<uint>(), &removed);
+    mMembers.remove(room);
+}
+
+bool RoomMembers::contains(uint room, uint member) const
+{
+    auto i = mMembers.find(room);
+    return i != mMembers.end() && i->contains(member);
+}
+
+int RoomMembers::memberCount(uint room) const
+{
+    auto i = mMembers.find(room);
+    return i == mMembers.end() ? 0 : i->size();
+}
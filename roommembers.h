@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QSet>
+#include <TelepathyQt/Types>
+
+/*
+ * Two-way index between room handles and contact handles of their members.
+ * All mutators report what actually changed, so callers only signal real changes.
+ */
+class RoomMembers
+{
+public:
+    /* Replaces the member set of room. Returns the members that were added,
+     * stores those that were removed in *removed */
+    Tp::UIntList setMembers(uint room, const QSet<uint>& members, Tp::UIntList* removed);
+    /* Returns true if member was not in room before */
+    bool addMember(uint room, uint member);
+    /* Returns true if member was in room before */
+    bool removeMember(uint room, uint member);
+    void removeRoom(uint room);
+
+    bool contains(uint room, uint member) const;
+    QSet<uint> members(uint room) const { return mMembers.value(room); }
+    QSet<uint> rooms(uint member) const { return mRooms.value(member); }
+    int memberCount(uint room) const;
+
+private:
+    /* room -> members */
+    QHash<uint,QSet<uint> > mMembers;
+    /* member -> rooms */
+    QHash<uint,QSet<uint> > mRooms;
+};
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QtTest>
+#include "avatarcache.h"
+
+class TestAvatarCache : public QObject
+{
+    Q_OBJECT
+private slots:
+    void fetchesOnce();
+    void replacesOlderPicture();
+};
+
+static const QString JID = "491701234567@s.whatsapp.net";
+
+/* Stands in for the picture yowsup downloaded */
+static QString picture(const QTemporaryDir& dir, const QByteArray& data)
+{
+    QString filename = dir.path() + "/download";
+    QFile file(filename);
+    file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    file.write(data);
+    return filename;
+}
+
+void TestAvatarCache::fetchesOnce()
+{
+    QTemporaryDir dir;
+    AvatarCache cache(dir.path() + "/avatars");
+    QSignalSpy requested(&cache, SIGNAL(fetchRequested(QString)));
+    QSignalSpy retrieved(&cache, SIGNAL(avatarRetrieved(QString,QString,QByteArray)));
+    QString token = AvatarCache::tokenFor(JID, 1);
+
+    cache.request(JID, token);
+    cache.request(JID, token);
+    QCOMPARE(requested.count(), 1);
+    cache.fetched(JID, picture(dir, "one"));
+    QCOMPARE(retrieved.count(), 1);
+
+    /* From the cache now */
+    cache.request(JID, token);
+    QCOMPARE(requested.count(), 1);
+    QCOMPARE(retrieved.count(), 2);
+    QCOMPARE(retrieved[1][2].toByteArray(), QByteArray("one"));
+}
+
+/* Only the current picture of a contact stays on disk */
+void TestAvatarCache::replacesOlderPicture()
+{
+    QTemporaryDir dir;
+    QString directory = dir.path() + "/avatars";
+    AvatarCache cache(directory);
+    QString other = AvatarCache::tokenFor("491709999999@s.whatsapp.net", 1);
+    cache.request("491709999999@s.whatsapp.net", other);
+    cache.fetched("491709999999@s.whatsapp.net", picture(dir, "other"));
+    cache.request(JID, AvatarCache::tokenFor(JID, 1));
+    cache.fetched(JID, picture(dir, "one"));
+    QCOMPARE(QDir(directory).entryList(QDir::Files).size(), 2);
+
+    QString token = AvatarCache::tokenFor(JID, 2);
+    cache.request(JID, token);
+    cache.fetched(JID, picture(dir, "two"));
+    QCOMPARE(QDir(directory).entryList(QDir::Files).toSet(), QSet<QString>() << token << other);
+}
+
+QTEST_MAIN(TestAvatarCache)
+#include "tst_avatarcache.moc"
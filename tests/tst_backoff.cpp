@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <climits>
+#include <QSet>
+#include <QtTest>
+#include "backoff.h"
+
+static const int BASE_MS = 1000;
+static const int MAX_MS = 5*60*1000;
+
+class TestBackoff : public QObject
+{
+    Q_OBJECT
+private slots:
+    void withinBounds();
+    void capped();
+    void negativeAttempt();
+    void jittered();
+};
+
+/* The delay of attempt n lies in [d/2, d] for d = min(base * 2^n, max) */
+void TestBackoff::withinBounds()
+{
+    for(int attempt = 0; attempt < 40; ++attempt) {
+        qint64 delay = qMin(qint64(BASE_MS) << qMin(attempt, 30), qint64(MAX_MS));
+        for(int i = 0; i < 100; ++i) {
+            int ms = backoffDelayMs(attempt, BASE_MS, MAX_MS);
+            QVERIFY2(ms >= delay - delay/2 && ms <= delay,
+                     qPrintable(QString("attempt %1: %2 ms").arg(attempt).arg(ms)));
+        }
+    }
+}
+
+/* Large attempt counts must neither overflow nor exceed the cap */
+void TestBackoff::capped()
+{
+    for(int attempt : { 9, 31, 64, 1000, INT_MAX }) {
+        int ms = backoffDelayMs(attempt, BASE_MS, MAX_MS);
+        QVERIFY(ms >= MAX_MS/2);
+        QVERIFY(ms <= MAX_MS);
+    }
+}
+
+void TestBackoff::negativeAttempt()
+{
+    int ms = backoffDelayMs(-1, BASE_MS, MAX_MS);
+    QVERIFY(ms >= BASE_MS/2);
+    QVERIFY(ms <= BASE_MS);
+}
+
+/* Clients that reconnect together should spread out */
+void TestBackoff::jittered()
+{
+    QSet<int> delays;
+    for(int i = 0; i < 100; ++i)
+        delays.insert(backoffDelayMs(10, BASE_MS, MAX_MS));
+    QVERIFY(delays.size() > 10);
+}
+
+QTEST_MAIN(TestBackoff)
+#include "tst_backoff.moc"
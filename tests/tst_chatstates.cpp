@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QSignalSpy>
+#include <QtTest>
+#include <TelepathyQt/Constants>
+#include "chatstates.h"
+
+class TestChatStates : public QObject
+{
+    Q_OBJECT
+private slots:
+    void coalescesRemote();
+    void expiresRemote();
+    void limitsLocal();
+    void manyConversations();
+};
+
+static const QString JID = "491701234567@s.whatsapp.net";
+
+/* Changes within REMOTE_MIN_INTERVAL_MS collapse into the last one */
+void TestChatStates::coalescesRemote()
+{
+    ChatStates states;
+    QSignalSpy changed(&states, SIGNAL(remoteStateChanged(QString,uint)));
+    states.remoteTyping(JID);
+    states.remotePaused(JID);
+    states.remoteTyping(JID);
+    states.remotePaused(JID);
+    QCOMPARE(changed.count(), 1);
+    QCOMPARE(changed[0][1].toUInt(), uint(Tp::ChannelChatStateComposing));
+
+    QTRY_COMPARE(changed.count(), 2);
+    QCOMPARE(changed[1][1].toUInt(), uint(Tp::ChannelChatStatePaused));
+    QTest::qWait(1000);
+    QCOMPARE(changed.count(), 2);
+}
+
+/* A message ends typing, and the conversation is forgotten */
+void TestChatStates::expiresRemote()
+{
+    ChatStates states;
+    QSignalSpy changed(&states, SIGNAL(remoteStateChanged(QString,uint)));
+    /* Paused without composing first does not start a conversation */
+    states.remotePaused(JID);
+    QCOMPARE(states.conversationCount(), 0);
+
+    states.remoteTyping(JID);
+    states.remoteMessage(JID);
+    QTRY_COMPARE(changed.count(), 2);
+    QCOMPARE(changed[1][1].toUInt(), uint(Tp::ChannelChatStateActive));
+    QTRY_COMPARE(states.conversationCount(), 0);
+}
+
+/* typing_send once while composing, typing_paused only after a real pause */
+void TestChatStates::limitsLocal()
+{
+    ChatStates states;
+    QSignalSpy typing(&states, SIGNAL(sendTyping(QString)));
+    QSignalSpy paused(&states, SIGNAL(sendPaused(QString)));
+    for(int i = 0; i < 10; ++i) {
+        states.setLocalState(JID, Tp::ChannelChatStateComposing);
+        states.setLocalState(JID, Tp::ChannelChatStatePaused);
+    }
+    states.setLocalState(JID, Tp::ChannelChatStateComposing);
+    QCOMPARE(typing.count(), 1);
+    QTest::qWait(1500);
+    QCOMPARE(paused.count(), 0);
+
+    states.setLocalState(JID, Tp::ChannelChatStateActive);
+    QTRY_COMPARE(paused.count(), 1);
+    QCOMPARE(typing.count(), 1);
+    QCOMPARE(states.conversationCount(), 0);
+}
+
+/* A busy account: thousands of conversations typing in both directions at once */
+void TestChatStates::manyConversations()
+{
+    static const int COUNT = 5000;
+    QStringList jids;
+    for(int i = 0; i < COUNT; ++i)
+        jids << QString::number(491700000000LL + i) + "@s.whatsapp.net";
+
+    ChatStates states;
+    QSignalSpy changed(&states, SIGNAL(remoteStateChanged(QString,uint)));
+    QBENCHMARK {
+        for(const QString& jid : jids) {
+            states.remoteTyping(jid);
+            states.setLocalState(jid, Tp::ChannelChatStateComposing);
+            states.remotePaused(jid);
+            states.setLocalState(jid, Tp::ChannelChatStatePaused);
+            states.remoteTyping(jid);
+        }
+    }
+    QCOMPARE(states.conversationCount(), COUNT);
+    /* One signal per conversation, the rest is held back */
+    QCOMPARE(changed.count(), COUNT);
+}
+
+QTEST_MAIN(TestChatStates)
+#include "tst_chatstates.moc"
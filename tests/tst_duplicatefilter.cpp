@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QtTest>
+#include "duplicatefilter.h"
+
+class TestDuplicateFilter : public QObject
+{
+    Q_OBJECT
+private slots:
+    void detectsDuplicates();
+    void boundedByCapacity();
+    void evictsLeastRecentlyUsed();
+    void remembersWithinCapacity();
+    void redeliveryStorm();
+};
+
+void TestDuplicateFilter::detectsDuplicates()
+{
+    DuplicateFilter filter;
+    QVERIFY(!filter.seen("1@s.whatsapp.net", "a"));
+    QVERIFY(filter.seen("1@s.whatsapp.net", "a"));
+    /* msgIds are only unique per sender */
+    QVERIFY(!filter.seen("2@s.whatsapp.net", "a"));
+    QVERIFY(!filter.seen("1@s.whatsapp.net", "b"));
+    QCOMPARE(filter.size(), 3);
+    QCOMPARE(filter.duplicateCount(), qint64(1));
+}
+
+void TestDuplicateFilter::boundedByCapacity()
+{
+    DuplicateFilter filter(8);
+    for(int i = 0; i < 100; ++i)
+        QVERIFY(!filter.seen("1@s.whatsapp.net", QString::number(i)));
+    QCOMPARE(filter.size(), 8);
+    QCOMPARE(filter.duplicateCount(), qint64(0));
+}
+
+void TestDuplicateFilter::evictsLeastRecentlyUsed()
+{
+    DuplicateFilter filter(4);
+    for(const char* msgId : { "a", "b", "c", "d" })
+        filter.seen("1@s.whatsapp.net", msgId);
+    /* Seeing a again makes b the oldest */
+    QVERIFY(filter.seen("1@s.whatsapp.net", "a"));
+    QVERIFY(!filter.seen("1@s.whatsapp.net", "e"));
+    QVERIFY(filter.seen("1@s.whatsapp.net", "a"));
+    QVERIFY(!filter.seen("1@s.whatsapp.net", "b"));
+    QCOMPARE(filter.size(), 4);
+}
+
+/* Everything within the capacity is remembered, however many messages went by */
+void TestDuplicateFilter::remembersWithinCapacity()
+{
+    const int capacity = 16;
+    DuplicateFilter filter(capacity);
+    for(int i = 0; i < 1000; ++i)
+        QVERIFY(!filter.seen("1@s.whatsapp.net", QString::number(i)));
+    for(int i = 1000 - capacity; i < 1000; ++i)
+        QVERIFY(filter.seen("1@s.whatsapp.net", QString::number(i)));
+    QVERIFY(!filter.seen("1@s.whatsapp.net", QString::number(1000 - capacity - 1)));
+    QCOMPARE(filter.duplicateCount(), qint64(capacity));
+}
+
+/* After a reconnect the server sends everything that was not acked again: a full
+ * filter's worth of duplicates from many senders, interleaved with new messages */
+void TestDuplicateFilter::redeliveryStorm()
+{
+    const int capacity = 4096;
+    QStringList senders;
+    for(int i = 0; i < 100; ++i)
+        senders << QString::number(491700000000LL + i) + "@s.whatsapp.net";
+    QStringList msgIds;
+    for(int i = 0; i < capacity; ++i)
+        msgIds << QString::number(1400000000 + i) + "-" + QString::number(i);
+
+    DuplicateFilter filter(capacity);
+    for(int i = 0; i < capacity; ++i)
+        filter.seen(senders[i % senders.size()], msgIds[i]);
+
+    int fresh = 0;
+    QBENCHMARK {
+        for(int i = 0; i < capacity; ++i) {
+            filter.seen(senders[i % senders.size()], msgIds[i]);
+            if(i % 8 == 0)
+                filter.seen(senders[i % senders.size()], QString::number(++fresh));
+        }
+    }
+    QCOMPARE(filter.size(), capacity);
+}
+
+QTEST_MAIN(TestDuplicateFilter)
+#include "tst_duplicatefilter.moc"
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <algorithm>
+#include <QtTest>
+#include "handletable.h"
+
+class TestHandleTable : public QObject
+{
+    Q_OBJECT
+private slots:
+    void lookups();
+    void use();
+    void remove();
+    void bytesPerContact();
+    void lookupSpeed_data();
+    void lookupSpeed();
+    void importContacts();
+    void flatUnderChurn();
+};
+
+/* Not static constants, Jid::parse needs the suffixes of jid.cpp initialized */
+static Jid alice() { return Jid::parse("491701234567@s.whatsapp.net"); }
+static Jid bob() { return Jid::parse("441234567890@s.whatsapp.net"); }
+
+void TestHandleTable::lookups()
+{
+    HandleTable table;
+    table.insert(1, alice(), 0);
+    table.insert(2, bob(), 0);
+    QCOMPARE(table.size(), 2);
+    QCOMPARE(table.handle(alice()), 1u);
+    QCOMPARE(table.handle(bob()), 2u);
+    QCOMPARE(table.handle(Jid::parse("12345678@s.whatsapp.net")), 0u);
+    QVERIFY(table.jid(1) == alice());
+    QVERIFY(!table.jid(3).isValid());
+    QVERIFY(table.contains(2));
+    QVERIFY(!table.contains(3));
+}
+
+/* Lookups through use() record the generation, plain lookups do not */
+void TestHandleTable::use()
+{
+    HandleTable table;
+    table.insert(1, alice(), 3);
+    table.insert(2, bob(), 3);
+    QCOMPARE(table.lastUsed(1), 3u);
+
+    QCOMPARE(table.use(alice(), 5), 1u);
+    QCOMPARE(table.lastUsed(1), 5u);
+    QVERIFY(table.use(2, 7) == bob());
+    QCOMPARE(table.lastUsed(2), 7u);
+
+    table.handle(alice());
+    table.jid(2);
+    QCOMPARE(table.lastUsed(1), 5u);
+    QCOMPARE(table.lastUsed(2), 7u);
+
+    /* Unknown ids are not inserted */
+    QCOMPARE(table.use(Jid::parse("12345678@s.whatsapp.net"), 9), 0u);
+    QVERIFY(!table.use(3, 9).isValid());
+    QCOMPARE(table.size(), 2);
+}
+
+void TestHandleTable::remove()
+{
+    HandleTable table;
+    table.insert(1, alice(), 0);
+    table.insert(2, bob(), 0);
+    table.remove(1);
+    table.remove(3);
+    QCOMPARE(table.size(), 1);
+    QCOMPARE(table.handle(alice()), 0u);
+    QVERIFY(!table.contains(1));
+    QCOMPARE(table.handles(), QList<uint>() << 2);
+}
+
+static QStringList contactIds(int count)
+{
+    QStringList ids;
+    for(int i = 0; i < count; ++i)
+        ids << QString::number(491700000000LL + i*7919) + "@s.whatsapp.net";
+    return ids;
+}
+
+/* Key size of a packed id and of the string id the table was keyed by before */
+void TestHandleTable::bytesPerContact()
+{
+    QString id = contactIds(1).first();
+    int packed = sizeof(Jid);
+    int string = sizeof(QString) + sizeof(QArrayData) + (id.size() + 1) * sizeof(QChar);
+    qDebug() << "key bytes per contact: packed" << packed << ", string" << string;
+    QVERIFY(packed < string);
+}
+
+/* Looking up ids as they come from D-Bus, packed versus in a string keyed hash */
+void TestHandleTable::lookupSpeed_data()
+{
+    QTest::addColumn<bool>("packed");
+    QTest::newRow("packed") << true;
+    QTest::newRow("string") << false;
+}
+
+void TestHandleTable::lookupSpeed()
+{
+    QFETCH(bool, packed);
+    const QStringList ids = contactIds(10000);
+    HandleTable table;
+    QHash<QString,uint> strings;
+    for(int i = 0; i < ids.size(); ++i) {
+        table.insert(i+1, Jid::parse(ids[i]), 0);
+        strings.insert(ids[i], i+1);
+    }
+
+    uint sum = 0;
+    QBENCHMARK {
+        sum = 0;
+        if(packed) {
+            for(const QString& id : ids)
+                sum += table.handle(Jid::parse(id));
+        } else {
+            for(const QString& id : ids)
+                sum += strings.value(id);
+        }
+    }
+    QCOMPARE(sum, uint(ids.size()) * (ids.size()+1) / 2);
+}
+
+/* The table side of a 10k contact import, as YSConnection::ensureContacts() does it:
+ * look every id up, then allocate handles for the unknown ones */
+void TestHandleTable::importContacts()
+{
+    const QStringList ids = contactIds(10000);
+    QBENCHMARK {
+        HandleTable table;
+        uint lastHandle = 0;
+        for(const QString& id : ids) {
+            Jid jid = Jid::parse(id);
+            if(!table.use(jid, 0))
+                table.insert(++lastHandle, jid, 0);
+        }
+        QCOMPARE(table.size(), ids.size());
+    }
+}
+
+/* Soak: every sweep brings new one-off senders while the same roster stays in use.
+ * With the reclamation policy of YSConnection::reclaimHandles() the table levels off */
+void TestHandleTable::flatUnderChurn()
+{
+    const int roster = 100;
+    const int perSweep = 500;
+    const uint grace = 3;
+    HandleTable table;
+    uint lastHandle = 0;
+    uint generation = 0;
+    quint64 sender = 441000000000LL;
+    for(int i = 0; i < roster; ++i)
+        table.insert(++lastHandle, Jid::parse(QString::number(491700000000LL + i) + "@s.whatsapp.net"), 0);
+
+    int largest = 0;
+    for(int sweep = 0; sweep < 200; ++sweep) {
+        for(int i = 0; i < perSweep; ++i)
+            table.insert(++lastHandle, Jid::parse(QString::number(++sender) + "@s.whatsapp.net"), generation);
+        for(uint handle = 1; handle <= uint(roster); ++handle)
+            table.use(handle, generation);
+
+        ++generation;
+        for(uint handle : table.handles())
+            if(generation - table.lastUsed(handle) > grace)
+                table.remove(handle);
+        largest = std::max(largest, table.size());
+    }
+    QCOMPARE(table.size(), roster + perSweep * int(grace));
+    QCOMPARE(largest, table.size());
+    /* Handles are never reused */
+    QCOMPARE(table.handle(Jid::parse(QString::number(sender) + "@s.whatsapp.net")), lastHandle);
+}
+
+QTEST_MAIN(TestHandleTable)
+#include "tst_handletable.moc"
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QtTest>
+#include "jid.h"
+
+Q_DECLARE_METATYPE(Jid::Type)
+
+class TestJid : public QObject
+{
+    Q_OBJECT
+private slots:
+    void parse_data();
+    void parse();
+    void equalityAndHash();
+};
+
+void TestJid::parse_data()
+{
+    QTest::addColumn<QString>("id");
+    QTest::addColumn<Jid::Type>("type");
+
+    QTest::newRow("contact") << "491701234567@s.whatsapp.net" << Jid::Contact;
+    QTest::newRow("group") << "491701234567-1400000000@g.us" << Jid::Group;
+    QTest::newRow("empty") << "" << Jid::Invalid;
+    QTest::newRow("no suffix") << "491701234567" << Jid::Invalid;
+    QTest::newRow("no number") << "@s.whatsapp.net" << Jid::Invalid;
+    QTest::newRow("leading zero") << "0491701234567@s.whatsapp.net" << Jid::Invalid;
+    QTest::newRow("letters") << "49170abc@s.whatsapp.net" << Jid::Invalid;
+    QTest::newRow("too long") << "12345678901234567890@s.whatsapp.net" << Jid::Invalid;
+    QTest::newRow("group without creation time") << "491701234567@g.us" << Jid::Invalid;
+    QTest::newRow("group without creator") << "-1400000000@g.us" << Jid::Invalid;
+    QTest::newRow("creation time overflows") << "491701234567-4294967296@g.us" << Jid::Invalid;
+    QTest::newRow("contact with dash") << "49170-1234567@s.whatsapp.net" << Jid::Invalid;
+}
+
+/* Valid ids give back the same string, so packing loses nothing */
+void TestJid::parse()
+{
+    QFETCH(QString, id);
+    QFETCH(Jid::Type, type);
+    Jid jid = Jid::parse(id);
+    QCOMPARE(jid.type(), type);
+    QCOMPARE(jid.isValid(), type != Jid::Invalid);
+    QCOMPARE(jid.toString(), type == Jid::Invalid ? QString() : id);
+}
+
+void TestJid::equalityAndHash()
+{
+    Jid contact = Jid::parse("491701234567@s.whatsapp.net");
+    QCOMPARE(contact.user(), Q_UINT64_C(491701234567));
+    QCOMPARE(contact.created(), 0u);
+    Jid group = Jid::parse("491701234567-1400000000@g.us");
+    QCOMPARE(group.user(), contact.user());
+    QCOMPARE(group.created(), 1400000000u);
+
+    QVERIFY(contact != group);
+    QVERIFY(contact == Jid::parse("491701234567@s.whatsapp.net"));
+    QVERIFY(Jid() == Jid::parse("invalid"));
+
+    QHash<Jid,int> hash;
+    hash[contact] = 1;
+    hash[group] = 2;
+    QCOMPARE(hash.value(Jid::parse("491701234567@s.whatsapp.net")), 1);
+    QCOMPARE(hash.value(Jid::parse("491701234567-1400000000@g.us")), 2);
+}
+
+QTEST_MAIN(TestJid)
+#include "tst_jid.moc"
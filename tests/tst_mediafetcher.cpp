@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QSignalSpy>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+#include <QTimer>
+#include <QtTest>
+#include "mediafetcher.h"
+
+/*
+ * Local stand-in for the media server: serves files by path, ignoring the query,
+ * honours "Range: bytes=<offset>-" and can cut the first response short.
+ */
+class HttpStandIn : public QTcpServer
+{
+public:
+    HttpStandIn() : cutFirst(false) { listen(QHostAddress::LocalHost); }
+
+    QString url(const QString& path) const {
+        return QString("http://127.0.0.1:%1%2").arg(serverPort()).arg(path);
+    }
+
+    QHash<QString,QByteArray> files;
+    /* Send half of the first response, then close the connection */
+    bool cutFirst;
+    /* Path and range offset of every request */
+    QList<QPair<QString,qint64> > requests;
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) {
+        QTcpSocket* socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+        QObject::connect(socket, &QTcpSocket::readyRead, [this, socket] () { serve(socket); });
+        QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+    }
+
+private:
+    void serve(QTcpSocket* socket) {
+        QByteArray request = socket->property("request").toByteArray() + socket->readAll();
+        socket->setProperty("request", request);
+        if(!request.contains("\r\n\r\n"))
+            return;
+
+        QList<QByteArray> lines = request.split('\n');
+        QString path = QString::fromLatin1(lines.first().split(' ').value(1)).section('?', 0, 0);
+        qint64 offset = 0;
+        for(const QByteArray& line : lines)
+            if(line.toLower().startsWith("range: bytes="))
+                offset = line.mid(13).split('-').first().toLongLong();
+        requests << qMakePair(path, offset);
+
+        if(!files.contains(path)) {
+            socket->write("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            socket->disconnectFromHost();
+            return;
+        }
+        QByteArray body = files.value(path);
+        QByteArray header;
+        if(offset > 0) {
+            header = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + QByteArray::number(offset) + "-"
+                     + QByteArray::number(body.size()-1) + "/" + QByteArray::number(body.size()) + "\r\n";
+            body = body.mid(offset);
+        } else {
+            header = "HTTP/1.1 200 OK\r\n";
+        }
+        header += "Content-Length: " + QByteArray::number(body.size()) + "\r\nConnection: close\r\n\r\n";
+        socket->write(header);
+        if(cutFirst && requests.size() == 1) {
+            socket->write(body.left(body.size()/2));
+            /* Let the client see the data before the connection drops, deleting aborts it */
+            QTimer::singleShot(200, socket, SLOT(deleteLater()));
+            return;
+        }
+        socket->write(body);
+        socket->disconnectFromHost();
+    }
+};
+
+class TestMediaFetcher : public QObject
+{
+    Q_OBJECT
+private slots:
+    void fetchesAndCaches();
+    void mergesRequests();
+    void resumesCutDownload();
+    void givesUpOnOversize();
+    void refusesOtherSchemes();
+    void storesContentOnce();
+    void throughput();
+};
+
+static QByteArray content(int size)
+{
+    QByteArray data(size, 0);
+    for(int i = 0; i < size; ++i)
+        data[i] = char(i * 7 + i / 251);
+    return data;
+}
+
+static QByteArray readFile(const QString& filename)
+{
+    QFile file(filename);
+    file.open(QIODevice::ReadOnly);
+    return file.readAll();
+}
+
+void TestMediaFetcher::fetchesAndCaches()
+{
+    HttpStandIn server;
+    server.files["/a.jpg"] = content(100000);
+    QTemporaryDir dir;
+    MediaFetcher fetcher(dir.path() + "/media", dir.path() + "/test.index");
+    QSignalSpy fetched(&fetcher, SIGNAL(fetched(QString,QString)));
+
+    fetcher.fetch(server.url("/a.jpg"), 100000);
+    QVERIFY(fetched.wait(5000));
+    QString filename = fetched[0][1].toString();
+    QVERIFY(filename.endsWith(".jpg"));
+    QCOMPARE(readFile(filename), server.files["/a.jpg"]);
+
+    /* From the cache, also for a new fetcher reading the index */
+    fetcher.fetch(server.url("/a.jpg"), 100000);
+    QCOMPARE(fetched.count(), 2);
+    QCOMPARE(fetched[1][1].toString(), filename);
+    MediaFetcher again(dir.path() + "/media", dir.path() + "/test.index");
+    QSignalSpy fetchedAgain(&again, SIGNAL(fetched(QString,QString)));
+    again.fetch(server.url("/a.jpg"), 100000);
+    QCOMPARE(fetchedAgain.count(), 1);
+    QCOMPARE(server.requests.size(), 1);
+    QVERIFY(fetcher.summary().startsWith("hits 1, misses 1"));
+}
+
+void TestMediaFetcher::mergesRequests()
+{
+    HttpStandIn server;
+    server.files["/a.jpg"] = content(1000);
+    QTemporaryDir dir;
+    MediaFetcher fetcher(dir.path() + "/media", dir.path() + "/test.index");
+    QSignalSpy fetched(&fetcher, SIGNAL(fetched(QString,QString)));
+
+    fetcher.fetch(server.url("/a.jpg"), 1000);
+    fetcher.fetch(server.url("/a.jpg"), 1000);
+    QVERIFY(fetched.wait(5000));
+    QTest::qWait(100);
+    QCOMPARE(fetched.count(), 1);
+    QCOMPARE(server.requests.size(), 1);
+}
+
+/* The second attempt asks for the rest only */
+void TestMediaFetcher::resumesCutDownload()
+{
+    HttpStandIn server;
+    server.cutFirst = true;
+    server.files["/v.mp4"] = content(256*1024);
+    QTemporaryDir dir;
+    MediaFetcher fetcher(dir.path() + "/media", dir.path() + "/test.index");
+    QSignalSpy fetched(&fetcher, SIGNAL(fetched(QString,QString)));
+
+    fetcher.fetch(server.url("/v.mp4"), 256*1024);
+    QVERIFY(fetched.wait(5000));
+    QCOMPARE(readFile(fetched[0][1].toString()), server.files["/v.mp4"]);
+    QCOMPARE(server.requests.size(), 2);
+    QVERIFY(server.requests[1].second > 0);
+    QVERIFY(server.requests[1].second <= 128*1024);
+}
+
+/* The sender announced less than the server sends */
+void TestMediaFetcher::givesUpOnOversize()
+{
+    HttpStandIn server;
+    server.files["/a.jpg"] = content(100000);
+    QTemporaryDir dir;
+    MediaFetcher fetcher(dir.path() + "/media", dir.path() + "/test.index");
+    QSignalSpy failed(&fetcher, SIGNAL(failed(QString)));
+
+    fetcher.fetch(server.url("/a.jpg"), 50000);
+    QVERIFY(failed.wait(5000));
+    QCOMPARE(server.requests.size(), 1);
+    QCOMPARE(QDir(dir.path() + "/media/partial").entryList(QDir::Files).size(), 0);
+}
+
+void TestMediaFetcher::refusesOtherSchemes()
+{
+    QTemporaryDir dir;
+    MediaFetcher fetcher(dir.path() + "/media", dir.path() + "/test.index");
+    QSignalSpy failed(&fetcher, SIGNAL(failed(QString)));
+    fetcher.fetch("file:///etc/passwd", 1000);
+    QCOMPARE(failed.count(), 1);
+}
+
+/* Media forwarded between chats has different URLs, but the same content */
+void TestMediaFetcher::storesContentOnce()
+{
+    HttpStandIn server;
+    server.files["/a.jpg"] = content(1000);
+    server.files["/b.jpg"] = content(1000);
+    QTemporaryDir dir;
+    MediaFetcher fetcher(dir.path() + "/media", dir.path() + "/test.index");
+    QSignalSpy fetched(&fetcher, SIGNAL(fetched(QString,QString)));
+
+    fetcher.fetch(server.url("/a.jpg"), 1000);
+    fetcher.fetch(server.url("/b.jpg"), 1000);
+    QTRY_COMPARE(fetched.count(), 2);
+    QCOMPARE(fetched[0][1].toString(), fetched[1][1].toString());
+    QCOMPARE(QDir(dir.path() + "/media").entryList(QDir::Files).size(), 1);
+}
+
+/* Eight 1 MiB downloads, then the same eight from the cache */
+void TestMediaFetcher::throughput()
+{
+    static const int FILES = 8;
+    static const int SIZE = 1024*1024;
+    HttpStandIn server;
+    server.files["/big.bin"] = content(SIZE);
+    QTemporaryDir dir;
+    QString summary;
+    int round = 0;
+
+    QBENCHMARK {
+        MediaFetcher fetcher(dir.path() + "/media", dir.path() + "/bench.index");
+        QSignalSpy fetched(&fetcher, SIGNAL(fetched(QString,QString)));
+        ++round;
+        QStringList urls;
+        for(int i = 0; i < FILES; ++i)
+            urls << server.url(QString("/big.bin?round=%1&file=%2").arg(round).arg(i));
+        for(const QString& url : urls)
+            fetcher.fetch(url, SIZE);
+        while(fetched.count() < FILES)
+            QVERIFY(fetched.wait(10000));
+        for(const QString& url : urls)
+            fetcher.fetch(url, SIZE);
+        QCOMPARE(fetched.count(), 2*FILES);
+        summary = fetcher.summary();
+    }
+    qDebug() << "MediaFetcher:" << summary;
+}
+
+QTEST_MAIN(TestMediaFetcher)
+#include "tst_mediafetcher.moc"
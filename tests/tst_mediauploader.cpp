@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QCryptographicHash>
+#include <QSignalSpy>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+#include <QtTest>
+#include "mediauploader.h"
+
+/* Local stand-in for the upload server: takes a POST and answers with the url of the file */
+class UploadStandIn : public QTcpServer
+{
+public:
+    UploadStandIn() { listen(QHostAddress::LocalHost); }
+
+    QString url(const QString& path) const {
+        return QString("http://127.0.0.1:%1%2").arg(serverPort()).arg(path);
+    }
+
+    /* Bodies of all requests */
+    QList<QByteArray> bodies;
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) {
+        QTcpSocket* socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+        QObject::connect(socket, &QTcpSocket::readyRead, [this, socket] () { serve(socket); });
+        QObject::connect(socket, &QTcpSocket::disconnected, [this, socket] () {
+            mRequests.remove(socket);
+            socket->deleteLater();
+        });
+    }
+
+private:
+    void serve(QTcpSocket* socket) {
+        QByteArray& request = mRequests[socket];
+        request += socket->readAll();
+        int end = request.indexOf("\r\n\r\n");
+        if(end < 0)
+            return;
+        qint64 length = 0;
+        for(const QByteArray& line : request.left(end).split('\n'))
+            if(line.toLower().startsWith("content-length:"))
+                length = line.mid(15).trimmed().toLongLong();
+        QByteArray body = request.mid(end + 4);
+        if(body.size() < length)
+            return;
+        bodies << body;
+
+        QByteArray name = "f" + QByteArray::number(bodies.size());
+        QByteArray json = "{\"url\":\"https://mms.example.com/" + name + "\",\"name\":\"" + name + "\"}";
+        socket->write("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: "
+                      + QByteArray::number(json.size()) + "\r\nConnection: close\r\n\r\n" + json);
+        socket->disconnectFromHost();
+    }
+
+    /* Received so far, by connection */
+    QHash<QTcpSocket*,QByteArray> mRequests;
+};
+
+class TestMediaUploader : public QObject
+{
+    Q_OBJECT
+private slots:
+    void uploadsFile();
+    void waitsUntilOnline();
+    void usesDuplicate();
+    void reportsRefusal();
+    void rejectsUnusable();
+    void throughput();
+};
+
+static const QString JID = "491701234567@s.whatsapp.net";
+
+static QByteArray content(int size)
+{
+    QByteArray data(size, 0);
+    for(int i = 0; i < size; ++i)
+        data[i] = char(i * 13 + i / 509);
+    return data;
+}
+
+/* Collects uploaded(), which QSignalSpy cannot record without a registered Media type */
+struct Uploaded
+{
+    Uploaded(MediaUploader* uploader) {
+        QObject::connect(uploader, &MediaUploader::uploaded,
+                         [this] (const QString& token, const QString&, const OutgoingQueue::Media& uploaded) {
+            tokens << token;
+            media << uploaded;
+        });
+    }
+    QStringList tokens;
+    QList<OutgoingQueue::Media> media;
+};
+
+void TestMediaUploader::uploadsFile()
+{
+    UploadStandIn server;
+    QTemporaryDir dir;
+    QByteArray bytes = content(3*1024*1024);
+    QFile file(dir.path() + "/photo.jpg");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write(bytes);
+    file.close();
+
+    MediaUploader uploader("491709999999");
+    QSignalSpy requested(&uploader, SIGNAL(requestUpload(QString,QString,qint64)));
+    QSignalSpy progress(&uploader, SIGNAL(progress(QString,QString,int)));
+    Uploaded uploaded(&uploader);
+    uploader.setOnline(true);
+    QVERIFY(uploader.uploadFile("t1", JID, "image", file.fileName(), "preview"));
+    QCOMPARE(uploader.jids(), QSet<QString>() << JID);
+
+    QVERIFY(requested.wait(5000));
+    QString hash = requested[0][0].toString();
+    QCOMPARE(hash, QString(QCryptographicHash::hash(bytes, QCryptographicHash::Sha256).toBase64()));
+    QCOMPARE(requested[0][1].toString(), QString("image"));
+    QCOMPARE(requested[0][2].toLongLong(), qint64(bytes.size()));
+
+    uploader.requestSucceeded(hash, server.url("/upload"));
+    QTRY_COMPARE(uploaded.tokens.size(), 1);
+    QCOMPARE(uploaded.media[0].url, QString("https://mms.example.com/f1"));
+    QCOMPARE(uploaded.media[0].size, qint64(bytes.size()));
+    QCOMPARE(uploaded.media[0].preview, QString("preview"));
+
+    QCOMPARE(server.bodies.size(), 1);
+    QVERIFY(server.bodies[0].contains(bytes));
+    QVERIFY(server.bodies[0].contains(QCryptographicHash::hash(bytes, QCryptographicHash::Md5).toHex()));
+    int last = 0;
+    for(const QList<QVariant>& step : progress) {
+        QVERIFY(step[2].toInt() > last && step[2].toInt() < 100);
+        last = step[2].toInt();
+    }
+    QVERIFY(uploader.jids().isEmpty());
+}
+
+/* Upload requests go out once online, and again after a reconnect */
+void TestMediaUploader::waitsUntilOnline()
+{
+    MediaUploader uploader("491709999999");
+    QSignalSpy requested(&uploader, SIGNAL(requestUpload(QString,QString,qint64)));
+    QVERIFY(uploader.uploadData("t1", JID, "audio", "audio/ogg", content(1000), ""));
+    QTest::qWait(200);
+    QCOMPARE(requested.count(), 0);
+
+    uploader.setOnline(true);
+    QCOMPARE(requested.count(), 1);
+    uploader.setOnline(false);
+    uploader.setOnline(true);
+    QCOMPARE(requested.count(), 2);
+}
+
+/* The server has the file already, nothing is uploaded */
+void TestMediaUploader::usesDuplicate()
+{
+    UploadStandIn server;
+    MediaUploader uploader("491709999999");
+    QSignalSpy requested(&uploader, SIGNAL(requestUpload(QString,QString,qint64)));
+    Uploaded uploaded(&uploader);
+    uploader.setOnline(true);
+    uploader.uploadData("t1", JID, "image", "image/png", content(1000), "");
+    uploader.uploadData("t2", JID, "image", "image/png", content(1000), "");
+    QTRY_COMPARE(requested.count(), 2);
+
+    uploader.requestDuplicate(requested[0][0].toString(), "https://mms.example.com/known.png");
+    QCOMPARE(uploaded.tokens.toSet(), QSet<QString>() << "t1" << "t2");
+    QCOMPARE(uploaded.media[0].name, QString("known.png"));
+    QCOMPARE(uploaded.media[1].url, QString("https://mms.example.com/known.png"));
+    QVERIFY(server.bodies.isEmpty());
+}
+
+void TestMediaUploader::reportsRefusal()
+{
+    MediaUploader uploader("491709999999");
+    QSignalSpy requested(&uploader, SIGNAL(requestUpload(QString,QString,qint64)));
+    QSignalSpy failed(&uploader, SIGNAL(failed(QString,QString,QString)));
+    uploader.setOnline(true);
+    uploader.uploadData("t1", JID, "video", "video/mp4", content(1000), "");
+    QVERIFY(requested.wait(5000));
+
+    uploader.requestFailed(requested[0][0].toString());
+    QCOMPARE(failed.count(), 1);
+    QCOMPARE(failed[0][0].toString(), QString("t1"));
+    QCOMPARE(failed[0][1].toString(), JID);
+}
+
+void TestMediaUploader::rejectsUnusable()
+{
+    QTemporaryDir dir;
+    MediaUploader uploader("491709999999");
+    QVERIFY(!uploader.uploadData("t1", JID, "image", "image/png", QByteArray(), ""));
+    QVERIFY(!uploader.uploadData("t2", JID, "image", "image/png", QByteArray(16*1024*1024 + 1, 'x'), ""));
+    QVERIFY(!uploader.uploadFile("t3", JID, "image", dir.path() + "/missing.jpg", ""));
+    QVERIFY(uploader.jids().isEmpty());
+}
+
+/* 8 MiB from a mapped file: digests, multipart post and the server's answer */
+void TestMediaUploader::throughput()
+{
+    static const int SIZE = 8*1024*1024;
+    UploadStandIn server;
+    QTemporaryDir dir;
+    QFile file(dir.path() + "/video.mp4");
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write(content(SIZE));
+    file.close();
+
+    MediaUploader uploader("491709999999");
+    QSignalSpy requested(&uploader, SIGNAL(requestUpload(QString,QString,qint64)));
+    Uploaded uploaded(&uploader);
+    uploader.setOnline(true);
+    int round = 0;
+    QBENCHMARK {
+        ++round;
+        uploader.uploadFile("t" + QString::number(round), JID, "video", file.fileName(), "");
+        while(requested.count() < round)
+            QVERIFY(requested.wait(10000));
+        uploader.requestSucceeded(requested.last()[0].toString(), server.url("/upload"));
+        while(uploaded.tokens.size() < round)
+            QCoreApplication::processEvents();
+        server.bodies.clear();
+    }
+    qDebug() << "MediaUploader:" << uploader.summary();
+}
+
+QTEST_MAIN(TestMediaUploader)
+#include "tst_mediauploader.moc"
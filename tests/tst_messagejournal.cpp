@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QFile>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QtTest>
+#include "messagejournal.h"
+
+using namespace Tp;
+
+static MessageJournal::Entry makeEntry(const QString& senderId, const QString& msgId, const QString& text)
+{
+    MessagePart part;
+    part["content-type"] = QDBusVariant("text/plain");
+    part["content"] = QDBusVariant(text);
+    MessageJournal::Entry entry;
+    entry.token = MessageJournal::tokenFor(senderId, msgId);
+    entry.senderId = senderId;
+    entry.targetId = senderId;
+    entry.timestamp = 1000;
+    entry.body << part;
+    return entry;
+}
+
+static QString textOf(const MessageJournal::Entry& entry)
+{
+    return entry.body.first().value("content").variant().toString();
+}
+
+class TestMessageJournal : public QObject
+{
+    Q_OBJECT
+private slots:
+    void init();
+    void tokens();
+    void replaysUnacknowledged();
+    void readsUncommittedAndCommitted();
+    void replacementKeepsPlace();
+    void truncatesWhenAllAcknowledged();
+    void cutsTornTail();
+    void commitsLargeBatchLater();
+
+private:
+    QString path() const { return mDir.path() + "/messages.journal"; }
+    QTemporaryDir mDir;
+};
+
+void TestMessageJournal::init()
+{
+    QFile::remove(path());
+}
+
+void TestMessageJournal::tokens()
+{
+    QString token = MessageJournal::tokenFor("491234@s.whatsapp.net", "1400000000-1");
+    QCOMPARE(token, QString("491234@s.whatsapp.net/1400000000-1"));
+    QCOMPARE(MessageJournal::msgIdOf(token), QString("1400000000-1"));
+}
+
+void TestMessageJournal::replaysUnacknowledged()
+{
+    {
+        MessageJournal journal(path());
+        QList<MessageJournal::Entry> replayed;
+        QVERIFY(journal.open(&replayed));
+        QVERIFY(replayed.isEmpty());
+
+        QSignalSpy committed(&journal, SIGNAL(committed()));
+        journal.append(makeEntry("1@s.whatsapp.net", "a", "first"));
+        journal.append(makeEntry("2@s.whatsapp.net", "b", "second"));
+        journal.append(makeEntry("1@s.whatsapp.net", "c", "third"));
+        QVERIFY(journal.hasUncommitted());
+        journal.commit();
+        QCOMPARE(committed.count(), 1);
+        QVERIFY(!journal.hasUncommitted());
+
+        journal.acknowledge(MessageJournal::tokenFor("2@s.whatsapp.net", "b"));
+        QCOMPARE(journal.liveCount(), 2);
+        /* Acknowledging twice or something unknown is harmless */
+        journal.acknowledge(MessageJournal::tokenFor("2@s.whatsapp.net", "b"));
+        journal.acknowledge("unknown");
+        QCOMPARE(journal.liveCount(), 2);
+    }
+
+    MessageJournal journal(path());
+    QList<MessageJournal::Entry> replayed;
+    QVERIFY(journal.open(&replayed));
+    QCOMPARE(replayed.size(), 2);
+    QCOMPARE(replayed[0].token, MessageJournal::tokenFor("1@s.whatsapp.net", "a"));
+    QCOMPARE(textOf(replayed[0]), QString("first"));
+    QCOMPARE(replayed[1].token, MessageJournal::tokenFor("1@s.whatsapp.net", "c"));
+    QCOMPARE(replayed[1].senderId, QString("1@s.whatsapp.net"));
+    QCOMPARE(replayed[1].timestamp, 1000u);
+    QCOMPARE(journal.liveCount(), 2);
+    QVERIFY(journal.contains(replayed[0].token));
+    QVERIFY(!journal.contains(MessageJournal::tokenFor("2@s.whatsapp.net", "b")));
+}
+
+void TestMessageJournal::readsUncommittedAndCommitted()
+{
+    MessageJournal journal(path());
+    QList<MessageJournal::Entry> replayed;
+    QVERIFY(journal.open(&replayed));
+
+    MessageJournal::Entry committed = makeEntry("1@s.whatsapp.net", "a", "on disk");
+    journal.append(committed);
+    journal.commit();
+    MessageJournal::Entry buffered = makeEntry("1@s.whatsapp.net", "b", "in the buffer");
+    journal.append(buffered);
+
+    MessageJournal::Entry entry;
+    QVERIFY(journal.read(committed.token, &entry));
+    QCOMPARE(textOf(entry), QString("on disk"));
+    QVERIFY(journal.read(buffered.token, &entry));
+    QCOMPARE(textOf(entry), QString("in the buffer"));
+    QVERIFY(journal.sizeOf(buffered.token) > 0);
+    QVERIFY(!journal.read("unknown", &entry));
+    QCOMPARE(journal.sizeOf("unknown"), 0);
+}
+
+void TestMessageJournal::replacementKeepsPlace()
+{
+    MessageJournal::Entry media = makeEntry("1@s.whatsapp.net", "a", "image");
+    {
+        MessageJournal journal(path());
+        QList<MessageJournal::Entry> replayed;
+        QVERIFY(journal.open(&replayed));
+        journal.append(media);
+        journal.append(makeEntry("1@s.whatsapp.net", "b", "later"));
+        journal.commit();
+
+        /* e.g. a downloaded attachment */
+        MessagePart file;
+        file["content-type"] = QDBusVariant("image/jpeg");
+        media.body << file;
+        journal.append(media);
+        journal.commit();
+        QCOMPARE(journal.liveCount(), 2);
+
+        MessageJournal::Entry entry;
+        QVERIFY(journal.read(media.token, &entry));
+        QCOMPARE(entry.body.size(), 2);
+    }
+
+    MessageJournal journal(path());
+    QList<MessageJournal::Entry> replayed;
+    QVERIFY(journal.open(&replayed));
+    QCOMPARE(replayed.size(), 2);
+    QCOMPARE(replayed[0].token, media.token);
+    QCOMPARE(replayed[0].body.size(), 2);
+    QCOMPARE(textOf(replayed[1]), QString("later"));
+}
+
+void TestMessageJournal::truncatesWhenAllAcknowledged()
+{
+    MessageJournal journal(path());
+    QList<MessageJournal::Entry> replayed;
+    QVERIFY(journal.open(&replayed));
+    MessageJournal::Entry entry = makeEntry("1@s.whatsapp.net", "a", "text");
+    journal.append(entry);
+    journal.commit();
+    QVERIFY(QFile(path()).size() > 0);
+
+    journal.acknowledge(entry.token);
+    journal.commit();
+    QCOMPARE(journal.liveCount(), 0);
+    QCOMPARE(QFile(path()).size(), qint64(0));
+}
+
+void TestMessageJournal::cutsTornTail()
+{
+    {
+        MessageJournal journal(path());
+        QList<MessageJournal::Entry> replayed;
+        QVERIFY(journal.open(&replayed));
+        journal.append(makeEntry("1@s.whatsapp.net", "a", "complete"));
+        journal.append(makeEntry("1@s.whatsapp.net", "b", "torn"));
+        journal.commit();
+    }
+    /* Crash in the middle of writing the second record */
+    QFile file(path());
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.resize(file.size() - 3));
+    file.close();
+
+    {
+        MessageJournal journal(path());
+        QList<MessageJournal::Entry> replayed;
+        QVERIFY(journal.open(&replayed));
+        QCOMPARE(replayed.size(), 1);
+        QCOMPARE(textOf(replayed[0]), QString("complete"));
+        /* Appends go after the cut */
+        journal.append(makeEntry("1@s.whatsapp.net", "c", "after"));
+        journal.commit();
+    }
+
+    MessageJournal journal(path());
+    QList<MessageJournal::Entry> replayed;
+    QVERIFY(journal.open(&replayed));
+    QCOMPARE(replayed.size(), 2);
+    QCOMPARE(textOf(replayed[1]), QString("after"));
+}
+
+/* Crossing COMMIT_MAX_BYTES commits soon, but never from inside append() */
+void TestMessageJournal::commitsLargeBatchLater()
+{
+    const QString text(16*1024, QLatin1Char('x'));
+    {
+        MessageJournal journal(path());
+        QList<MessageJournal::Entry> replayed;
+        QVERIFY(journal.open(&replayed));
+        QSignalSpy committed(&journal, SIGNAL(committed()));
+        /* UTF-16 on disk, so 32 KiB per entry and 320 KiB in total */
+        for(int i = 0; i < 10; ++i) {
+            journal.append(makeEntry("1@s.whatsapp.net", QString::number(i), text));
+            QCOMPARE(committed.count(), 0);
+        }
+        QVERIFY(journal.hasUncommitted());
+        QVERIFY(committed.wait(1000));
+        QCOMPARE(committed.count(), 1);
+        QVERIFY(!journal.hasUncommitted());
+        QVERIFY(QFile(path()).size() > 256*1024);
+    }
+
+    MessageJournal journal(path());
+    QList<MessageJournal::Entry> replayed;
+    QVERIFY(journal.open(&replayed));
+    QCOMPARE(replayed.size(), 10);
+    QCOMPARE(textOf(replayed[9]), text);
+}
+
+QTEST_MAIN(TestMessageJournal)
+#include "tst_messagejournal.moc"
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QSignalSpy>
+#include <QtTest>
+#include "messagesender.h"
+#include "outgoingqueue.h"
+
+/* Records what the queue sends and hands out msgIds "m1", "m2", ... */
+class FakeSender : public MessageSender
+{
+public:
+    FakeSender() : lastId(0) {}
+
+    QStringList sendMessages(const QList<QPair<QString,QByteArray> >& messages) {
+        QStringList msgIds;
+        for(const auto& message : messages)
+            msgIds << send(message.first, QString::fromUtf8(message.second));
+        batches << messages.size();
+        return msgIds;
+    }
+    QString sendMedia(const QString& jid, const QString& type, const QString& url, const QString& name,
+                      qint64 size, const QString& preview) {
+        batches << 1;
+        return send(jid, type + ":" + url);
+    }
+
+    /* Contents in the order they were sent */
+    QStringList sent;
+    QList<int> batches;
+    /* Contents that are refused */
+    QStringList refused;
+
+private:
+    QString send(const QString& jid, const QString& content) {
+        sent << content;
+        if(refused.contains(content))
+            return QString();
+        return "m" + QString::number(++lastId);
+    }
+    int lastId;
+};
+
+class TestOutgoingQueue : public QObject
+{
+    Q_OBJECT
+private slots:
+    void sendsInOrder();
+    void waitsUntilOnline();
+    void batches();
+    void mediaGoesAlone();
+    void retransmitsUnaccepted();
+    void reportsRefused();
+    void tracksRecipients();
+    void keepsTokensUntilDelivered();
+    void pausesWhileUnaccepted();
+    void failsAll();
+    void burst();
+};
+
+static const QString JID = "491701234567@s.whatsapp.net";
+
+void TestOutgoingQueue::sendsInOrder()
+{
+    FakeSender sender;
+    OutgoingQueue queue(&sender);
+    QSignalSpy dispatched(&queue, SIGNAL(messageDispatched(QString,QString)));
+    queue.setOnline(true);
+    QString a = queue.enqueue(JID, "a");
+    QString b = queue.enqueue(JID, "b");
+    QString c = queue.enqueue(JID, "c");
+    QVERIFY(a != b && b != c);
+
+    QTRY_COMPARE(sender.sent, QStringList() << "a" << "b" << "c");
+    QCOMPARE(dispatched.count(), 3);
+    QCOMPARE(dispatched[0][0].toString(), a);
+    QCOMPARE(dispatched[0][1].toString(), QString("m1"));
+    QCOMPARE(queue.tokenFor("m2"), b);
+    QCOMPARE(queue.tokenFor("unknown"), QString("unknown"));
+    QCOMPARE(queue.pendingCount(), 3);
+
+    queue.messageAccepted("m1");
+    /* Delivery implies acceptance */
+    queue.messageDelivered("m2");
+    QCOMPARE(queue.pendingCount(), 1);
+}
+
+void TestOutgoingQueue::waitsUntilOnline()
+{
+    FakeSender sender;
+    OutgoingQueue queue(&sender);
+    queue.enqueue(JID, "a");
+    QTest::qWait(50);
+    QVERIFY(sender.sent.isEmpty());
+    QCOMPARE(queue.pendingCount(), 1);
+
+    queue.setOnline(true);
+    QTRY_COMPARE(sender.sent, QStringList() << "a");
+}
+
+/* One sendMessages() call per BATCH_SIZE messages */
+void TestOutgoingQueue::batches()
+{
+    FakeSender sender;
+    OutgoingQueue queue(&sender);
+    for(int i = 0; i < 40; ++i)
+        queue.enqueue(JID, QByteArray::number(i));
+    queue.setOnline(true);
+
+    QTRY_COMPARE(sender.sent.size(), 40);
+    QCOMPARE(sender.batches, QList<int>() << 32 << 8);
+    for(int i = 0; i < 40; ++i)
+        QCOMPARE(sender.sent[i], QString::number(i));
+}
+
+/* Media messages are sent on their own, in the order they were enqueued */
+void TestOutgoingQueue::mediaGoesAlone()
+{
+    FakeSender sender;
+    OutgoingQueue queue(&sender);
+    queue.enqueue(JID, "before");
+    OutgoingQueue::Media media;
+    media.type = "image";
+    media.url = "https://example.com/a.jpg";
+    media.size = 1024;
+    queue.enqueueMedia(queue.reserveToken(), JID, media);
+    queue.enqueue(JID, "after");
+    queue.setOnline(true);
+
+    QTRY_COMPARE(sender.sent.size(), 3);
+    QCOMPARE(sender.sent, QStringList() << "before" << "image:https://example.com/a.jpg" << "after");
+    QCOMPARE(sender.batches, QList<int>() << 1 << 1 << 1);
+}
+
+/* Messages the server did not accept before a disconnect are sent again first */
+void TestOutgoingQueue::retransmitsUnaccepted()
+{
+    FakeSender sender;
+    OutgoingQueue queue(&sender);
+    queue.setOnline(true);
+    QString a = queue.enqueue(JID, "a");
+    queue.enqueue(JID, "b");
+    QString c = queue.enqueue(JID, "c");
+    QTRY_COMPARE(sender.sent.size(), 3);
+    queue.messageAccepted("m2");
+
+    queue.setOnline(false);
+    queue.enqueue(JID, "d");
+    QTest::qWait(50);
+    QCOMPARE(sender.sent.size(), 3);
+
+    sender.sent.clear();
+    queue.setOnline(true);
+    QTRY_COMPARE(sender.sent, QStringList() << "a" << "c" << "d");
+    /* The same tokens under new msgIds */
+    QCOMPARE(queue.tokenFor("m4"), a);
+    QCOMPARE(queue.tokenFor("m5"), c);
+    QCOMPARE(queue.pendingCount(), 3);
+}
+
+void TestOutgoingQueue::reportsRefused()
+{
+    FakeSender sender;
+    sender.refused << "b";
+    OutgoingQueue queue(&sender);
+    QSignalSpy failed(&queue, SIGNAL(messageFailed(QString,QString)));
+    queue.setOnline(true);
+    queue.enqueue(JID, "a");
+    QString b = queue.enqueue(JID, "b");
+    queue.enqueue(JID, "c");
+
+    QTRY_COMPARE(sender.sent.size(), 3);
+    QCOMPARE(failed.count(), 1);
+    QCOMPARE(failed[0][0].toString(), b);
+    QCOMPARE(failed[0][1].toString(), JID);
+    QCOMPARE(queue.pendingCount(), 2);
+
+    /* Refused messages are not sent again */
+    sender.sent.clear();
+    queue.setOnline(false);
+    queue.setOnline(true);
+    QTRY_COMPARE(sender.sent, QStringList() << "a" << "c");
+}
+
+void TestOutgoingQueue::tracksRecipients()
+{
+    FakeSender sender;
+    OutgoingQueue queue(&sender);
+    queue.enqueue("1@s.whatsapp.net", "a");
+    queue.setOnline(true);
+    QTRY_COMPARE(sender.sent.size(), 1);
+    queue.setOnline(false);
+    queue.enqueue("2@s.whatsapp.net", "b");
+    QCOMPARE(queue.jids(), QSet<QString>() << "1@s.whatsapp.net" << "2@s.whatsapp.net");
+
+    queue.setOnline(true);
+    QTRY_COMPARE(sender.sent.size(), 3);
+    queue.messageDelivered("m2");
+    queue.messageDelivered("m3");
+    QVERIFY(queue.jids().isEmpty());
+}
+
+/* More messages awaiting delivery than the queue tracks completion times for */
+void TestOutgoingQueue::keepsTokensUntilDelivered()
+{
+    static const int COUNT = 5000;
+    FakeSender sender;
+    OutgoingQueue queue(&sender);
+    QStringList tokens;
+    for(int i = 0; i < COUNT; ++i)
+        tokens << queue.enqueue(JID, QByteArray::number(i));
+    /* The server accepts right away, but delivers nothing */
+    connect(&queue, &OutgoingQueue::messageDispatched, [&queue] (const QString&, const QString& msgId) {
+        queue.messageAccepted(msgId);
+    });
+    queue.setOnline(true);
+    QTRY_COMPARE_WITH_TIMEOUT(sender.sent.size(), COUNT, 10000);
+
+    QCOMPARE(queue.tokenFor("m1"), tokens.first());
+    QCOMPARE(queue.tokenFor("m" + QString::number(COUNT)), tokens.last());
+
+    queue.messageDelivered("m1");
+    QCOMPARE(queue.tokenFor("m1"), QString("m1"));
+    QCOMPARE(queue.tokenFor("m2"), tokens[1]);
+}
+
+/* At most 1024 messages wait for the server's acceptance */
+void TestOutgoingQueue::pausesWhileUnaccepted()
+{
+    FakeSender sender;
+    OutgoingQueue queue(&sender);
+    for(int i = 0; i < 1100; ++i)
+        queue.enqueue(JID, QByteArray::number(i));
+    queue.setOnline(true);
+    QTRY_COMPARE(sender.sent.size(), 1024);
+    QTest::qWait(50);
+    QCOMPARE(sender.sent.size(), 1024);
+    QCOMPARE(queue.pendingCount(), 1100);
+
+    for(int i = 1; i <= 50; ++i)
+        queue.messageAccepted("m" + QString::number(i));
+    for(int i = 51; i <= 76; ++i)
+        queue.messageDelivered("m" + QString::number(i));
+    QTRY_COMPARE(sender.sent.size(), 1100);
+    QCOMPARE(sender.sent.last(), QString("1099"));
+    QCOMPARE(queue.pendingCount(), 1024);
+}
+
+/* Unaccepted and unsent messages fail in their original order */
+void TestOutgoingQueue::failsAll()
+{
+    FakeSender sender;
+    OutgoingQueue queue(&sender);
+    QSignalSpy failed(&queue, SIGNAL(messageFailed(QString,QString)));
+    queue.setOnline(true);
+    QString a = queue.enqueue(JID, "a");
+    queue.enqueue(JID, "b");
+    QString c = queue.enqueue(JID, "c");
+    QTRY_COMPARE(sender.sent.size(), 3);
+    queue.messageAccepted("m2");
+    queue.setOnline(false);
+    QString d = queue.enqueue(JID, "d");
+
+    queue.failAll();
+    QCOMPARE(failed.count(), 3);
+    QCOMPARE(failed[0][0].toString(), a);
+    QCOMPARE(failed[1][0].toString(), c);
+    QCOMPARE(failed[2][0].toString(), d);
+    QCOMPARE(queue.pendingCount(), 0);
+
+    sender.sent.clear();
+    queue.setOnline(true);
+    QTest::qWait(50);
+    QVERIFY(sender.sent.isEmpty());
+}
+
+/* A pasted batch or a bot's burst: enqueue returns right away, the sends go out in
+ * batches while the server accepts them */
+void TestOutgoingQueue::burst()
+{
+    static const int COUNT = 1000;
+    QBENCHMARK {
+        FakeSender sender;
+        OutgoingQueue queue(&sender);
+        connect(&queue, &OutgoingQueue::messageDispatched, [&queue] (const QString&, const QString& msgId) {
+            queue.messageAccepted(msgId);
+        });
+        queue.setOnline(true);
+        for(int i = 0; i < COUNT; ++i)
+            queue.enqueue(JID, "message " + QByteArray::number(i));
+        /* Not QTRY_COMPARE, that polls in steps of 50 ms */
+        while(sender.sent.size() < COUNT)
+            QCoreApplication::processEvents();
+        QCOMPARE(sender.batches.size(), (COUNT + 31) / 32);
+    }
+}
+
+QTEST_MAIN(TestOutgoingQueue)
+#include "tst_outgoingqueue.moc"
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QtTest>
+#include "pendingbudget.h"
+
+class TestPendingBudget : public QObject
+{
+    Q_OBJECT
+private slots:
+    void admitsWithinChannelLimit();
+    void spilledKeepOrder();
+    void sharesByteBudget();
+    void alwaysAdmitsOne();
+    void releaseRequeuesDelivered();
+    void forgetsEmptyChannels();
+};
+
+/* Pages spilled messages of channel in while there is room, as YSConnection does */
+static QStringList pageIn(PendingBudget& budget, uint channel, int size)
+{
+    QStringList pagedIn;
+    while(!budget.nextSpilled(channel).isEmpty() && budget.hasRoom(channel, size)) {
+        QString token = budget.nextSpilled(channel);
+        budget.deliver(channel, token, size);
+        budget.dropSpilled(channel);
+        pagedIn << token;
+    }
+    return pagedIn;
+}
+
+void TestPendingBudget::admitsWithinChannelLimit()
+{
+    PendingBudget budget(2, 1000);
+    QVERIFY(budget.admit(1, "a", 100));
+    QVERIFY(budget.admit(1, "b", 100));
+    QVERIFY(!budget.admit(1, "c", 100));
+    QCOMPARE(budget.deliveredCount(1), 2);
+    QCOMPARE(budget.spilledCount(1), 1);
+    QCOMPARE(budget.nextSpilled(1), QString("c"));
+    QCOMPARE(budget.messageCount(), 2);
+    QCOMPARE(budget.byteCount(), qint64(200));
+    QCOMPARE(budget.spillingChannels(), QList<uint>() << 1);
+    /* Other channels have their own limit */
+    QVERIFY(budget.admit(2, "d", 100));
+}
+
+/* Once a channel spills, later messages queue behind the spilled ones */
+void TestPendingBudget::spilledKeepOrder()
+{
+    PendingBudget budget(2, 1000);
+    budget.admit(1, "a", 100);
+    budget.admit(1, "b", 100);
+    budget.admit(1, "c", 100);
+    QVERIFY(budget.acknowledge("a"));
+    QVERIFY(!budget.admit(1, "d", 100));
+    QCOMPARE(budget.spilledCount(1), 2);
+
+    QCOMPARE(pageIn(budget, 1, 100), QStringList() << "c");
+    QCOMPARE(budget.nextSpilled(1), QString("d"));
+    QVERIFY(budget.acknowledge("b"));
+    QVERIFY(budget.acknowledge("c"));
+    QCOMPARE(pageIn(budget, 1, 100), QStringList() << "d");
+    QVERIFY(budget.spillingChannels().isEmpty());
+}
+
+void TestPendingBudget::sharesByteBudget()
+{
+    PendingBudget budget(10, 250);
+    QVERIFY(budget.admit(1, "a", 200));
+    QVERIFY(!budget.admit(1, "b", 100));
+    QVERIFY(budget.admit(2, "c", 100));
+    QVERIFY(!budget.admit(2, "d", 10));
+    QCOMPARE(budget.spillingChannels().size(), 2);
+    QCOMPARE(budget.byteCount(), qint64(300));
+
+    QVERIFY(budget.acknowledge("a"));
+    QCOMPARE(budget.byteCount(), qint64(100));
+    QCOMPARE(pageIn(budget, 1, 100), QStringList() << "b");
+    QCOMPARE(pageIn(budget, 2, 10), QStringList() << "d");
+    QCOMPARE(budget.byteCount(), qint64(210));
+}
+
+/* A channel may always hold one message, however large, so no chat starves */
+void TestPendingBudget::alwaysAdmitsOne()
+{
+    PendingBudget budget(10, 100);
+    QVERIFY(budget.admit(1, "a", 100));
+    QVERIFY(budget.admit(2, "huge", 1000));
+    QVERIFY(!budget.admit(2, "b", 1));
+    QCOMPARE(budget.byteCount(), qint64(1100));
+}
+
+/* A closed channel's unacked messages are delivered again before its spilled ones */
+void TestPendingBudget::releaseRequeuesDelivered()
+{
+    PendingBudget budget(2, 1000);
+    budget.admit(1, "a", 100);
+    budget.admit(1, "b", 100);
+    budget.admit(1, "c", 100);
+    budget.admit(2, "d", 100);
+    budget.release(1);
+
+    QCOMPARE(budget.deliveredCount(1), 0);
+    QCOMPARE(budget.spilledCount(1), 3);
+    QCOMPARE(budget.messageCount(), 1);
+    QCOMPARE(budget.byteCount(), qint64(100));
+    QVERIFY(!budget.acknowledge("a"));
+    QCOMPARE(pageIn(budget, 1, 100), QStringList() << "a" << "b");
+    QCOMPARE(budget.nextSpilled(1), QString("c"));
+
+    budget.release(3); // unknown channel
+    QCOMPARE(budget.messageCount(), 3);
+}
+
+void TestPendingBudget::forgetsEmptyChannels()
+{
+    PendingBudget budget(1, 1000);
+    budget.admit(1, "a", 100);
+    budget.admit(1, "b", 100);
+    QVERIFY(budget.contains(1));
+    QVERIFY(!budget.acknowledge("unknown"));
+
+    QVERIFY(budget.acknowledge("a"));
+    QVERIFY(budget.contains(1));
+    budget.dropSpilled(1);
+    QVERIFY(!budget.contains(1));
+    QCOMPARE(budget.nextSpilled(1), QString());
+    QCOMPARE(budget.messageCount(), 0);
+    QCOMPARE(budget.byteCount(), qint64(0));
+}
+
+QTEST_MAIN(TestPendingBudget)
+#include "tst_pendingbudget.moc"
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QtTest>
+#include "phonenumber.h"
+
+class TestPhoneNumber : public QObject
+{
+    Q_OBJECT
+private slots:
+    void normalize_data();
+    void normalize();
+    void normalizeAccount_data();
+    void normalizeAccount();
+    void countryCode_data();
+    void countryCode();
+    void fromUri_data();
+    void fromUri();
+    void throughput();
+};
+
+void TestPhoneNumber::normalize_data()
+{
+    QTest::addColumn<QString>("address");
+    QTest::addColumn<QString>("defaultCountryCode");
+    QTest::addColumn<QString>("digits");
+
+    QTest::newRow("international") << "+49 170 1234567" << "" << "491701234567";
+    QTest::newRow("00 prefix") << "0049 (170) 123-4567" << "" << "491701234567";
+    QTest::newRow("separators") << "+1 (555) 123.4567" << "" << "15551234567";
+    QTest::newRow("no-break space") << QString("+49") + QChar(0xa0) + "1701234567" << "" << "491701234567";
+    QTest::newRow("national") << "0170 1234567" << "49" << "491701234567";
+    QTest::newRow("national without trunk prefix") << "170/1234567" << "49" << "491701234567";
+    QTest::newRow("international ignores default") << "+44 20 7946 0958" << "49" << "442079460958";
+    QTest::newRow("national without default") << "0170 1234567" << "" << "";
+    QTest::newRow("letters") << "+49 170 12a4567" << "" << "";
+    QTest::newRow("second plus") << "++49 170 1234567" << "" << "";
+    QTest::newRow("plus inside") << "49+1701234567" << "" << "";
+    QTest::newRow("too short") << "+49 123" << "" << "";
+    QTest::newRow("too long") << "+49 1234 5678 9012 3456" << "" << "";
+    QTest::newRow("unassigned country code") << "+999 1234567" << "" << "";
+    QTest::newRow("empty") << "" << "49" << "";
+}
+
+void TestPhoneNumber::normalize()
+{
+    QFETCH(QString, address);
+    QFETCH(QString, defaultCountryCode);
+    QFETCH(QString, digits);
+    QCOMPARE(PhoneNumber::normalize(address, defaultCountryCode), digits);
+}
+
+void TestPhoneNumber::normalizeAccount_data()
+{
+    QTest::addColumn<QString>("account");
+    QTest::addColumn<QString>("digits");
+
+    QTest::newRow("digits") << "491701234567" << "491701234567";
+    QTest::newRow("plus") << "+491701234567" << "491701234567";
+    QTest::newRow("00 prefix") << "00491701234567" << "491701234567";
+    QTest::newRow("spaces") << "49 170 1234567" << "491701234567";
+    QTest::newRow("national") << "01701234567" << "";
+    QTest::newRow("unassigned country code") << "9991234567" << "";
+    QTest::newRow("letters") << "alice" << "";
+    QTest::newRow("empty") << "" << "";
+}
+
+void TestPhoneNumber::normalizeAccount()
+{
+    QFETCH(QString, account);
+    QFETCH(QString, digits);
+    QCOMPARE(PhoneNumber::normalizeAccount(account), digits);
+}
+
+void TestPhoneNumber::countryCode_data()
+{
+    QTest::addColumn<QString>("digits");
+    QTest::addColumn<QString>("code");
+
+    QTest::newRow("one digit") << "15551234567" << "1";
+    QTest::newRow("two digits") << "491701234567" << "49";
+    QTest::newRow("three digits") << "353861234567" << "353";
+    QTest::newRow("unassigned") << "9991234567" << "";
+    QTest::newRow("not digits") << "+491701234567" << "";
+}
+
+void TestPhoneNumber::countryCode()
+{
+    QFETCH(QString, digits);
+    QFETCH(QString, code);
+    QCOMPARE(PhoneNumber::countryCode(digits), code);
+}
+
+void TestPhoneNumber::fromUri_data()
+{
+    QTest::addColumn<QString>("uri");
+    QTest::addColumn<QString>("number");
+
+    QTest::newRow("plain") << "tel:+491701234567" << "+491701234567";
+    QTest::newRow("parameters") << "tel:0170-1234567;phone-context=+49" << "0170-1234567";
+    QTest::newRow("upper case scheme") << "TEL:+491701234567" << "+491701234567";
+    QTest::newRow("other scheme") << "sip:alice@example.com" << "";
+}
+
+void TestPhoneNumber::fromUri()
+{
+    QFETCH(QString, uri);
+    QFETCH(QString, number);
+    QCOMPARE(PhoneNumber::fromUri(uri), number);
+}
+
+/* A contact sync's worth of address book entries in the usual spellings */
+void TestPhoneNumber::throughput()
+{
+    QStringList addresses;
+    for(int i = 0; i < 5000; ++i) {
+        QString number = QString::number(1700000000LL + i*7919);
+        switch(i % 4) {
+        case 0: addresses << "+49 " + number.left(3) + " " + number.mid(3); break;
+        case 1: addresses << "0049 (" + number.left(3) + ") " + number.mid(3, 3) + "-" + number.mid(6); break;
+        case 2: addresses << "0" + number; break;
+        default: addresses << "+1 555." + number.right(7); break;
+        }
+    }
+
+    int valid = 0;
+    QBENCHMARK {
+        valid = 0;
+        for(const QString& address : addresses)
+            if(!PhoneNumber::normalize(address, "49").isEmpty())
+                ++valid;
+    }
+    QCOMPARE(valid, addresses.size());
+}
+
+QTEST_MAIN(TestPhoneNumber)
+#include "tst_phonenumber.moc"
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QElapsedTimer>
+#include <QSignalSpy>
+#include <QtTest>
+#include "timerwheel.h"
+
+static const int TICK_MS = 10;
+static const int SLOT_COUNT = 4;
+
+class TestTimerWheel : public QObject
+{
+    Q_OBJECT
+private slots:
+    void expiresAfterDelay();
+    void expiresInOrder();
+    void cancelled();
+    void rescheduleReplaces();
+    void waitsForFullRounds();
+};
+
+void TestTimerWheel::expiresAfterDelay()
+{
+    TimerWheel wheel(TICK_MS, SLOT_COUNT);
+    QSignalSpy expired(&wheel, SIGNAL(expired(QString)));
+    wheel.schedule("a", 25);
+    QVERIFY(wheel.isScheduled("a"));
+    QCOMPARE(wheel.size(), 1);
+
+    QTRY_COMPARE(expired.count(), 1);
+    QCOMPARE(expired.first().first().toString(), QString("a"));
+    QVERIFY(!wheel.isScheduled("a"));
+    QCOMPARE(wheel.size(), 0);
+}
+
+void TestTimerWheel::expiresInOrder()
+{
+    TimerWheel wheel(TICK_MS, SLOT_COUNT);
+    QSignalSpy expired(&wheel, SIGNAL(expired(QString)));
+    wheel.schedule("late", 60);
+    wheel.schedule("early", 20);
+
+    QTRY_COMPARE(expired.count(), 2);
+    QCOMPARE(expired[0].first().toString(), QString("early"));
+    QCOMPARE(expired[1].first().toString(), QString("late"));
+}
+
+void TestTimerWheel::cancelled()
+{
+    TimerWheel wheel(TICK_MS, SLOT_COUNT);
+    QSignalSpy expired(&wheel, SIGNAL(expired(QString)));
+    wheel.schedule("a", 20);
+    wheel.cancel("a");
+    wheel.cancel("unknown");
+    QVERIFY(!wheel.isScheduled("a"));
+
+    QTest::qWait(10 * TICK_MS);
+    QCOMPARE(expired.count(), 0);
+}
+
+void TestTimerWheel::rescheduleReplaces()
+{
+    TimerWheel wheel(TICK_MS, SLOT_COUNT);
+    QSignalSpy expired(&wheel, SIGNAL(expired(QString)));
+    wheel.schedule("a", 20);
+    wheel.schedule("a", 300);
+    QCOMPARE(wheel.size(), 1);
+
+    QTest::qWait(10 * TICK_MS);
+    QCOMPARE(expired.count(), 0);
+    QVERIFY(wheel.isScheduled("a"));
+    QTRY_COMPARE(expired.count(), 1);
+}
+
+/* Delays longer than a turn of the wheel must not expire on the first pass of their slot */
+void TestTimerWheel::waitsForFullRounds()
+{
+    TimerWheel wheel(TICK_MS, SLOT_COUNT);
+    QSignalSpy expired(&wheel, SIGNAL(expired(QString)));
+    QElapsedTimer timer;
+    timer.start();
+    wheel.schedule("a", 3 * SLOT_COUNT * TICK_MS);
+
+    QTRY_COMPARE(expired.count(), 1);
+    /* QTimer may fire a little early */
+    QVERIFY(timer.elapsed() >= 3 * SLOT_COUNT * TICK_MS * 9 / 10);
+}
+
+QTEST_MAIN(TestTimerWheel)
+#include "tst_timerwheel.moc"
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <QStringList>
+#include "timerwheel.h"
+
+TimerWheel::TimerWheel(int tickMs, int slotCount, QObject* parent)
+    : QObject(parent), mTickMs(tickMs), mCurrent(0), mSlots(slotCount)
+{
+    mTimer.setInterval(tickMs);
+    QObject::connect(&mTimer, SIGNAL(timeout()), this, SLOT(tick()));
+}
+
+void TimerWheel::schedule(const QString& key, int delayMs)
+{
+    cancel(key);
+
+    int ticks = qMax(1, (delayMs + mTickMs - 1) / mTickMs);
+    Entry entry;
+    entry.slot = (mCurrent + ticks) % mSlots.size();
+    entry.rounds = (ticks - 1) / mSlots.size();
+    mSlots[entry.slot].insert(key);
+    mEntries[key] = entry;
+
+    if(!mTimer.isActive())
+        mTimer.start();
+}
+
+void TimerWheel::cancel(const QString& key)
+{
+    auto i = mEntries.find(key);
+    if(i == mEntries.end())
+        return;
+    mSlots[i->slot].remove(key);
+    mEntries.erase(i);
+}
+
+void TimerWheel::tick()
+{
+    mCurrent = (mCurrent + 1) % mSlots.size();
+
+    QStringList expiredKeys;
+    QSet<QString>& slot = mSlots[mCurrent];
+    for(auto i = slot.begin(); i != slot.end();) {
+        Entry& entry = mEntries[*i];
+        if(entry.rounds > 0) {
+            --entry.rounds;
+            ++i;
+        } else {
+            expiredKeys << *i;
+            mEntries.remove(*i);
+            i = slot.erase(i);
+        }
+    }
+
+    if(mEntries.isEmpty())
+        mTimer.stop();
+
+    /* Handlers may schedule again, so only emit once the slot is consistent */
+    for(const QString& key : expiredKeys)
+        emit expired(key);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QTimer>
+#include <QVector>
+
+/*
+ * Hashed timer wheel: many coarse timeouts driven by a single QTimer.
+ *
+ * Timeouts are rounded up to the tick length. Scheduling and cancelling
+ * are O(1); each tick only looks at the keys in the current slot. The
+ * QTimer only runs while something is scheduled.
+ */
+class TimerWheel : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(TimerWheel)
+public:
+    TimerWheel(int tickMs, int slotCount, QObject* parent = 0);
+
+    /* (Re)schedules key to expire after delayMs */
+    void schedule(const QString& key, int delayMs);
+    void cancel(const QString& key);
+    bool isScheduled(const QString& key) const { return mEntries.contains(key); }
+    int size() const { return mEntries.size(); }
+
+signals:
+    void expired(const QString& key);
+
+private slots:
+    void tick();
+
+private:
+    struct Entry {
+        int slot;
+        /* Full turns of the wheel left before expiry */
+        int rounds;
+    };
+    int mTickMs;
+    int mCurrent;
+    QVector<QSet<QString> > mSlots;
+    QHash<QString,Entry> mEntries;
+    QTimer mTimer;
+};
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#include <QDateTime>
+#include <QDebug>
+#include <QRegularExpression>
+#include "pythoninterface.h"
+#include "trace.h"
+
+static const QByteArray TRACE_MAGIC = "WHTR";
+static const char TRACE_VERSION = 1;
+/* Pseudonyms are numbers no real account has */
+static const qint64 PSEUDONYM_BASE = 100000000000LL;
+static const QRegularExpression ADDRESS("(\\d+)(-\\d+)?@(s\\.whatsapp\\.net|g\\.us)");
+
+static void writeVarint(QByteArray& out, quint64 value)
+{
+    while(value >= 0x80) {
+        out.append(char(value | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+static quint64 zigzag(qint64 value)
+{
+    return (quint64(value) << 1) ^ quint64(value >> 63);
+}
+
+static qint64 unzigzag(quint64 value)
+{
+    return qint64(value >> 1) ^ -qint64(value & 1);
+}
+
+static void writeBytes(QByteArray& out, const QByteArray& bytes)
+{
+    writeVarint(out, bytes.size());
+    out.append(bytes);
+}
+
+static void writeValue(QByteArray& out, const QVariant& value)
+{
+    switch(value.userType()) {
+    case QMetaType::QString:
+        writeBytes(out, value.toString().toUtf8());
+        break;
+    case QMetaType::Bool:
+        out.append(char(value.toBool()));
+        break;
+    case QMetaType::Int:
+    case QMetaType::LongLong:
+        writeVarint(out, zigzag(value.toLongLong()));
+        break;
+    case QMetaType::UInt:
+        writeVarint(out, value.toUInt());
+        break;
+    default:
+        qWarning() << "TraceRecorder: cannot record arguments of type " << value.typeName();
+    }
+}
+
+TraceRecorder::TraceRecorder(const QString& filename, bool anonymize)
+    : mFile(filename), mAnonymize(anonymize), mLastEventMs(QDateTime::currentMSecsSinceEpoch())
+{
+    if(!mFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "TraceRecorder: cannot open " << filename << ": " << mFile.errorString();
+        return;
+    }
+    QByteArray header = TRACE_MAGIC;
+    header.append(TRACE_VERSION);
+    writeVarint(header, mLastEventMs);
+    mFile.write(header);
+    qDebug() << "TraceRecorder: recording to " << filename << (anonymize ? " (anonymized)" : "");
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    if(mFile.isOpen())
+        qDebug() << "TraceRecorder: recorded " << mFile.size() << " bytes to " << mFile.fileName();
+}
+
+void TraceRecorder::record(const QMetaMethod& signal, const QVariantList& args)
+{
+    if(!mFile.isOpen())
+        return;
+
+    QByteArray record;
+    auto number = mSignalNumbers.find(signal.methodIndex());
+    if(number == mSignalNumbers.end()) {
+        number = mSignalNumbers.insert(signal.methodIndex(), mSignalNumbers.size());
+        writeVarint(record, 0);
+        writeBytes(record, signal.methodSignature());
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    writeVarint(record, number.value() + 1);
+    writeVarint(record, qMax<qint64>(0, now - mLastEventMs));
+    mLastEventMs = qMax(mLastEventMs, now);
+
+    QList<QByteArray> names = signal.parameterNames();
+    for(int i = 0; i < args.size(); ++i) {
+        if(mAnonymize && args[i].userType() == QMetaType::QString) {
+            QString value = args[i].toString();
+            writeValue(record, names.value(i) == "mobilenumber" ? pseudonym(value) : anonymize(value));
+        } else {
+            writeValue(record, args[i]);
+        }
+    }
+    mFile.write(record);
+}
+
+/* Replaces the number in every address within value */
+QString TraceRecorder::anonymize(const QString& value)
+{
+    if(!value.contains('@'))
+        return value;
+    QString result;
+    int last = 0;
+    QRegularExpressionMatchIterator i = ADDRESS.globalMatch(value);
+    while(i.hasNext()) {
+        QRegularExpressionMatch match = i.next();
+        result += value.midRef(last, match.capturedStart() - last);
+        result += pseudonym(match.captured(1)) + match.captured(2) + '@' + match.captured(3);
+        last = match.capturedEnd();
+    }
+    result += value.midRef(last);
+    return result;
+}
+
+QString TraceRecorder::pseudonym(const QString& number)
+{
+    auto i = mPseudonyms.find(number);
+    if(i == mPseudonyms.end())
+        i = mPseudonyms.insert(number, QString::number(PSEUDONYM_BASE + mPseudonyms.size()));
+    return i.value();
+}
+
+TraceReplayer::TraceReplayer(const QString& filename, double speed, YowsupInterface* target, QObject* parent)
+    : QObject(parent), mTarget(target), mSpeed(speed), mValid(false), mPos(0),
+      mHasNext(false), mNextSignal(-1), mNextOffsetMs(0), mEventCount(0)
+{
+    mTimer.setSingleShot(true);
+    QObject::connect(&mTimer, SIGNAL(timeout()), this, SLOT(emitDueEvents()));
+
+    QFile file(filename);
+    if(!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "TraceReplayer: cannot open " << filename << ": " << file.errorString();
+        return;
+    }
+    mData = file.readAll();
+    mPos = TRACE_MAGIC.size() + 1;
+    quint64 startMs;
+    if(!mData.startsWith(TRACE_MAGIC) || mData.size() < mPos || mData[mPos - 1] != TRACE_VERSION
+       || !readVarint(&startMs)) {
+        qWarning() << "TraceReplayer: " << filename << " is not a trace";
+        return;
+    }
+    mValid = true;
+    mHasNext = readNext();
+    qDebug() << "TraceReplayer: replaying " << filename << ", recorded "
+             << QDateTime::fromMSecsSinceEpoch(startMs).toString() << ", speed " << speed;
+}
+
+void TraceReplayer::start()
+{
+    mClock.start();
+    scheduleNext();
+}
+
+void TraceReplayer::scheduleNext()
+{
+    if(!mHasNext) {
+        qDebug() << "TraceReplayer: replayed " << mEventCount << " events in " << mClock.elapsed() << " ms";
+        emit finished();
+        return;
+    }
+    qint64 delay = mSpeed > 0 ? qint64(mNextOffsetMs / mSpeed) - mClock.elapsed() : 0;
+    mTimer.start(int(qMax<qint64>(0, delay)));
+}
+
+void TraceReplayer::emitDueEvents()
+{
+    do {
+        emitEvent();
+        mHasNext = readNext();
+    } while(mHasNext && mSpeed > 0 && mNextOffsetMs / mSpeed <= mClock.elapsed());
+    scheduleNext();
+}
+
+void TraceReplayer::emitEvent()
+{
+    ++mEventCount;
+    const Signal& signal = mSignals[mNextSignal];
+    if(!signal.method.isValid())
+        return;
+    QGenericArgument args[10];
+    for(int i = 0; i < mNextArgs.size() && i < 10; ++i)
+        args[i] = QGenericArgument(mNextArgs[i].typeName(), mNextArgs[i].constData());
+    mTarget->setLastEventMs(QDateTime::currentMSecsSinceEpoch());
+    signal.method.invoke(mTarget, Qt::DirectConnection, args[0], args[1], args[2], args[3], args[4],
+                         args[5], args[6], args[7], args[8], args[9]);
+}
+
+/* Reads up to the next event. Returns false at the end of the trace */
+bool TraceReplayer::readNext()
+{
+    quint64 code;
+    while(readVarint(&code)) {
+        if(code == 0) {
+            quint64 size;
+            if(!readVarint(&size) || size > quint64(mData.size() - mPos))
+                break;
+            QByteArray signature = mData.mid(mPos, size);
+            mPos += size;
+            Signal signal;
+            int index = mTarget->metaObject()->indexOfSignal(signature.constData());
+            if(index >= 0)
+                signal.method = mTarget->metaObject()->method(index);
+            else
+                qWarning() << "TraceReplayer: skipping events of unknown signal " << signature;
+            QByteArray parameters = signature.mid(signature.indexOf('(') + 1);
+            parameters.chop(1);
+            if(!parameters.isEmpty())
+                for(const QByteArray& type : parameters.split(','))
+                    signal.types << QMetaType::type(type.constData());
+            mSignals << signal;
+            continue;
+        }
+
+        quint64 delta;
+        if(code > quint64(mSignals.size()) || !readVarint(&delta))
+            break;
+        mNextSignal = code - 1;
+        mNextOffsetMs += delta;
+        mNextArgs.clear();
+        for(int type : mSignals[mNextSignal].types) {
+            QVariant value;
+            if(!readValue(type, &value))
+                break;
+            mNextArgs << value;
+        }
+        if(mNextArgs.size() == mSignals[mNextSignal].types.size())
+            return true;
+        break;
+    }
+    /* The recorder may have been killed in the middle of a record */
+    if(mPos < mData.size())
+        qWarning() << "TraceReplayer: ignoring the rest of the trace after offset " << mPos;
+    return false;
+}
+
+bool TraceReplayer::readVarint(quint64* value)
+{
+    *value = 0;
+    for(int shift = 0; shift < 64 && mPos < mData.size(); shift += 7) {
+        uchar byte = mData[mPos++];
+        *value |= quint64(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool TraceReplayer::readValue(int type, QVariant* value)
+{
+    quint64 raw;
+    switch(type) {
+    case QMetaType::QString:
+        if(!readVarint(&raw) || raw > quint64(mData.size() - mPos))
+            return false;
+        *value = QString::fromUtf8(mData.constData() + mPos, int(raw));
+        mPos += raw;
+        return true;
+    case QMetaType::Bool:
+        if(mPos >= mData.size())
+            return false;
+        *value = mData[mPos++] != 0;
+        return true;
+    case QMetaType::Int:
+        if(!readVarint(&raw))
+            return false;
+        *value = int(unzigzag(raw));
+        return true;
+    case QMetaType::LongLong:
+        if(!readVarint(&raw))
+            return false;
+        *value = qlonglong(unzigzag(raw));
+        return true;
+    case QMetaType::UInt:
+        if(!readVarint(&raw))
+            return false;
+        *value = uint(raw);
+        return true;
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2013 Matthias Gehre <gehre.matthias@gmail.com>
+ *
+ * This work is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This work is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this work; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#pragma once
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMetaMethod>
+#include <QObject>
+#include <QTimer>
+#include <QVariantList>
+#include <QVector>
+
+class YowsupInterface;
+
+/*
+ * Binary traces of the signals yowsup emits, to rerun real traffic without a network.
+ *
+ * A trace starts with TRACE_MAGIC, a version byte and the start time. Every record
+ * starts with a varint code: 0 introduces the next signal, followed by its signature;
+ * n > 0 is an event of signal n-1, followed by the varint ms since the previous event
+ * and the arguments. Strings are a varint length and UTF-8, ints and qlonglongs are
+ * zigzag varints, uints varints and bools one byte. The argument types come from the
+ * signature, so a trace stays readable when signals are added or removed.
+ */
+
+/* Writes a trace. Only record() is called from the reader thread */
+class TraceRecorder
+{
+    Q_DISABLE_COPY(TraceRecorder)
+public:
+    /* With anonymize, phone numbers in addresses and mobilenumber arguments are replaced
+     * by pseudonyms that are stable within the trace. Message bodies and push names
+     * are recorded as they are */
+    TraceRecorder(const QString& filename, bool anonymize);
+    ~TraceRecorder();
+
+    bool isOpen() const { return mFile.isOpen(); }
+    void record(const QMetaMethod& signal, const QVariantList& args);
+
+private:
+    QString anonymize(const QString& value);
+    QString pseudonym(const QString& number);
+
+    QFile mFile;
+    bool mAnonymize;
+    qint64 mLastEventMs;
+    /* Method index -> signal number in the trace */
+    QHash<int,uint> mSignalNumbers;
+    QHash<QString,QString> mPseudonyms;
+};
+
+/*
+ * Emits the events of a trace on a YowsupInterface, at the recorded pace divided
+ * by speed. With speed 0, one event is emitted per event loop iteration.
+ */
+class TraceReplayer : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(TraceReplayer)
+public:
+    TraceReplayer(const QString& filename, double speed, YowsupInterface* target, QObject* parent = 0);
+
+    bool isValid() const { return mValid; }
+    bool isRunning() const { return mClock.isValid(); }
+    void start();
+    int eventCount() const { return mEventCount; }
+
+signals:
+    void finished();
+
+private slots:
+    void emitDueEvents();
+
+private:
+    bool readNext();
+    bool readVarint(quint64* value);
+    bool readValue(int type, QVariant* value);
+    void emitEvent();
+    void scheduleNext();
+
+    struct Signal {
+        /* Invalid if this build does not have the signal */
+        QMetaMethod method;
+        QVector<int> types;
+    };
+    YowsupInterface* mTarget;
+    double mSpeed;
+    bool mValid;
+    QByteArray mData;
+    int mPos;
+    QVector<Signal> mSignals;
+    /* The event to emit next */
+    bool mHasNext;
+    int mNextSignal;
+    qint64 mNextOffsetMs;
+    QVariantList mNextArgs;
+    int mEventCount;
+    QElapsedTimer mClock;
+    QTimer mTimer;
+};